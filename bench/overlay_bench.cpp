@@ -0,0 +1,1040 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <map>
+#include <cstdio>
+#include <csignal>
+#include <climits>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <grpcpp/grpcpp.h>
+#include "data.grpc.pb.h"
+#include "overlay.grpc.pb.h"
+#include <nlohmann/json.hpp>
+#include "vectorized_dataset.h"
+#include "query_engine.h"
+#include "rollup_cube.h"
+#include "partition_summary.h"
+#include "snapshot.h"
+#include "id_set.h"
+#include "metrics.h"
+
+using json = nlohmann::json;
+
+// Benchmark and load generator for the overlay. Every measurement is a named number; a run can be
+// saved as a baseline and later runs compared against it. Names ending in _qps, _mbps or _mrows_s
+// are better when higher, all others (_us, _ms, _pct) when lower.
+//
+//   overlay_bench gen <rows> <csv> [seed]
+//       Write a synthetic collision CSV with the schema of the NYC file.
+//   overlay_bench micro <csv> [--save F] [--baseline F] [--tolerance PCT]
+//       Time loadFromFileRange and the search kernels in this process.
+//   overlay_bench run [--config C] [--rows N] [--seed S] [--workdir D] [--port-offset K]
+//                     [--mode closed|open] [--clients N] [--qps Q] [--seconds T]
+//                     [--thresholds 0,1,2,5] [--cached] [--save F] [--baseline F] [--tolerance PCT]
+//       Start every node of the config's topology on a synthetic CSV of N rows, drive SendData at
+//       the entry node and report latency quantiles, throughput and each node's CPU use.
+//       "closed" runs N clients that each wait for their reply; "open" sends at Q queries per
+//       second whatever the replies do, and measures latency from the intended send time.
+//       Queries draw their threshold from the list and, unless --cached, a random date window so
+//       the result caches miss.
+//   overlay_bench verify [--rows N] [--seed S] [--workdir D]
+//       Check the fast paths against plain references and exit 1 on any mismatch: every SIMD scan
+//       kernel the CPU supports against the scalar test, the CSV tokenizer and loader on a fixture
+//       of quoted, multi-line and malformed rows, IdSet unions, single and batched evaluation and
+//       the rollup cube against a row-by-row count, and a snapshot round trip. The parallel scans
+//       use the kernels SCAN_ISA allows.
+
+using Results = std::map<std::string, double>;
+
+namespace {
+
+// Synthetic data ---------------------------------------------------------------------------------
+
+const char* kHeader =
+    "CRASH DATE,CRASH TIME,BOROUGH,ZIP CODE,LATITUDE,LONGITUDE,LOCATION,ON STREET NAME,CROSS STREET NAME,"
+    "OFF STREET NAME,NUMBER OF PERSONS INJURED,NUMBER OF PERSONS KILLED,NUMBER OF PEDESTRIANS INJURED,"
+    "NUMBER OF PEDESTRIANS KILLED,NUMBER OF CYCLIST INJURED,NUMBER OF CYCLIST KILLED,NUMBER OF MOTORIST INJURED,"
+    "NUMBER OF MOTORIST KILLED,CONTRIBUTING FACTOR VEHICLE 1,CONTRIBUTING FACTOR VEHICLE 2,"
+    "CONTRIBUTING FACTOR VEHICLE 3,CONTRIBUTING FACTOR VEHICLE 4,CONTRIBUTING FACTOR VEHICLE 5,COLLISION_ID,"
+    "VEHICLE TYPE CODE 1,VEHICLE TYPE CODE 2,VEHICLE TYPE CODE 3,VEHICLE TYPE CODE 4,VEHICLE TYPE CODE 5\n";
+
+const std::vector<std::string> kBoroughs = {"", "BROOKLYN", "QUEENS", "MANHATTAN", "BRONX", "STATEN ISLAND"};
+const std::vector<std::string> kStreets = {"", "BROADWAY", "ATLANTIC AVENUE", "QUEENS BOULEVARD", "FLATBUSH AVENUE",
+                                           "GRAND CONCOURSE", "NORTHERN BOULEVARD", "3 AVENUE", "BELT PARKWAY"};
+const std::vector<std::string> kFactors = {"", "Unspecified", "Driver Inattention/Distraction", "Following Too Closely",
+                                           "Failure to Yield Right-of-Way", "Unsafe Speed", "Backing Unsafely"};
+const std::vector<std::string> kVehicles = {"", "Sedan", "Station Wagon/Sport Utility Vehicle", "Taxi", "Bike", "Bus",
+                                            "Pick-up Truck", "Box Truck"};
+
+// Mostly zero, occasionally a few: roughly the shape of the real injury and fatality counts.
+int smallCount(std::mt19937_64& rng, double pNonZero) {
+    std::uniform_real_distribution<double> u(0, 1);
+    int n = 0;
+    while (n < 20 && u(rng) < (n == 0 ? pNonZero : 0.35)) n++;
+    return n;
+}
+
+bool generateCsv(size_t rows, const std::string& path, uint64_t seed) {
+    std::string tmp = path + ".tmp";
+    FILE* out = std::fopen(tmp.c_str(), "w");
+    if (!out) return false;
+    std::fputs(kHeader, out);
+    std::mt19937_64 rng(seed);
+    auto pick = [&](const std::vector<std::string>& v) -> const std::string& { return v[rng() % v.size()]; };
+    std::uniform_int_distribution<int> day(VectorizedDataSet::daysFromCivil(2012, 7, 1), VectorizedDataSet::daysFromCivil(2024, 12, 31));
+    std::uniform_real_distribution<double> lat(40.50, 40.91), lon(-74.25, -73.70);
+    std::string buffer;
+    char line[1024];
+    for (size_t i = 0; i < rows; i++) {
+        std::string date = VectorizedDataSet::formatDate(day(rng));   // YYYY-MM-DD
+        int counts[8];
+        for (int c = 0; c < 8; c++) counts[c] = smallCount(rng, c % 2 == 0 ? 0.25 : 0.01);
+        char position[64] = "", location[80] = "";
+        if (rng() % 10 != 0) {
+            double y = lat(rng), x = lon(rng);
+            std::snprintf(position, sizeof(position), "%.6f,%.6f", y, x);
+            std::snprintf(location, sizeof(location), "\"(%.6f, %.6f)\"", y, x);
+        } else {
+            std::strcpy(position, ",");
+        }
+        char zip[8] = "";
+        if (rng() % 4 != 0) std::snprintf(zip, sizeof(zip), "%d", 10001 + int(rng() % 1500));
+        std::snprintf(line, sizeof(line),
+                      "%.2s/%.2s/%.4s,%d:%02d,%s,%s,%s,%s,%s,%s,%s,%d,%d,%d,%d,%d,%d,%d,%d,%s,%s,%s,%s,%s,%zu,%s,%s,%s,%s,%s\n",
+                      date.c_str() + 5, date.c_str() + 8, date.c_str(), int(rng() % 24), int(rng() % 60), pick(kBoroughs).c_str(),
+                      zip, position, location, pick(kStreets).c_str(), pick(kStreets).c_str(), pick(kStreets).c_str(),
+                      counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6], counts[7],
+                      pick(kFactors).c_str(), pick(kFactors).c_str(), pick(kFactors).c_str(), pick(kFactors).c_str(),
+                      pick(kFactors).c_str(), size_t(4000000) + i, pick(kVehicles).c_str(), pick(kVehicles).c_str(),
+                      pick(kVehicles).c_str(), pick(kVehicles).c_str(), pick(kVehicles).c_str());
+        buffer += line;
+        if (buffer.size() > (1 << 20)) {
+            std::fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+    }
+    bool ok = std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+    ok = std::fclose(out) == 0 && ok;
+    return ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// Options and baselines --------------------------------------------------------------------------
+
+struct Options {
+    std::map<std::string, std::string> values;
+    std::vector<std::string> positional;
+
+    static Options parse(int argc, char** argv, int from) {
+        Options o;
+        for (int i = from; i < argc; i++) {
+            std::string a = argv[i];
+            if (a.rfind("--", 0) != 0) {
+                o.positional.push_back(a);
+            } else if (a == "--cached") {
+                o.values[a.substr(2)] = "1";
+            } else if (i + 1 < argc) {
+                o.values[a.substr(2)] = argv[++i];
+            }
+        }
+        return o;
+    }
+    std::string get(const std::string& key, const std::string& fallback) const {
+        auto it = values.find(key);
+        return it == values.end() ? fallback : it->second;
+    }
+    double number(const std::string& key, double fallback) const { return std::stod(get(key, std::to_string(fallback))); }
+};
+
+bool higherIsBetter(const std::string& name) {
+    for (const char* suffix : {"_qps", "_mbps", "_mrows_s"}) {
+        std::string s = suffix;
+        if (name.size() >= s.size() && name.compare(name.size() - s.size(), s.size(), s) == 0) return true;
+    }
+    return false;
+}
+
+// Print the results, save them and compare them to a baseline. Returns the process exit code:
+// 2 when some measurement is worse than the baseline by more than the tolerance.
+int report(const Results& results, const Options& opts) {
+    double tolerance = opts.number("tolerance", 10);
+    json baseline;
+    std::string baselinePath = opts.get("baseline", "");
+    if (!baselinePath.empty()) {
+        std::ifstream in(baselinePath);
+        baseline = in.is_open() ? json::parse(in, nullptr, false) : json();
+        if (!baseline.is_object()) {
+            std::cerr << "Cannot read baseline " << baselinePath << std::endl;
+            baseline = json::object();
+        }
+    }
+    int regressions = 0;
+    for (const auto& [name, value] : results) {
+        std::printf("%-32s %14.3f", name.c_str(), value);
+        if (baseline.contains(name) && baseline[name].is_number() && baseline[name].get<double>() != 0) {
+            double before = baseline[name].get<double>();
+            double change = 100.0 * (value - before) / before;
+            bool worse = higherIsBetter(name) ? change < -tolerance : change > tolerance;
+            regressions += worse;
+            std::printf("   baseline %14.3f  %+7.1f%%%s", before, change, worse ? "  REGRESSION" : "");
+        }
+        std::printf("\n");
+    }
+    std::string savePath = opts.get("save", "");
+    if (!savePath.empty()) {
+        std::ofstream out(savePath);
+        out << json(results).dump(2) << std::endl;
+        if (!out) std::cerr << "Cannot write " << savePath << std::endl;
+    }
+    if (regressions) std::printf("%d measurement(s) regressed by more than %.0f%%\n", regressions, tolerance);
+    return regressions ? 2 : 0;
+}
+
+// Microbenchmarks --------------------------------------------------------------------------------
+
+// Median time of f in microseconds, over at least 'minRuns' runs and 'minSeconds' seconds.
+template <typename F>
+double medianUs(F&& f, int minRuns = 5, double minSeconds = 0.5) {
+    std::vector<double> times;
+    auto start = std::chrono::steady_clock::now();
+    while (int(times.size()) < minRuns || std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < minSeconds) {
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        times.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+        if (times.size() >= 10000) break;
+    }
+    std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+    return times[times.size() / 2];
+}
+
+int microbenchmarks(const Options& opts) {
+    if (opts.positional.empty()) {
+        std::cerr << "usage: overlay_bench micro <csv> [--save F] [--baseline F] [--tolerance PCT]" << std::endl;
+        return 1;
+    }
+    const std::string csv = opts.positional[0];
+    size_t total = VectorizedDataSet::countLines(csv);
+    std::error_code ec;
+    double megabytes = double(std::filesystem::file_size(csv, ec)) / 1e6;
+    if (total == 0 || ec) {
+        std::cerr << "Cannot read " << csv << std::endl;
+        return 1;
+    }
+    std::printf("%zu rows, %.1f MB, %d threads, %s kernels\n", total, megabytes, VectorizedDataSet::get_num_threads_used(),
+                ScanKernels::isaName(ScanKernels::isa()));
+
+    Results r;
+    volatile size_t sink = 0;   // keeps results alive so the calls are not optimized away
+    double loadUs = medianUs([&] {
+        VectorizedDataSet ds;
+        ds.loadFromFileRange(csv, 0, total);
+        sink = sink + ds.size();
+    }, 3, 0);
+    r["load_file_range_ms"] = loadUs / 1e3;
+    r["load_file_range_mbps"] = megabytes / (loadUs / 1e6);
+
+    VectorizedDataSet ds;
+    ds.loadFromFileRange(csv, 0, total);
+    const size_t n = ds.size();
+    auto rate = [&](double us) { return double(n) / us; };   // million rows per second
+
+    int32_t from = VectorizedDataSet::parseDate("2019-01-01"), to = VectorizedDataSet::parseDate("2019-12-31");
+    double us = medianUs([&] { sink = sink + ScanKernels::countInRange(ds.crash_date.data(), n, from, to); });
+    r["count_in_range_us"] = us;
+    r["count_in_range_mrows_s"] = rate(us);
+    us = medianUs([&] { sink = sink + ScanKernels::selectInRange(ds.number_of_persons_injured.data(), n, 1, INT32_MAX).count(); });
+    r["select_in_range_us"] = us;
+    r["select_in_range_mrows_s"] = rate(us);
+    us = medianUs([&] { sink = sink + ScanKernels::indicesInRange(ds.number_of_persons_injured.data(), n, 1, INT32_MAX).size(); });
+    r["indices_in_range_us"] = us;
+    r["indices_in_range_mrows_s"] = rate(us);
+    us = medianUs([&] { sink = sink + ds.searchByInjuryCountParallel(1).size(); });
+    r["search_by_injury_us"] = us;
+
+    // The python client's grouped query: three aggregates per borough over one year's injury crashes.
+    query::Query grouped;
+    grouped.set_group_by(query::BOROUGH);
+    query::Predicate* p = grouped.add_where();
+    p->set_column(query::NUMBER_OF_PERSONS_INJURED);
+    p->mutable_range()->set_min(1);
+    p = grouped.add_where();
+    p->set_column(query::CRASH_DATE);
+    p->mutable_date_window()->set_from("2021-01-01");
+    p->mutable_date_window()->set_to("2021-12-31");
+    grouped.add_aggregates()->set_op(query::COUNT);
+    for (query::AggregateOp op : {query::SUM, query::MAX}) {
+        query::Aggregate* a = grouped.add_aggregates();
+        a->set_op(op);
+        a->set_column(query::NUMBER_OF_PERSONS_INJURED);
+    }
+    us = medianUs([&] { sink = sink + QueryEngine::evaluate(ds, grouped).groups_size(); });
+    r["evaluate_grouped_us"] = us;
+    r["evaluate_grouped_mrows_s"] = rate(us);
+    us = medianUs([&] { sink = sink + QueryEngine::select(ds, grouped).size(); });
+    r["select_grouped_us"] = us;
+
+    // Injury crashes within 500 m of an intersection (Atlantic and Flatbush), from the spatial grid.
+    query::Query nearby;
+    p = nearby.add_where();
+    p->set_column(query::LOCATION);
+    p->mutable_radius()->set_latitude(40.6842);
+    p->mutable_radius()->set_longitude(-73.9777);
+    p->mutable_radius()->set_meters(500);
+    p = nearby.add_where();
+    p->set_column(query::NUMBER_OF_PERSONS_INJURED);
+    p->mutable_range()->set_min(1);
+    us = medianUs([&] { sink = sink + QueryEngine::totalRows(QueryEngine::evaluate(ds, nearby)); });
+    r["evaluate_radius_us"] = us;
+
+    // A dashboard query, injuries and deaths per borough over one year, scanned and read from the rollup cube.
+    query::Query dashboard;
+    dashboard.set_group_by(query::BOROUGH);
+    *dashboard.add_where() = grouped.where(1);
+    dashboard.add_aggregates()->set_op(query::COUNT);
+    for (query::Column c : {query::NUMBER_OF_PERSONS_INJURED, query::NUMBER_OF_PERSONS_KILLED}) {
+        query::Aggregate* a = dashboard.add_aggregates();
+        a->set_op(query::SUM);
+        a->set_column(c);
+    }
+    us = medianUs([&] { sink = sink + QueryEngine::evaluate(ds, dashboard).groups_size(); });
+    r["evaluate_dashboard_us"] = us;
+    RollupCube cube;
+    us = medianUs([&] {
+        cube = RollupCube::of(ds, 0);
+        sink = sink + cube.cells.size();
+    }, 3, 0);
+    r["rollup_build_ms"] = us / 1e3;
+    us = medianUs([&] { sink = sink + cube.answer(dashboard).groups_size(); });
+    r["rollup_dashboard_us"] = us;
+    return report(r, opts);
+}
+
+// The overlay under load -------------------------------------------------------------------------
+
+struct NodeProcess {
+    std::string name;
+    std::string address;
+    pid_t pid = -1;
+};
+
+// CPU seconds used so far by a process, or -1 where /proc is not available.
+double cpuSeconds(pid_t pid) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    if (!std::getline(in, stat)) return -1;
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));   // after "pid (comm) "
+    std::string f;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> f; i++) {
+        if (i == 14) utime = std::stoull(f);
+        if (i == 15) stime = std::stoull(f);
+    }
+    return double(utime + stime) / double(sysconf(_SC_CLK_TCK));
+}
+
+pid_t startNode(const std::string& binary, const std::string& name, const std::string& config, const std::string& log) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGTERM);   // do not outlive the benchmark
+#endif
+    int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    execl(binary.c_str(), binary.c_str(), name.c_str(), config.c_str(), static_cast<char*>(nullptr));
+    std::perror("exec overlay_node");
+    _exit(127);
+}
+
+void stopNodes(std::vector<NodeProcess>& nodes) {
+    for (const auto& n : nodes)
+        if (n.pid > 0) kill(n.pid, SIGTERM);
+    for (auto& n : nodes)
+        if (n.pid > 0) waitpid(n.pid, nullptr, 0);
+    nodes.clear();
+}
+
+// True once every node answers Stats, i.e. has loaded its partition and is serving.
+bool waitReady(const std::vector<NodeProcess>& nodes, std::chrono::seconds limit) {
+    auto giveUp = std::chrono::steady_clock::now() + limit;
+    for (const auto& n : nodes) {
+        auto stub = overlay::OverlayComm::NewStub(grpc::CreateChannel(n.address, grpc::InsecureChannelCredentials()));
+        while (true) {
+            grpc::ClientContext ctx;
+            ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(1));
+            overlay::StatsRequest request;
+            overlay::StatsReply reply;
+            if (stub->Stats(&ctx, request, &reply).ok()) break;
+            int status;
+            if (waitpid(n.pid, &status, WNOHANG) == n.pid) {
+                std::cerr << "Node " << n.name << " exited during startup; see its log" << std::endl;
+                return false;
+            }
+            if (std::chrono::steady_clock::now() > giveUp) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+    }
+    return true;
+}
+
+// Draws the queries of a run: a threshold from the mix and, to defeat the caches, a random window
+// of crash dates wide enough to keep the scans realistic.
+class QueryMix {
+public:
+    QueryMix(std::vector<int> thresholds, bool cached, uint64_t seed) : thresholds(std::move(thresholds)), cached(cached), rng(seed) {}
+
+    dataportal::DataRequest next() {
+        std::lock_guard<std::mutex> lock(m);
+        int threshold = thresholds[rng() % thresholds.size()];
+        dataportal::DataRequest request;
+        request.set_id(std::to_string(sequence++));
+        if (cached) {
+            request.set_payload(std::to_string(threshold));
+            return request;
+        }
+        query::Query q = QueryEngine::fromThreshold(threshold);
+        int first = VectorizedDataSet::daysFromCivil(2012, 7, 1), last = VectorizedDataSet::daysFromCivil(2024, 12, 31);
+        int from = first + int(rng() % uint64_t(last - first - 365));
+        query::Predicate* p = q.add_where();
+        p->set_column(query::CRASH_DATE);
+        p->mutable_date_window()->set_from(VectorizedDataSet::formatDate(from));
+        p->mutable_date_window()->set_to(VectorizedDataSet::formatDate(from + 365 + int(rng() % 1460)));
+        *request.mutable_query() = std::move(q);
+        return request;
+    }
+
+private:
+    std::mutex m;
+    const std::vector<int> thresholds;
+    const bool cached;
+    std::mt19937_64 rng;
+    uint64_t sequence = 0;
+};
+
+struct LoadResult {
+    LatencyHistogram latency;
+    std::atomic<uint64_t> ok{0}, failed{0};
+    double seconds = 0;
+};
+
+void closedLoop(const std::string& entry, QueryMix& mix, int clients, double seconds, LoadResult& out) {
+    auto channel = grpc::CreateChannel(entry, grpc::InsecureChannelCredentials());
+    auto stop = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < clients; c++) {
+        threads.emplace_back([&] {
+            auto stub = dataportal::DataPortal::NewStub(channel);
+            while (std::chrono::steady_clock::now() < stop) {
+                dataportal::DataRequest request = mix.next();
+                grpc::ClientContext ctx;
+                ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(30));
+                dataportal::Ack reply;
+                auto t0 = std::chrono::steady_clock::now();
+                grpc::Status status = stub->SendData(&ctx, request, &reply);
+                auto dt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0);
+                out.latency.record(dt.count());
+                (status.ok() ? out.ok : out.failed)++;
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    out.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Poisson arrivals at 'qps'. Latency counts from the intended send time, so a stalled server
+// shows up in the quantiles instead of silently slowing the generator down.
+void openLoop(const std::string& entry, QueryMix& mix, double qps, double seconds, LoadResult& out) {
+    auto channel = grpc::CreateChannel(entry, grpc::InsecureChannelCredentials());
+    auto stub = dataportal::DataPortal::NewStub(channel);
+    struct Call {
+        grpc::ClientContext ctx;
+        dataportal::DataRequest request;
+        dataportal::Ack reply;
+        std::chrono::steady_clock::time_point intended;
+    };
+    std::atomic<int> outstanding{0};
+    std::mt19937_64 rng(7);
+    std::exponential_distribution<double> gap(qps);
+    auto start = std::chrono::steady_clock::now(), next = start;
+    auto stop = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    while (next < stop) {
+        std::this_thread::sleep_until(next);
+        auto* call = new Call;
+        call->request = mix.next();
+        call->intended = next;
+        call->ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(30));
+        outstanding++;
+        stub->async()->SendData(&call->ctx, &call->request, &call->reply, [call, &out, &outstanding](grpc::Status status) {
+            auto dt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - call->intended);
+            out.latency.record(dt.count());
+            (status.ok() ? out.ok : out.failed)++;
+            delete call;
+            outstanding--;
+        });
+        next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(gap(rng)));
+    }
+    while (outstanding > 0) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    out.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::vector<int> parseThresholds(const std::string& list) {
+    std::vector<int> out;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+        if (!item.empty()) out.push_back(std::stoi(item));
+    return out.empty() ? std::vector<int>{1} : out;
+}
+
+int runOverlay(const Options& opts, const std::string& self) {
+    const std::string workdir = std::filesystem::absolute(opts.get("workdir", "/tmp/overlay_bench")).string();
+    const size_t rows = size_t(opts.number("rows", 200000));
+    const uint64_t seed = uint64_t(opts.number("seed", 1));
+    const int portOffset = int(opts.number("port-offset", 0));
+    std::filesystem::create_directories(workdir);
+
+    std::ifstream in(opts.get("config", "../config/overlay_config.json"));
+    json config = in.is_open() ? json::parse(in, nullptr, false) : json();
+    if (config.is_discarded() || !config.contains("nodes")) {
+        std::cerr << "Cannot read overlay config " << opts.get("config", "../config/overlay_config.json") << std::endl;
+        return 1;
+    }
+
+    // The same topology on a synthetic file, kept between runs of the same size and seed.
+    std::string csv = workdir + "/collisions_" + std::to_string(rows) + "_" + std::to_string(seed) + ".csv";
+    if (!std::filesystem::exists(csv)) {
+        std::cout << "Generating " << rows << " rows into " << csv << std::endl;
+        if (!generateCsv(rows, csv, seed)) {
+            std::cerr << "Cannot write " << csv << std::endl;
+            return 1;
+        }
+    }
+    config["data_file"] = csv;
+    std::vector<NodeProcess> nodes;
+    std::string entry;
+    for (auto& [name, n] : config["nodes"].items()) {
+        n.erase("data_file");
+        n["port"] = n.value("port", 0) + portOffset;
+        std::string address = n.value("host", std::string("localhost")) + ":" + std::to_string(n["port"].get<int>());
+        nodes.push_back({name, address});
+        if (n.value("entry", false)) entry = address;
+    }
+    if (entry.empty()) {
+        std::cerr << "The config has no entry node" << std::endl;
+        return 1;
+    }
+    std::string configPath = workdir + "/overlay_config.json";
+    std::ofstream(configPath) << config.dump(2) << std::endl;
+
+    // Leaves first, so a parent's first summary poll finds its children up.
+    std::string binary = (std::filesystem::path(self).parent_path() / "overlay_node").string();
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it)
+        it->pid = startNode(binary, it->name, configPath, workdir + "/" + it->name + ".log");
+    if (!waitReady(nodes, std::chrono::seconds(300))) {
+        std::cerr << "The overlay did not come up; logs are in " << workdir << std::endl;
+        stopNodes(nodes);
+        return 1;
+    }
+
+    const std::string mode = opts.get("mode", "closed");
+    const double seconds = opts.number("seconds", 10);
+    QueryMix mix(parseThresholds(opts.get("thresholds", "0,1,2,3,5")), opts.values.count("cached"), seed);
+    LoadResult warmup;
+    closedLoop(entry, mix, 1, 1.0, warmup);   // children's summaries, connections, page cache
+
+    std::vector<double> cpuBefore;
+    for (const auto& n : nodes) cpuBefore.push_back(cpuSeconds(n.pid));
+    LoadResult load;
+    if (mode == "open") {
+        openLoop(entry, mix, opts.number("qps", 200), seconds, load);
+    } else {
+        closedLoop(entry, mix, int(opts.number("clients", 8)), seconds, load);
+    }
+
+    Results r;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        double after = cpuSeconds(nodes[i].pid);
+        if (after >= 0 && cpuBefore[i] >= 0) r["cpu_" + nodes[i].name + "_pct"] = 100.0 * (after - cpuBefore[i]) / load.seconds;
+    }
+    stopNodes(nodes);
+
+    LatencyHistogram::Snapshot s = load.latency.snapshot();
+    r["achieved_qps"] = double(load.ok) / load.seconds;
+    r["errors"] = double(load.failed);
+    r["latency_p50_us"] = double(s.quantile(0.5));
+    r["latency_p95_us"] = double(s.quantile(0.95));
+    r["latency_p99_us"] = double(s.quantile(0.99));
+    r["latency_max_us"] = double(s.maxUs);
+    std::printf("%s loop, %zu rows, %llu queries (%llu failed) in %.1f s\n", mode.c_str(), rows,
+                (unsigned long long)(load.ok + load.failed), (unsigned long long)load.failed.load(), load.seconds);
+    return report(r, opts);
+}
+
+// Verification -----------------------------------------------------------------------------------
+
+// Counts checks and prints the first failures.
+struct Checker {
+    size_t checks = 0, failures = 0;
+
+    bool expect(bool ok, const std::string& what) {
+        checks++;
+        if (!ok && ++failures <= 20) std::cerr << "MISMATCH " << what << std::endl;
+        return ok;
+    }
+};
+
+std::string rangeName(int32_t lo, int32_t hi) { return "[" + std::to_string(lo) + ", " + std::to_string(hi) + "]"; }
+
+// Every block kernel the CPU supports against a row-by-row test, on lengths around the vector
+// widths and ranges at the edges of int32; then the parallel scans, with and without a zone map.
+void verifyKernels(Checker& check, std::mt19937_64& rng) {
+    const std::vector<std::pair<int32_t, int32_t>> ranges = {{0, 0}, {-3, 2}, {1, INT32_MAX}, {INT32_MIN, -1},
+                                                             {INT32_MIN, INT32_MAX}, {INT32_MAX, INT32_MAX}, {INT32_MIN, INT32_MIN}};
+    auto value = [&] {
+        uint64_t r = rng() % 16;
+        return r == 0 ? INT32_MIN : r == 1 ? INT32_MAX : int32_t(rng() % 11) - 5;
+    };
+    for (ScanKernels::Isa isa : {ScanKernels::SCALAR, ScanKernels::AVX2, ScanKernels::AVX512}) {
+        if (!ScanKernels::supports(isa)) continue;
+        for (size_t n : {0, 1, 7, 8, 9, 15, 16, 17, 31, 33, 63, 64, 65, 127, 129, 1000, 4099}) {
+            std::vector<int32_t> v(n);
+            for (auto& x : v) x = value();
+            for (auto [lo, hi] : ranges) {
+                std::vector<uint64_t> words((n + 63) / 64, 0);
+                std::vector<RowId> ids;
+                for (size_t i = 0; i < n; i++) {
+                    if (v[i] < lo || v[i] > hi) continue;
+                    words[i / 64] |= uint64_t(1) << (i % 64);
+                    ids.push_back(RowId(1000 + i));
+                }
+                std::string what = std::string(ScanKernels::isaName(isa)) + " n=" + std::to_string(n) + " " + rangeName(lo, hi);
+                check.expect(ScanKernels::countBlock(v.data(), n, lo, hi, isa) == ids.size(), what + " count");
+                std::vector<uint64_t> bits(words.size(), ~uint64_t(0));
+                ScanKernels::selectBlock(v.data(), n, lo, hi, bits.data(), isa);
+                check.expect(bits == words, what + " select");
+                std::vector<RowId> out(n + 16);
+                out.resize(ScanKernels::compactBlock(v.data(), n, lo, hi, 1000, out.data(), isa));
+                check.expect(out == ids, what + " compact");
+            }
+        }
+    }
+
+    // Three and a half blocks, the second all zeros so that a zone map takes it whole.
+    size_t n = 3 * ScanKernels::kBlockRows + ScanKernels::kBlockRows / 2 + 7;
+    std::vector<int32_t> v(n);
+    for (size_t i = 0; i < n; i++) v[i] = i / ScanKernels::kBlockRows == 1 ? 0 : value();
+    ZoneMap zones;
+    zones.build(v.data(), n, [](int32_t) { return false; });
+    for (auto [lo, hi] : ranges) {
+        std::vector<RowId> ids;
+        for (size_t i = 0; i < n; i++)
+            if (lo <= v[i] && v[i] <= hi) ids.push_back(RowId(i));
+        std::string what = std::string(ScanKernels::isaName(ScanKernels::isa())) + " parallel " + rangeName(lo, hi);
+        for (const auto& plan : {ScanKernels::allBlocks(n), zones.plan(lo, hi)}) {
+            check.expect(ScanKernels::countInRange(v.data(), n, lo, hi, plan) == ids.size(), what + " count");
+            SelectionBitmap bits = ScanKernels::selectInRange(v.data(), n, lo, hi, plan);
+            bool same = bits.size() == n && bits.count() == ids.size();
+            for (RowId id : ids) same = same && bits.test(id);
+            check.expect(same, what + " select");
+            check.expect(ScanKernels::indicesInRange(v.data(), n, lo, hi, plan) == ids, what + " indices");
+        }
+    }
+}
+
+// RFC 4180 rows of a CSV text, read one byte at a time: a reference for the tokenizer.
+struct CsvReference {
+    std::vector<std::vector<std::string>> rows;
+    std::vector<size_t> ends;   // just past each row's newline
+};
+
+CsvReference parseCsv(const std::string& text) {
+    CsvReference ref;
+    std::vector<std::string> row(1);
+    bool quoted = false;
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (quoted) {
+            if (c != '"') row.back() += c;
+            else if (i + 1 < text.size() && text[i + 1] == '"') row.back() += text[i++];
+            else quoted = false;
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            row.emplace_back();
+        } else if (c == '\n') {
+            if (!row.back().empty() && row.back().back() == '\r') row.back().pop_back();
+            ref.rows.push_back(std::move(row));
+            ref.ends.push_back(i + 1);
+            row.assign(1, std::string());
+        } else {
+            row.back() += c;
+        }
+    }
+    return ref;
+}
+
+// Collision rows in the export's format with the cases the loader must get right: quoted fields
+// holding commas, doubled quotes and newlines (long ones crossing 64-byte blocks), empty quoted
+// fields, CRLF line ends, short rows and unparsable numbers.
+std::string csvFixture(size_t rows, std::mt19937_64& rng, size_t& shortRows, size_t& badFields) {
+    std::string text = kHeader;
+    for (size_t i = 0; i < rows; i++) {
+        std::string on = "MAIN STREET", cross, borough = "BROOKLYN", injured = std::to_string(i % 4), end = "\n";
+        switch (i % 8) {
+        case 1: on = "\"BROADWAY, UPPER\""; break;
+        case 2: on = "\"THE \"\"BIG\"\"\nROAD\""; break;
+        case 3:
+            cross = "\"";
+            for (size_t k = 0, len = 40 + rng() % 150; k < len; k++) {
+                uint64_t r = rng() % 10;
+                cross += r == 0 ? ',' : r == 1 ? '\n' : r == 2 ? ' ' : char('A' + rng() % 26);
+            }
+            cross += "\"";
+            break;
+        case 4:
+            text += "03/19/2024,2:16,QUEENS\n";
+            shortRows++;
+            continue;
+        case 5: injured = "x"; badFields++; break;
+        case 6: end = "\r\n"; break;
+        case 7: borough = i % 16 == 7 ? "\"\"" : "\"BRONX\""; break;
+        }
+        text += "03/19/2024,2:16," + borough + ",11201,40.7,-73.9,\"(40.7, -73.9)\"," + on + "," + cross + ",," + injured +
+                ",0,0,0,0,0,1,0,Unspecified,,,,," + std::to_string(5000000 + i) + ",Sedan,,,,Bike" + end;
+    }
+    return text;
+}
+
+// The tokenizer and the loader on the fixture, against parseCsv().
+void verifyCsv(Checker& check, const std::string& workdir, std::mt19937_64& rng) {
+    size_t shortRows = 0, badFields = 0;
+    const std::string text = csvFixture(40000, rng, shortRows, badFields);
+    const CsvReference ref = parseCsv(text);
+    const char *begin = text.data(), *end = begin + text.size();
+
+    for (ScanKernels::Isa isa : {ScanKernels::AVX2, ScanKernels::AVX512}) {
+        if (!ScanKernels::supports(isa)) continue;
+        bool same = true;
+        for (size_t shift : {0, 13})
+            for (size_t at = shift; at < text.size(); at += 64) {
+                size_t len = std::min<size_t>(64, text.size() - at);
+                CsvTokenizer::Masks a = CsvTokenizer::classifyWith(isa, begin + at, len);
+                CsvTokenizer::Masks b = CsvTokenizer::classifyWith(ScanKernels::SCALAR, begin + at, len);
+                same = same && a.quote == b.quote && a.comma == b.comma && a.newline == b.newline;
+            }
+        check.expect(same, std::string(ScanKernels::isaName(isa)) + " csv classify");
+    }
+    check.expect(CsvTokenizer::countRows(begin, end) == ref.rows.size(), "csv countRows");
+    for (int k = 0; k < 1000; k++) {
+        size_t cut = rng() % (text.size() + 1);
+        auto after = std::upper_bound(ref.ends.begin(), ref.ends.end(), cut);
+        size_t expected = after == ref.ends.begin() ? 0 : *(after - 1);
+        check.expect(size_t(CsvTokenizer::lastRowEnd(begin, begin + cut) - begin) == expected, "csv lastRowEnd at " + std::to_string(cut));
+    }
+
+    const std::string path = workdir + "/verify_fixture.csv";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << text;
+    }
+    const size_t rows = ref.rows.size() - 1;
+    check.expect(VectorizedDataSet::countLines(path) == rows, "csv countLines");
+    VectorizedDataSet ds;
+    ds.loadFromFileRange(path, 0, rows);
+    check.expect(ds.csvErrors.rows == shortRows && ds.csvErrors.fields == badFields, "csv errors");
+    if (check.expect(ds.size() == rows, "csv rows loaded")) {
+        size_t wrong = 0;
+        for (size_t r = 0; r < rows; r++) {
+            const std::vector<std::string>& f = ref.rows[r + 1];
+            auto field = [&](size_t i) { return i < f.size() ? f[i] : std::string(); };
+            bool same = ds.borough[r] == field(2) && ds.on_street_name[r] == field(7) && ds.cross_street_name[r] == field(8) &&
+                        ds.vehicle_type_code_5[r] == field(28);
+            if (f.size() == VectorizedDataSet::kNumColumns)
+                same = same && ds.collision_id[r] == field(23) && (field(10) == "x" || ds.number_of_persons_injured[r] == std::stoi(field(10)));
+            wrong += !same;
+        }
+        check.expect(wrong == 0, "csv fields of " + std::to_string(wrong) + " rows");
+    }
+
+    // Shares by rows and by hash hold every row once between them.
+    std::vector<std::string> all;
+    for (size_t r = 0; r < ds.size(); r++) all.emplace_back(ds.collision_id[r]);
+    std::sort(all.begin(), all.end());
+    for (PartitionSpec::Method method : {PartitionSpec::ROWS, PartitionSpec::HASH}) {
+        std::vector<std::string> ids;
+        for (size_t part = 0; part < 3; part++) {
+            PartitionSpec spec{{2, 1, 1}, part, method, "borough", {}};
+            VectorizedDataSet share;
+            share.loadPartition(path, spec);
+            for (size_t r = 0; r < share.size(); r++) ids.emplace_back(share.collision_id[r]);
+        }
+        std::sort(ids.begin(), ids.end());
+        check.expect(ids == all, std::string("csv shares by ") + (method == PartitionSpec::ROWS ? "rows" : "hash"));
+    }
+    std::filesystem::remove(path);
+}
+
+// Unions of sparse and dense containers against std::set_union.
+void verifyIdSets(Checker& check, std::mt19937_64& rng) {
+    auto fill = [&](std::vector<uint32_t>& ids) {
+        for (size_t h = 0, highs = rng() % 4; h < highs; h++) {
+            uint32_t high = uint32_t(rng() % 6);
+            size_t count = rng() % 3 == 0 ? 5000 + rng() % 20000 : rng() % 300;
+            for (size_t k = 0; k < count; k++) ids.push_back(high << 16 | uint32_t(rng() % 65536));
+        }
+    };
+    for (int round = 0; round < 50; round++) {
+        std::vector<uint32_t> a, b;
+        fill(a);
+        fill(b);
+        query::IdSet merged = IdSets::of(a);
+        IdSets::merge(merged, IdSets::of(b));
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        std::vector<uint32_t> expected, got;
+        std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+        expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+        IdSets::forEach(merged, [&](uint32_t id) { got.push_back(id); });
+        check.expect(got == expected && IdSets::count(merged) == expected.size(), "IdSet union, round " + std::to_string(round));
+    }
+}
+
+// Rows and SUMs per non-empty group.
+using GroupTotals = std::map<std::string, std::pair<uint64_t, std::vector<int64_t>>>;
+
+GroupTotals totalsOf(const query::QueryResult& r, const query::Query& q) {
+    GroupTotals out;
+    for (const auto& g : r.groups()) {
+        if (g.rows() == 0) continue;
+        auto& t = out[g.key()];
+        t.first = g.rows();
+        for (int i = 0; i < q.aggregates_size() && i < g.values_size(); i++)
+            if (q.aggregates(i).op() == query::SUM) t.second.push_back(g.values(i).int_value());
+    }
+    return out;
+}
+
+// The same, row by row. Handles the predicates and aggregates of verifyQueries() only.
+GroupTotals bruteForce(const VectorizedDataSet& ds, const query::Query& q) {
+    auto counts = [&](query::Column c) -> const Column<int>& {
+        return c == query::NUMBER_OF_PERSONS_KILLED ? ds.number_of_persons_killed : ds.number_of_persons_injured;
+    };
+    GroupTotals out;
+    for (size_t r = 0; r < ds.size(); r++) {
+        bool ok = true;
+        for (const auto& p : q.where()) {
+            if (p.test_case() == query::Predicate::kRange) {
+                int v = counts(p.column())[r];
+                ok = ok && (!p.range().has_min() || v >= p.range().min()) && (!p.range().has_max() || v <= p.range().max());
+            } else if (p.test_case() == query::Predicate::kDateWindow) {
+                int32_t d = ds.crash_date[r];
+                ok = ok && d != VectorizedDataSet::kNullDate &&
+                     (p.date_window().from().empty() || d >= VectorizedDataSet::parseDate(p.date_window().from())) &&
+                     (p.date_window().to().empty() || d <= VectorizedDataSet::parseDate(p.date_window().to()));
+            } else {
+                std::string_view v = p.column() == query::BOROUGH ? ds.borough[r] : ds.contributing_factor_vehicle_1[r];
+                if (p.test_case() == query::Predicate::kEquals) ok = ok && v == p.equals();
+                else ok = ok && std::find(p.in().values().begin(), p.in().values().end(), v) != p.in().values().end();
+            }
+        }
+        if (!ok) continue;
+        std::string key = q.group_by() == query::BOROUGH ? std::string(ds.borough[r])
+                        : q.group_by() == query::CONTRIBUTING_FACTOR_VEHICLE_1 ? std::string(ds.contributing_factor_vehicle_1[r]) : "";
+        auto& t = out[key];
+        t.first++;
+        size_t s = 0;
+        for (const auto& a : q.aggregates()) {
+            if (a.op() != query::SUM) continue;
+            if (t.second.size() <= s) t.second.push_back(0);
+            int v = counts(a.column())[r];
+            if (v != INT32_MIN) t.second[s] += v;
+            s++;
+        }
+    }
+    return out;
+}
+
+// Single and batched evaluation, and the rollup cube where it answers, against bruteForce().
+void verifyQueries(Checker& check, const VectorizedDataSet& ds) {
+    auto window = [](query::Query& q, const char* from, const char* to) {
+        query::Predicate* p = q.add_where();
+        p->set_column(query::CRASH_DATE);
+        p->mutable_date_window()->set_from(from);
+        p->mutable_date_window()->set_to(to);
+    };
+    auto sums = [](query::Query& q) {
+        q.add_aggregates()->set_op(query::COUNT);
+        for (query::Column c : {query::NUMBER_OF_PERSONS_INJURED, query::NUMBER_OF_PERSONS_KILLED}) {
+            query::Aggregate* a = q.add_aggregates();
+            a->set_op(query::SUM);
+            a->set_column(c);
+        }
+    };
+    std::vector<query::Query> queries;
+    for (int t : {0, 1, 2, 5}) queries.push_back(QueryEngine::fromThreshold(t));
+    query::Query q;
+    q.set_group_by(query::BOROUGH);
+    window(q, "2021-01-01", "2021-12-31");
+    sums(q);
+    queries.push_back(q);
+    q.Clear();
+    q.set_group_by(query::CONTRIBUTING_FACTOR_VEHICLE_1);
+    window(q, "2016-01-01", "");
+    query::Predicate* p = q.add_where();
+    p->set_column(query::BOROUGH);
+    p->mutable_in()->add_values("QUEENS");
+    p->mutable_in()->add_values("BRONX");
+    sums(q);
+    queries.push_back(q);
+    q.Clear();
+    p = q.add_where();
+    p->set_column(query::BOROUGH);
+    p->set_equals("");
+    p = q.add_where();
+    p->set_column(query::NUMBER_OF_PERSONS_INJURED);
+    p->mutable_range()->set_min(1);
+    p->mutable_range()->set_max(3);
+    sums(q);
+    queries.push_back(q);
+    q.Clear();
+    q.set_group_by(query::BOROUGH);
+    sums(q);
+    queries.push_back(q);
+
+    std::vector<const query::Query*> batch;
+    for (const auto& query : queries) batch.push_back(&query);
+    std::vector<query::QueryResult> batched = QueryEngine::evaluateBatch(ds, batch);
+    RollupCube cube = RollupCube::of(ds, 0);
+    for (size_t i = 0; i < queries.size(); i++) {
+        GroupTotals expected = bruteForce(ds, queries[i]);
+        std::string what = "query " + std::to_string(i);
+        check.expect(totalsOf(QueryEngine::evaluate(ds, queries[i]), queries[i]) == expected, what + " evaluate");
+        check.expect(i < batched.size() && totalsOf(batched[i], queries[i]) == expected, what + " batch");
+        if (RollupCube::answers(queries[i])) check.expect(totalsOf(cube.answer(queries[i]), queries[i]) == expected, what + " cube");
+    }
+}
+
+// A snapshot of 'ds' reopened: the same columns, index answers, summary and cube; a damaged one
+// fails verify().
+void verifySnapshot(Checker& check, const VectorizedDataSet& ds, const std::string& csv, const std::string& workdir) {
+    const std::string path = workdir + "/verify.snap";
+    SnapshotSource source;
+    if (!check.expect(SnapshotSource::of(csv, "verify", source), "snapshot source")) return;
+    PartitionDerived written{PartitionSummaries::of(ds, 0), std::make_shared<const RollupCube>(RollupCube::of(ds, 0))};
+    if (!check.expect(DatasetSnapshot::write(ds, path, source, ds.size(), 0, written), "snapshot write")) return;
+    VectorizedDataSet copy;
+    PartitionDerived read;
+    if (!check.expect(DatasetSnapshot::open(copy, path, source, nullptr, nullptr, &read), "snapshot open")) return;
+    check.expect(DatasetSnapshot::verify(path), "snapshot checksums");
+
+    size_t differ = 0;
+    ds.forEachColumn([&](const char* name, const auto& col) {
+        using Col = std::decay_t<decltype(col)>;
+        const Col& other = *std::get<const Col*>(copy.column(name));
+        if (other.size() != col.size()) {
+            differ++;
+        } else if constexpr (std::is_same_v<Col, StringColumn> || std::is_same_v<Col, DictColumn<uint16_t>>) {
+            for (size_t i = 0; i < col.size(); i++) differ += col[i] != other[i];
+        } else {
+            differ += std::memcmp(col.data(), other.data(), col.bytes()) != 0;
+        }
+    });
+    check.expect(differ == 0, "snapshot columns");
+    for (int t : {0, 1, 2, 5}) {
+        check.expect(copy.countByInjuryCount(t) == ds.countByInjuryCount(t) &&
+                     copy.searchByInjuryCountParallel(t) == ds.searchByInjuryCountParallel(t), "snapshot value index at " + std::to_string(t));
+    }
+    query::Query nearby;
+    query::Predicate* p = nearby.add_where();
+    p->set_column(query::LOCATION);
+    p->mutable_radius()->set_latitude(40.6842);
+    p->mutable_radius()->set_longitude(-73.9777);
+    p->mutable_radius()->set_meters(2000);
+    p = nearby.add_where();
+    p->set_column(query::CRASH_DATE);
+    p->mutable_date_window()->set_from("2019-01-01");
+    p->mutable_date_window()->set_to("2019-12-31");
+    check.expect((copy.spatialIndex() != nullptr) == (ds.spatialIndex() != nullptr) &&
+                 QueryEngine::select(copy, nearby) == QueryEngine::select(ds, nearby), "snapshot spatial grid and zone maps");
+    query::PartitionSummary summary = written.summary;
+    summary.set_data_version(read.summary.data_version());
+    check.expect(summary.SerializeAsString() == read.summary.SerializeAsString(), "snapshot summary");
+    const RollupCube &a = *written.cube, &b = *read.cube;
+    check.expect(a.boroughs == b.boroughs && a.factors == b.factors && a.cells.size() == b.cells.size() &&
+                 std::memcmp(a.cells.data(), b.cells.data(), a.bytes()) == 0, "snapshot cube");
+
+    // Damage the last byte, in the cube's cells.
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(-1, std::ios::end);
+    char last = char(file.get());
+    file.seekp(-1, std::ios::end);
+    file.put(char(last ^ 1));
+    file.close();
+    check.expect(!DatasetSnapshot::verify(path), "snapshot damage detected");
+    std::filesystem::remove(path);
+}
+
+int verify(const Options& opts) {
+    const std::string workdir = std::filesystem::absolute(opts.get("workdir", "/tmp/overlay_bench")).string();
+    const size_t rows = size_t(opts.number("rows", 100000));
+    const uint64_t seed = uint64_t(opts.number("seed", 1));
+    std::filesystem::create_directories(workdir);
+    std::mt19937_64 rng(seed);
+    Checker check;
+    verifyKernels(check, rng);
+    verifyCsv(check, workdir, rng);
+    verifyIdSets(check, rng);
+
+    std::string csv = workdir + "/collisions_" + std::to_string(rows) + "_" + std::to_string(seed) + ".csv";
+    if (!std::filesystem::exists(csv) && !generateCsv(rows, csv, seed)) {
+        std::cerr << "Cannot write " << csv << std::endl;
+        return 1;
+    }
+    VectorizedDataSet ds;
+    ds.loadFromFileRange(csv, 0, VectorizedDataSet::countLines(csv));
+    verifyQueries(check, ds);
+    verifySnapshot(check, ds, csv, workdir);
+
+    std::printf("%zu checks, %zu mismatches (%s kernels in the parallel scans)\n", check.checks, check.failures,
+                ScanKernels::isaName(ScanKernels::isa()));
+    return check.failures ? 1 : 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string command = argc > 1 ? argv[1] : "";
+    Options opts = Options::parse(argc, argv, 2);
+    if (command == "gen" && opts.positional.size() >= 2) {
+        uint64_t seed = opts.positional.size() > 2 ? std::stoull(opts.positional[2]) : 1;
+        return generateCsv(std::stoull(opts.positional[0]), opts.positional[1], seed) ? 0 : 1;
+    }
+    if (command == "micro") return microbenchmarks(opts);
+    if (command == "verify") return verify(opts);
+    if (command == "run") {
+        signal(SIGPIPE, SIG_IGN);
+        std::error_code ec;
+        std::filesystem::path self = std::filesystem::canonical("/proc/self/exe", ec);   // overlay_node sits next to it
+        return runOverlay(opts, ec ? std::string(argv[0]) : self.string());
+    }
+    std::cerr << "usage: overlay_bench gen <rows> <csv> [seed]\n"
+                 "       overlay_bench micro <csv> [--save F] [--baseline F] [--tolerance PCT]\n"
+                 "       overlay_bench run [--config C] [--rows N] [--mode closed|open] [--clients N] [--qps Q]\n"
+                 "                         [--seconds T] [--thresholds 0,1,2,5] [--cached] [--save F] [--baseline F]\n"
+                 "       overlay_bench verify [--rows N] [--seed S] [--workdir D]"
+              << std::endl;
+    return 1;
+}
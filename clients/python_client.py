@@ -1,6 +1,7 @@
 import grpc
 import data_pb2
 import data_pb2_grpc
+import query_pb2
 
 def run():
     channel = grpc.insecure_channel('localhost:50051')
@@ -9,5 +10,52 @@ def run():
     response = stub.SendData(data_pb2.DataRequest(id="42", payload="1"))
     print("Ack:", response.message)
 
+    # A structured query: injury crashes in 2021 per borough, with the total injured and the worst crash.
+    q = query_pb2.Query(group_by=query_pb2.BOROUGH)
+    q.where.add(column=query_pb2.NUMBER_OF_PERSONS_INJURED, range=query_pb2.Range(min=1))
+    q.where.add(column=query_pb2.CRASH_DATE,
+                date_window=query_pb2.DateWindow(**{"from": "2021-01-01", "to": "2021-12-31"}))
+    q.aggregates.add(op=query_pb2.COUNT)
+    q.aggregates.add(op=query_pb2.SUM, column=query_pb2.NUMBER_OF_PERSONS_INJURED)
+    q.aggregates.add(op=query_pb2.MAX, column=query_pb2.NUMBER_OF_PERSONS_INJURED)
+    response = stub.SendData(data_pb2.DataRequest(id="43", query=q))
+    print("Ack:", response.message)
+    for g in response.result.groups:
+        print(" ", g.key or "(none)", g.rows, [v.int_value for v in g.values])
+    # Where the query's time went, per node and phase.
+    print("Trace %016x:" % response.trace_id)
+    for s in sorted(response.spans, key=lambda s: s.start_us):
+        print("  %-2s %-10s %8d us %s" % (s.node, s.phase, s.duration_us, s.detail))
+
+    # Injuries and deaths per contributing factor in 2021, answered from the merged rollup cube
+    # (COUNT and SUM per day, borough and factor) without scanning any partition.
+    per_factor = query_pb2.Query(group_by=query_pb2.CONTRIBUTING_FACTOR_VEHICLE_1)
+    per_factor.where.add(column=query_pb2.CRASH_DATE,
+                         date_window=query_pb2.DateWindow(**{"from": "2021-01-01", "to": "2021-12-31"}))
+    per_factor.aggregates.add(op=query_pb2.SUM, column=query_pb2.NUMBER_OF_PERSONS_INJURED)
+    per_factor.aggregates.add(op=query_pb2.SUM, column=query_pb2.NUMBER_OF_PERSONS_KILLED)
+    response = stub.SendData(data_pb2.DataRequest(id="44", query=per_factor))
+    print("Ack:", response.message)
+
+    # Injury crashes within 500 m of an intersection, read from each node's spatial grid.
+    near = query_pb2.Query()
+    near.where.add(column=query_pb2.LOCATION,
+                   radius=query_pb2.GeoRadius(latitude=40.6842, longitude=-73.9777, meters=500))
+    near.where.add(column=query_pb2.NUMBER_OF_PERSONS_INJURED, range=query_pb2.Range(min=1))
+    response = stub.SendData(data_pb2.DataRequest(id="45", query=near))
+    print("Ack:", response.message)
+
+    # The matching rows themselves, streamed in columnar batches. Reading slowly holds the servers back.
+    rows = query_pb2.RowQuery(query=q, batch_rows=1000, limit=5000,
+                              columns=[query_pb2.CRASH_DATE, query_pb2.BOROUGH, query_pb2.NUMBER_OF_PERSONS_INJURED])
+    fetched = 0
+    for batch in stub.FetchRows(rows):
+        if batch.partial:
+            print("  rows missing from", list(batch.missing))
+            continue
+        fetched += batch.rows
+        print("  batch of", batch.rows, "rows from", batch.origin)
+    print("Fetched", fetched, "rows")
+
 if __name__ == '__main__':
     run()
@@ -6,4 +6,4 @@ protoc -I=proto \
   --cpp_out=generated \
   --grpc_out=generated \
   --plugin=protoc-gen-grpc=$(which grpc_cpp_plugin) \
-  proto/data.proto proto/overlay.proto
+  proto/query.proto proto/data.proto proto/overlay.proto
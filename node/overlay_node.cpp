@@ -0,0 +1,740 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <grpcpp/grpcpp.h>
+#include "data.grpc.pb.h"
+#include "overlay.grpc.pb.h"
+#include <nlohmann/json.hpp>
+#include "vectorized_dataset.h"
+#include "snapshot.h"
+#include "row_stream.h"
+#include "result_cache.h"
+#include "partition_summary.h"
+#include "partition_epochs.h"
+#include "rollup_cube.h"
+#include "scan_batcher.h"
+#include "trace.h"
+#include "metrics.h"
+#include <omp.h>
+#include <cstdio>
+#include <filesystem>
+
+using grpc::Server;
+using grpc::ServerBuilder;
+using grpc::Status;
+
+using dataportal::DataPortal;
+using dataportal::DataRequest;
+using dataportal::Ack;
+
+using overlay::OverlayComm;
+using overlay::OverlayRequest;
+using overlay::OverlayAck;
+
+using json = nlohmann::json;
+
+// One node of the overlay. Its name selects an entry of overlay_config.json, which gives its port,
+// children, thread budget, whether it serves clients, and its share of the data file.
+struct NodeConfig {
+    std::string name;
+    std::string listenAddress;
+    int threads = 1;                     // scan pool workers, and the OpenMP budget for loading
+    bool pinWorkers = false;             // bind each scan pool worker to one CPU
+    bool entry = false;                  // also serve DataPortal to clients
+    std::vector<std::vector<std::string>> children;   // addresses of the child nodes, each followed by its replicas
+    std::string dataFile;                // empty when the node holds no partition
+    PartitionSpec partition;
+    std::string traceFile;               // Chrome trace export of the recorded spans, when set
+    std::string metricsFile;             // Prometheus text dump of the metrics, when set
+    std::chrono::milliseconds tail{0};   // how often to look for rows appended to the data file; 0: never
+    std::chrono::milliseconds deadline{5000};   // time budget of a query whose caller set none
+    std::chrono::microseconds batchWindow{0};   // how long a local scan waits for others to share its pass
+    grpc_compression_algorithm compression = GRPC_COMPRESS_NONE;   // of large replies and row streams to the parent
+};
+
+// Replies smaller than this are sent uncompressed even when compression is on.
+const size_t kCompressAbove = 1024;
+
+NodeConfig node;
+OverlayChildren children;   // Persistent stubs for the child nodes
+PartitionEpochs epochs;     // This node's partition, as of its latest epoch; unset without data
+TraceRing traces;           // Spans of recent queries; see trace.h
+
+// This node's instruments, exposed by the Stats RPC and the optional "metrics_file".
+struct NodeMetrics {
+    MetricsRegistry registry{"overlay_"};
+    Counter& queries = registry.counter("queries_total", "PushData calls from the parent node");
+    Counter& clientQueries = registry.counter("client_queries_total", "SendData calls from clients");
+    Counter& rowStreams = registry.counter("row_streams_total", "PullRows and FetchRows calls");
+    Counter& rejected = registry.counter("rejected_total", "Queries refused because the admission queue was full");
+    Counter& rowsScanned = registry.counter("rows_scanned_total", "Rows of the local partition visited by scans");
+    Counter& downstreamErrors = registry.counter("downstream_errors_total", "Child subtrees left out of a result after every replica failed or timed out");
+    Counter& hedges = registry.counter("hedged_calls_total", "Duplicate PushData calls sent to a replica after the first ran past its p95");
+    Counter& failovers = registry.counter("failover_calls_total", "PushData calls sent to a replica after another failed");
+    Counter& partialResults = registry.counter("partial_results_total", "Replies marked partial because part of the subtree is missing");
+    Counter& lateScans = registry.counter("late_scans_total", "Local scans skipped because the query's deadline passed while queued");
+    Counter& pruned = registry.counter("pruned_parts_total", "Local scans and child subtrees skipped by partition pruning");
+    Counter& bytesLoaded = registry.counter("bytes_loaded_total", "Bytes of CSV or snapshot read to load the partition");
+    Counter& rowsAppended = registry.counter("rows_appended_total", "Rows appended to the local partition since startup");
+    Counter& csvBadRows = registry.counter("csv_bad_rows_total", "CSV rows loaded without the expected number of fields");
+    Counter& csvBadFields = registry.counter("csv_bad_fields_total", "CSV date, time or numeric fields loaded that did not parse");
+    Counter& dictOverflow = registry.counter("dict_overflow_total", "Dictionary column values past 65536 distinct, loaded as missing");
+    Counter& rollupAnswers = registry.counter("rollup_answers_total", "Client queries answered from the subtree's rollup cube");
+    LatencyHistogram& queryLatency = registry.histogram("query_latency_us", "PushData time at this node, microseconds");
+    LatencyHistogram& clientLatency = registry.histogram("client_latency_us", "SendData time at this node, microseconds");
+    LatencyHistogram& queueWait = registry.histogram("queue_wait_us", "Time local scans waited for a worker, microseconds");
+    LatencyHistogram& scanLatency = registry.histogram("scan_latency_us", "Local scan time, microseconds");
+    LatencyHistogram& downstreamLatency = registry.histogram("downstream_latency_us", "Time until a child's PushData reply, microseconds");
+    double loadSeconds = 0;
+};
+NodeMetrics metrics;
+
+// Query evaluation shared by the overlay and client-facing services: the local partition (if any)
+// is scanned on the scheduler while the query is forwarded to the children, and the partial
+// results are merged as they arrive. Parts whose partition summaries rule the query out are
+// skipped. Each query reads the partition epoch current when it starts. Each phase is recorded
+// as a span in the query's trace rather than logged.
+class QueryNode {
+public:
+    QueryNode() : batcher(node.batchWindow), scheduler(node.threads) {
+        // With appends, children's summaries are refreshed as often as the data file is checked.
+        childSummaries.start(children, node.name, node.tail.count() > 0 ? node.tail : std::chrono::milliseconds(10000));
+        childRollups.start(children, node.name, node.tail.count() > 0 ? node.tail : std::chrono::milliseconds(10000));
+        MetricsRegistry& r = metrics.registry;
+        r.counterFrom("local_cache_hits_total", "Local scans answered from the result cache", [this] { return localCache.stats().hits; });
+        r.counterFrom("local_cache_misses_total", "Local scans not in the result cache", [this] { return localCache.stats().misses; });
+        r.counterFrom("merged_cache_hits_total", "Client queries answered from the merged-result cache", [this] { return mergedCache.stats().hits; });
+        r.counterFrom("merged_cache_misses_total", "Client queries not in the merged-result cache", [this] { return mergedCache.stats().misses; });
+        r.counterFrom("scan_passes_total", "Passes over the local partition, each serving one or more scans", [this] { return batcher.stats().batches; });
+        r.counterFrom("shared_scans_total", "Local scans served by those passes", [this] { return batcher.stats().scans; });
+        r.counterFrom("scan_tasks_total", "Block tasks run by the scan pool", [] { return ScanPool::shared().stats().tasks; });
+        r.counterFrom("scan_steals_total", "Block tasks a scan worker took from another's deque", [] { return ScanPool::shared().stats().stolen; });
+        r.gauge("rows_loaded", "Rows in the local partition", [] {
+            std::shared_ptr<const PartitionEpoch> epoch = epochs.current();
+            return epoch ? double(epoch->rows) : 0.0;
+        });
+        r.gauge("partition_epoch", "Appends published to the local partition", [] {
+            std::shared_ptr<const PartitionEpoch> epoch = epochs.current();
+            return epoch ? double(epoch->epoch) : 0.0;
+        });
+        r.gauge("rollup_cells", "Cells in the local partition's rollup cube", [] {
+            std::shared_ptr<const PartitionEpoch> epoch = epochs.current();
+            return epoch ? double(epoch->cube->cells.size()) : 0.0;
+        });
+        r.gauge("load_seconds", "Time taken to load the local partition", [] { return metrics.loadSeconds; });
+        r.gauge("scans_running", "Local scans running now", [this] { return double(scheduler.running()); });
+        r.gauge("scans_queued", "Local scans waiting in the admission queue", [this] { return double(scheduler.queued()); });
+    }
+
+    // Calls done(result, failed parts) once every part has reported. Returns false, without calling
+    // done, when the local scan cannot be admitted. Parts that cannot answer by 'deadline' are left
+    // out and the result is marked partial. Children get the budget left minus a tenth, kept for
+    // merging and replying, so each hop down has a little less time than its parent.
+    bool run(const query::Query& q, const std::string& payload, std::chrono::system_clock::time_point deadline,
+             std::shared_ptr<QueryTrace> trace, std::function<void(query::QueryResult&, size_t)> done) {
+        std::shared_ptr<const PartitionEpoch> epoch = epochs.current();
+        std::vector<size_t> targets;
+        std::vector<uint64_t> skipped;
+        plan(q, epoch, targets, skipped, *trace);
+        size_t count = (epoch ? 1 : 0) + targets.size() + skipped.size();
+        if (count == 0) {
+            query::QueryResult empty;
+            done(empty, 0);
+            return true;
+        }
+        auto parts = std::make_shared<PartialResults>(q, count, std::move(done));
+        for (uint64_t version : skipped) {
+            query::QueryResult empty = QueryEngine::emptyResult(q);
+            empty.set_data_version(version);
+            parts->add(empty);
+        }
+
+        if (epoch) {
+            // Repeated queries are answered from the cache instead of rescanning the partition. A
+            // result cached before rows were appended is brought up to date by scanning only the
+            // segments appended since.
+            uint64_t lookup = Tracing::nowUs();
+            std::string key = ResultCache::keyOf(q);
+            query::QueryResult cached;
+            uint64_t stored = 0, since = 0;
+            ResultCache::Lookup found = localCache.lookup(key, epoch->version, cached, stored);
+            std::vector<const VectorizedDataSet*> appended;
+            if (found == ResultCache::HIT) {
+                trace->span("cache", lookup, Tracing::nowUs());
+                parts->add(cached);
+            } else {
+                bool update = found == ResultCache::STALE && epoch->epochOf(stored, since) && epoch->appendedSince(since, appended);
+                uint64_t submitted = Tracing::nowUs();
+                auto report = [this, q, key, parts, trace, submitted, epoch, update, cached](query::QueryResult* scanned, uint64_t begin, size_t batched) {
+                    if (!scanned) {
+                        // The caller has given up; leave the scan out rather than add to the backlog.
+                        trace->span("queue", submitted, begin, "deadline passed");
+                        metrics.lateScans.add();
+                        parts->skip(node.name);
+                        return;
+                    }
+                    query::QueryResult result = update ? cached : *scanned;
+                    if (update) {
+                        QueryEngine::merge(result, *scanned, q);
+                        result.set_data_version(epoch->version);
+                    }
+                    localCache.put(key, epoch->version, result);
+                    uint64_t end = Tracing::nowUs();
+                    trace->span("queue", submitted, begin);
+                    std::string detail = std::to_string(QueryEngine::totalRows(result)) + " rows" + (update ? ", update" : "");
+                    if (batched > 1) detail += ", shared with " + std::to_string(batched - 1);
+                    trace->span("scan", begin, end, detail);
+                    metrics.queueWait.record(begin - submitted);
+                    metrics.scanLatency.record(end - begin);
+                    metrics.rowsScanned.add(scanned->rows_scanned());
+                    parts->add(result);
+                };
+                // A cached result is brought up to date on its own; full scans may share a pass.
+                bool admitted = update ? scheduler.submit([q, deadline, epoch, appended, report] {
+                    uint64_t begin = Tracing::nowUs();
+                    if (std::chrono::system_clock::now() >= deadline) return report(nullptr, begin, 1);
+                    query::QueryResult scanned = epoch->evaluate(q, &appended);
+                    report(&scanned, begin, 1);
+                }) : batcher.submit(scheduler, epoch, {q, deadline, submitted, report});
+                if (!admitted) {
+                    std::cerr << node.name << ": Admission queue full, rejecting query." << std::endl;
+                    metrics.rejected.add();
+                    return false;
+                }
+            }
+        }
+
+        OverlayRequest fwd_request;
+        fwd_request.set_origin(node.name);
+        fwd_request.set_payload(payload);
+        fwd_request.mutable_query()->CopyFrom(q);  // Forward the compiled query
+        fwd_request.set_packed_results(true);
+        uint64_t sent = Tracing::nowUs();
+        auto now = std::chrono::system_clock::now();
+        auto childDeadline = deadline <= now ? deadline : deadline - std::max<std::chrono::system_clock::duration>((deadline - now) / 10, std::chrono::milliseconds(1));
+        OverlayFanOut::start(children, targets, fwd_request, childDeadline, trace->id(),
+                             [parts, trace, sent](const OverlayFanOut::Outcome& outcome, const Status& status, const OverlayAck& ack) {
+            uint64_t now = Tracing::nowUs();
+            trace->span("downstream", sent, now, outcome.target);
+            if (outcome.hedges + outcome.failovers > 0)
+                trace->span("hedge", sent, now, std::to_string(outcome.hedges) + " hedged, " + std::to_string(outcome.failovers) + " failed over");
+            metrics.downstreamLatency.record(now - sent);
+            metrics.hedges.add(outcome.hedges);
+            metrics.failovers.add(outcome.failovers);
+            if (status.ok()) {
+                trace->adopt(ack.spans());
+                parts->add(ack.result());
+            } else {
+                std::cerr << node.name << ": Failed to get result from " << outcome.target << ": " << status.error_message() << std::endl;
+                metrics.downstreamErrors.add();
+                parts->skip(outcome.child);
+            }
+        });
+        return true;
+    }
+
+    // Matching rows of this subtree; local batches and the children's streams are interleaved as they are ready.
+    RowStream* rows(const query::RowQuery& request, std::chrono::system_clock::time_point deadline, std::shared_ptr<QueryTrace> trace) {
+        std::shared_ptr<const PartitionEpoch> epoch = epochs.current();
+        std::vector<size_t> targets;
+        std::vector<uint64_t> skipped;
+        if (QueryEngine::validate(request.query()).empty()) plan(request.query(), epoch, targets, skipped, *trace);
+        else for (size_t i = 0; i < children.size(); i++) targets.push_back(i);   // RowStream reports the error
+        return RowStream::start(request, node.name, std::move(epoch), &scheduler, children, targets, deadline, std::move(trace));
+    }
+
+    // Summary of this node's subtree for its parent.
+    query::PartitionSummary describe() const {
+        std::vector<query::PartitionSummary> parts = childSummaries.all();
+        if (std::shared_ptr<const PartitionEpoch> epoch = epochs.current()) parts.push_back(epoch->summary);
+        return PartitionSummaries::combine(parts);
+    }
+
+    // data_version a complete result over the subtree has now, as far as the children's latest
+    // summaries tell.
+    uint64_t currentVersion() const {
+        std::shared_ptr<const PartitionEpoch> epoch = epochs.current();
+        return (epoch ? epoch->version : 0) + childSummaries.version();
+    }
+
+    // Rollup cube of this node's subtree: the local epoch's merged with the children's latest,
+    // rebuilt when either has changed. Null while some child's cube is unknown.
+    std::shared_ptr<const RollupCube> rollup() {
+        std::shared_ptr<const PartitionEpoch> epoch = epochs.current();
+        uint64_t local = epoch ? epoch->version : 0, generation = childRollups.generation();
+        std::lock_guard<std::mutex> lock(rollupMutex);
+        if (subtreeCube && rollupLocal == local && rollupGeneration == generation) return subtreeCube;
+        std::vector<std::shared_ptr<const RollupCube>> parts;
+        if (!childRollups.all(parts)) return nullptr;
+        auto cube = std::make_shared<RollupCube>(epoch ? *epoch->cube : RollupCube());
+        for (const auto& part : parts) cube->merge(*part);
+        subtreeCube = std::move(cube);
+        rollupLocal = local;
+        rollupGeneration = generation;
+        return subtreeCube;
+    }
+
+    // Merged results of recent client queries (entry nodes), looked up by currentVersion(): rows
+    // appended or reloaded below make them stale once the summaries show it. They are trusted for
+    // a short while only, as summaries lag behind the children.
+    ResultCache mergedCache{256, std::chrono::seconds(10)};
+    std::atomic<uint64_t> subtreeVersion{0};   // data_version of the latest complete result
+
+private:
+    // Split a query's parts into those that may match (the local partition while 'epoch' stays
+    // set, and the children listed in 'targets') and those whose summaries rule it out. The data
+    // versions of the skipped parts are collected so merged results still carry the whole subtree's version.
+    void plan(const query::Query& q, std::shared_ptr<const PartitionEpoch>& epoch, std::vector<size_t>& targets,
+              std::vector<uint64_t>& skipped, QueryTrace& trace) const {
+        uint64_t now = Tracing::nowUs();
+        if (epoch && !PartitionSummaries::mayMatch(epoch->summary, q)) {
+            trace.span("pruned", now, now, "local");
+            metrics.pruned.add();
+            skipped.push_back(epoch->version);
+            epoch.reset();
+        }
+        for (size_t i = 0; i < children.size(); i++) {
+            query::PartitionSummary s;
+            if (childSummaries.get(i, s) && !PartitionSummaries::mayMatch(s, q)) {
+                trace.span("pruned", now, now, children[i].target);
+                metrics.pruned.add();
+                skipped.push_back(s.data_version());
+            } else {
+                targets.push_back(i);
+            }
+        }
+    }
+
+    ChildSummaries childSummaries;   // What each child's subtree holds, for pruning
+    ChildRollups childRollups;       // Each child's subtree cube
+    std::mutex rollupMutex;
+    std::shared_ptr<const RollupCube> subtreeCube;   // as of local epoch version rollupLocal and children's generation rollupGeneration
+    uint64_t rollupLocal = 0, rollupGeneration = 0;
+    ResultCache localCache;   // Local partial results of recent queries
+    ScanBatcher batcher;      // Full local scans, grouped into shared passes
+    QueryScheduler scheduler; // Declared last so its workers stop before the members they use go away
+};
+
+template <typename Request>
+static bool parseQuery(const Request& request, query::Query& q, std::string& error) {
+    if (!QueryEngine::fromRequest(request, q, error) || !(error = QueryEngine::validate(q)).empty()) {
+        std::cerr << node.name << ": Rejected query: " << error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Trace of a call: the caller's trace id, or a new one. The client-facing services keep their
+// children's spans in the ring so that the entry node's export shows the whole tree.
+static std::shared_ptr<QueryTrace> traceOf(const grpc::CallbackServerContext& context, bool clientFacing) {
+    uint64_t id = Tracing::idOf(context);
+    return std::make_shared<QueryTrace>(traces, node.name, id ? id : Tracing::newId(), clientFacing);
+}
+
+// When a query must be answered: the caller's deadline, but no later than the node's own budget.
+static std::chrono::system_clock::time_point deadlineOf(const grpc::CallbackServerContext& context) {
+    return std::min(context.deadline(), std::chrono::system_clock::now() + node.deadline);
+}
+
+class OverlayServiceImpl final : public OverlayComm::CallbackService {
+public:
+    explicit OverlayServiceImpl(QueryNode& queries) : queries(queries) {}
+
+    // The PushData function acts as a query handler. The request carries a typed query (or, from
+    // older callers, just the injury threshold as the payload). The reply carries the merged
+    // partial result of this node's subtree and the spans of its trace.
+    grpc::ServerUnaryReactor* PushData(grpc::CallbackServerContext* context, const OverlayRequest* request, OverlayAck* reply) override {
+        uint64_t t_start = Tracing::nowUs();
+        std::shared_ptr<QueryTrace> trace = traceOf(*context, false);
+        grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+        metrics.queries.add();
+
+        query::Query q;
+        std::string error;
+        if (!parseQuery(*request, q, error)) {
+            reactor->Finish(Status(grpc::StatusCode::INVALID_ARGUMENT, error));
+            return reactor;
+        }
+        bool admitted = queries.run(q, request->payload(), deadlineOf(*context), trace, [=](query::QueryResult& result, size_t) {
+            uint64_t t_reply = Tracing::nowUs();
+            if (result.partial()) metrics.partialResults.add();
+            uint64_t total = QueryEngine::totalRows(result);
+            *reply->mutable_result() = std::move(result);
+            if (request->packed_results()) QueryEngine::pack(*reply->mutable_result());
+            else reply->set_status(std::to_string(total));
+            uint64_t t_end = Tracing::nowUs();
+            trace->span("reply", t_reply, t_end);
+            trace->span("total", t_start, t_end);
+            trace->moveTo(reply->mutable_spans());
+            // Sized once complete, spans included, to decide on compression.
+            if (reply->ByteSizeLong() >= kCompressAbove && node.compression != GRPC_COMPRESS_NONE)
+                context->set_compression_algorithm(node.compression);
+            metrics.queryLatency.record(t_end - t_start);
+            reactor->Finish(Status::OK);
+        });
+        if (!admitted) reactor->Finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, node.name + ": too many queued scans"));
+        return reactor;
+    }
+
+    grpc::ServerWriteReactor<query::RowBatch>* PullRows(grpc::CallbackServerContext* context, const query::RowQuery* request) override {
+        metrics.rowStreams.add();
+        if (node.compression != GRPC_COMPRESS_NONE) context->set_compression_algorithm(node.compression);
+        return queries.rows(*request, deadlineOf(*context), traceOf(*context, false));
+    }
+
+    grpc::ServerUnaryReactor* Describe(grpc::CallbackServerContext* context, const overlay::DescribeRequest*,
+                                       query::PartitionSummary* reply) override {
+        *reply = queries.describe();
+        grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+        reactor->Finish(Status::OK);
+        return reactor;
+    }
+
+    // The rollup cube of this node's subtree; only its version when the caller's is still current.
+    grpc::ServerUnaryReactor* Rollup(grpc::CallbackServerContext* context, const overlay::RollupRequest* request,
+                                     query::RollupCube* reply) override {
+        grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+        std::shared_ptr<const RollupCube> cube = queries.rollup();
+        if (!cube) {
+            reactor->Finish(Status(grpc::StatusCode::UNAVAILABLE, node.name + ": rollup of the subtree not known yet"));
+            return reactor;
+        }
+        if (request->has_known_version() && request->known_version() == cube->version) reply->set_data_version(cube->version);
+        else cube->toProto(*reply);
+        if (node.compression != GRPC_COMPRESS_NONE) context->set_compression_algorithm(node.compression);
+        reactor->Finish(Status::OK);
+        return reactor;
+    }
+
+    // Counters, gauges and latency quantiles of this node, and optionally the Prometheus text.
+    grpc::ServerUnaryReactor* Stats(grpc::CallbackServerContext* context, const overlay::StatsRequest* request,
+                                    overlay::StatsReply* reply) override {
+        reply->set_node(node.name);
+        metrics.registry.forEachCounter([&](const MetricsRegistry::Named& n, uint64_t v) { (*reply->mutable_counters())[n.name] = v; });
+        metrics.registry.forEachGauge([&](const MetricsRegistry::Named& n, double v) { (*reply->mutable_gauges())[n.name] = v; });
+        metrics.registry.forEachHistogram([&](const MetricsRegistry::Named& n, const LatencyHistogram::Snapshot& s) {
+            overlay::LatencySummary* l = reply->add_latencies();
+            l->set_name(n.name);
+            l->set_count(s.count);
+            l->set_sum_us(s.sumUs);
+            l->set_p50_us(s.quantile(0.5));
+            l->set_p90_us(s.quantile(0.9));
+            l->set_p99_us(s.quantile(0.99));
+            l->set_p999_us(s.quantile(0.999));
+            l->set_max_us(s.maxUs);
+        });
+        if (request->prometheus()) reply->set_prometheus(metrics.registry.prometheus(node.name));
+        grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+        reactor->Finish(Status::OK);
+        return reactor;
+    }
+
+private:
+    QueryNode& queries;
+};
+
+class DataServiceImpl final : public DataPortal::CallbackService {
+public:
+    explicit DataServiceImpl(QueryNode& queries) : queries(queries) {}
+
+    // A client query over the whole overlay. Repeated queries are answered from the merged-result
+    // cache, and per-day, per-borough and per-factor totals from the subtree's rollup cube, without
+    // any fan-out. The reply carries the query's trace: every node's spans.
+    grpc::ServerUnaryReactor* SendData(grpc::CallbackServerContext* context, const DataRequest* request, Ack* reply) override {
+        uint64_t t_start = Tracing::nowUs();
+        std::shared_ptr<QueryTrace> trace = traceOf(*context, true);
+        reply->set_trace_id(trace->id());
+        grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+        metrics.clientQueries.add();
+
+        query::Query q;
+        std::string error;
+        if (!parseQuery(*request, q, error)) {
+            reactor->Finish(Status(grpc::StatusCode::INVALID_ARGUMENT, error));
+            return reactor;
+        }
+
+        std::string key = ResultCache::keyOf(q);
+        query::QueryResult cached;
+        if (queries.mergedCache.get(key, queries.currentVersion(), cached)) {
+            uint64_t aggregated_result = QueryEngine::totalRows(cached);
+            *reply->mutable_result() = std::move(cached);
+            reply->set_message("Total matching records: " + std::to_string(aggregated_result));
+            uint64_t t_end = Tracing::nowUs();
+            trace->span("cache", t_start, t_end, "merged");
+            trace->span("total", t_start, t_end);
+            trace->moveTo(reply->mutable_spans());
+            metrics.clientLatency.record(t_end - t_start);
+            reactor->Finish(Status::OK);
+            return reactor;
+        }
+
+        // The cube is used only once it holds what the children's summaries say they hold.
+        std::shared_ptr<const RollupCube> cube = RollupCube::answers(q) ? queries.rollup() : nullptr;
+        if (cube && cube->version == queries.currentVersion()) {
+            *reply->mutable_result() = cube->answer(q);
+            reply->set_message("Total matching records: " + std::to_string(QueryEngine::totalRows(reply->result())));
+            uint64_t t_end = Tracing::nowUs();
+            trace->span("rollup", t_start, t_end, std::to_string(cube->cells.size()) + " cells");
+            trace->span("total", t_start, t_end);
+            trace->moveTo(reply->mutable_spans());
+            metrics.rollupAnswers.add();
+            metrics.clientLatency.record(t_end - t_start);
+            reactor->Finish(Status::OK);
+            return reactor;
+        }
+
+        bool admitted = queries.run(q, request->payload(), deadlineOf(*context), trace, [=](query::QueryResult& aggregated, size_t failed) {
+            uint64_t t_reply = Tracing::nowUs();
+            // Only complete results are cached. Their version tells the node when a partition was reloaded.
+            if (failed == 0 && !aggregated.partial()) {
+                if (aggregated.data_version() != queries.subtreeVersion.exchange(aggregated.data_version())) queries.mergedCache.clear();
+                queries.mergedCache.put(key, aggregated.data_version(), aggregated);
+            }
+            uint64_t aggregated_result = QueryEngine::totalRows(aggregated);
+            std::string message = "Total matching records: " + std::to_string(aggregated_result);
+            if (aggregated.partial()) {
+                metrics.partialResults.add();
+                message += " (partial, missing";
+                for (const auto& part : aggregated.missing()) message += " " + part;
+                message += ")";
+            }
+            *reply->mutable_result() = std::move(aggregated);
+            reply->set_message(message);
+            uint64_t t_end = Tracing::nowUs();
+            trace->span("reply", t_reply, t_end);
+            trace->span("total", t_start, t_end);
+            trace->moveTo(reply->mutable_spans());
+            metrics.clientLatency.record(t_end - t_start);
+            reactor->Finish(Status::OK);
+        });
+        if (!admitted) reactor->Finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, node.name + ": too many queued scans"));
+        return reactor;
+    }
+
+    // Matching rows from every partition, relayed as their batches arrive.
+    grpc::ServerWriteReactor<query::RowBatch>* FetchRows(grpc::CallbackServerContext* context, const query::RowQuery* request) override {
+        metrics.rowStreams.add();
+        return queries.rows(*request, deadlineOf(*context), traceOf(*context, true));
+    }
+
+private:
+    QueryNode& queries;
+};
+
+// Read this node's entry from the overlay config:
+//   "data_file":  CSV shared by all nodes (a node entry may override it)
+//   "nodes":      name -> {"host", "port", "threads", "entry", "children": [names], "trace_file",
+//                 "metrics_file", "replica_of", "pin_workers"}; a node with "replica_of": "D" serves
+//                 D's share of the data and D's children, and D's parent sends each query to D or
+//                 to it; "pin_workers" (default false) binds the node's scan workers to CPUs, spread
+//                 over its NUMA nodes; leave it off when several nodes share a machine
+//   "partitions": [{"node", "weight"}, ...]; shares follow the list order, sized by weight
+//   "partitioning": optional {"method": "rows" | "hash" | "range", "column", "bounds": [...]};
+//                   "rows" (the default) splits the file into row ranges, "hash" and "range" assign
+//                   rows by the value of a column, "range" with one bound fewer than partitions.
+//                   Under "range" the bounds size the shares, and a partition with a "weight" is
+//                   rejected
+//   "tail_ms":    optional; check the data file this often for appended rows and add them to the
+//                 partitions while serving (a node entry may override it)
+//   "deadline_ms": optional, default 5000; time budget of a query whose caller set no deadline
+//                 (a node entry may override it)
+//   "batch_window_us": optional, default 0; a local scan waits this long for other queries to
+//                 share its pass over the partition (a node entry may override it)
+//   "compression": optional, "none" (the default), "deflate" or "gzip"; compresses the replies and
+//                 row streams a node sends its parent (a node entry may override it). Parents
+//                 accept every algorithm, so nodes can differ.
+bool loadConfig(const std::string& path, const std::string& name) {
+    std::ifstream in(path);
+    json config = in.is_open() ? json::parse(in, nullptr, false) : json();
+    if (config.is_discarded() || !config.contains("nodes")) {
+        std::cerr << name << ": Cannot read overlay config " << path << std::endl;
+        return false;
+    }
+    const json& nodes = config["nodes"];
+    if (!nodes.contains(name)) {
+        std::cerr << name << ": Node not found in " << path << std::endl;
+        return false;
+    }
+    const json& entry = nodes[name];
+    auto addressOf = [&](const json& n) {
+        return n.value("host", std::string("localhost")) + ":" + std::to_string(n.value("port", 0));
+    };
+
+    node.name = name;
+    node.listenAddress = "0.0.0.0:" + std::to_string(entry.value("port", 0));
+    node.threads = std::max(1, entry.value("threads", omp_get_num_procs()));
+    node.pinWorkers = entry.value("pin_workers", false);
+    node.entry = entry.value("entry", false);
+    node.traceFile = entry.value("trace_file", std::string());
+    node.metricsFile = entry.value("metrics_file", std::string());
+    node.tail = std::chrono::milliseconds(entry.value("tail_ms", config.value("tail_ms", 0)));
+    node.deadline = std::chrono::milliseconds(entry.value("deadline_ms", config.value("deadline_ms", 5000)));
+    node.batchWindow = std::chrono::microseconds(std::max(0, entry.value("batch_window_us", config.value("batch_window_us", 0))));
+    std::string compression = entry.value("compression", config.value("compression", std::string("none")));
+    if (compression == "deflate") node.compression = GRPC_COMPRESS_DEFLATE;
+    else if (compression == "gzip") node.compression = GRPC_COMPRESS_GZIP;
+    else if (compression != "none") {
+        std::cerr << name << ": Unknown compression " << compression << " in " << path << std::endl;
+        return false;
+    }
+    // A replica takes the place of the node it copies: same children, same share of the data.
+    const std::string role = entry.value("replica_of", name);
+    if (!nodes.contains(role) || nodes[role].contains("replica_of")) {
+        std::cerr << name << ": replica_of must name a node that is not itself a replica, in " << path << std::endl;
+        return false;
+    }
+    for (const auto& child : nodes[role].value("children", std::vector<std::string>())) {
+        if (!nodes.contains(child)) {
+            std::cerr << name << ": Unknown child node " << child << " in " << path << std::endl;
+            return false;
+        }
+        std::vector<std::string> replicas{addressOf(nodes[child])};
+        for (const auto& [other, n] : nodes.items())
+            if (n.value("replica_of", std::string()) == child) replicas.push_back(addressOf(n));
+        node.children.push_back(replicas);
+    }
+
+    const json& partitions = config.value("partitions", json::array());
+    for (size_t i = 0; i < partitions.size(); i++) {
+        node.partition.weights.push_back(partitions[i].value("weight", 1u));
+        if (partitions[i].value("node", std::string()) == role) {
+            node.partition.part = i;
+            node.dataFile = entry.value("data_file", config.value("data_file", std::string("../data/dataset.csv")));
+        }
+    }
+    const json& partitioning = config.value("partitioning", json::object());
+    std::string method = partitioning.value("method", std::string("rows"));
+    node.partition.column = partitioning.value("column", std::string());
+    node.partition.bounds = partitioning.value("bounds", std::vector<std::string>());
+    if (method == "hash") node.partition.method = PartitionSpec::HASH;
+    else if (method == "range") node.partition.method = PartitionSpec::RANGE;
+    else if (method != "rows") {
+        std::cerr << name << ": Unknown partitioning method " << method << " in " << path << std::endl;
+        return false;
+    }
+    if (node.partition.method == PartitionSpec::RANGE) {
+        for (const auto& p : partitions) {
+            if (p.contains("weight")) {
+                std::cerr << name << ": \"weight\" has no effect under range partitioning (the bounds size the shares), in " << path << std::endl;
+                return false;
+            }
+        }
+    }
+    if (node.partition.method != PartitionSpec::ROWS && std::holds_alternative<std::monostate>(VectorizedDataSet().column(node.partition.column))) {
+        std::cerr << name << ": Unknown partitioning column " << node.partition.column << " in " << path << std::endl;
+        return false;
+    }
+    if (!node.dataFile.empty() && !node.partition.valid()) {
+        std::cerr << name << ": Invalid partitioning in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Count and log malformed CSV input met while loading (see VectorizedDataSet::CsvErrors).
+void reportCsvErrors(const VectorizedDataSet::CsvErrors& errors) {
+    if (errors.overflowed > 0) {
+        metrics.dictOverflow.add(errors.overflowed);
+        std::cerr << node.name << ": " << errors.overflowed << " values of dictionary columns past "
+                  << DictColumn<uint16_t>::kMaxEntries << " distinct loaded as missing" << std::endl;
+    }
+    if (errors.rows + errors.fields == 0) return;
+    metrics.csvBadRows.add(errors.rows);
+    metrics.csvBadFields.add(errors.fields);
+    std::cerr << node.name << ": " << errors.rows << " malformed CSV rows and " << errors.fields
+              << " unparsable fields loaded" << std::endl;
+}
+
+// Load this node's share of the data file, from its snapshot when one is current. Returns where
+// the whole rows it read end, where following appended rows starts.
+uint64_t loadDataset() {
+    if (node.dataFile.empty()) return 0;
+    const std::string dataFile = node.dataFile;
+    const PartitionSpec spec = node.partition;
+    size_t total = 0;
+    bool fromSnapshot = false;
+    uint64_t sourceBytes = 0;
+    VectorizedDataSet dataset;
+    PartitionDerived derived;
+    auto t1 = std::chrono::steady_clock::now();
+    if(DatasetSnapshot::loadPartition(dataset, dataFile, spec, &total, &fromSnapshot, &derived, &sourceBytes) && total > 0)
+    {
+        size_t records = dataset.size();
+        VectorizedDataSet::CsvErrors errors = dataset.csvErrors;
+        uint64_t version = derived.summary.data_version();
+        epochs.reset(std::move(dataset), version, std::move(derived.summary), std::move(derived.cube));
+        auto t2 = std::chrono::steady_clock::now();
+        std::chrono::duration<double> dt = t2 - t1;
+        std::error_code ec;
+        uintmax_t bytes = std::filesystem::file_size(fromSnapshot ? DatasetSnapshot::pathFor(dataFile, spec) : dataFile, ec);
+        if (!ec) metrics.bytesLoaded.add(bytes);
+        reportCsvErrors(errors);
+        metrics.loadSeconds = dt.count();
+        std::string placement;
+        if (spec.method == PartitionSpec::ROWS) {
+            auto [first, last] = spec.rows(total);
+            placement = "rows " + std::to_string(first) + "-" + std::to_string(last);
+        } else {
+            placement = (spec.method == PartitionSpec::HASH ? "hash of " : "range of ") + spec.column;
+        }
+        std::cout << node.name << ": Total records = " << total << ", loaded share " << spec.part + 1 << " of "
+                  << spec.weights.size() << " (" << placement << ", " << records
+                  << " records) from " << (fromSnapshot ? "snapshot" : "CSV") << " in " << dt.count() << " seconds." << std::endl;
+        return sourceBytes;
+    }
+    std::cerr << node.name << ": Error loading dataset from " << dataFile << std::endl;
+    return 0;
+}
+
+void RunServer(uint64_t loadedBytes) {
+    QueryNode queries;
+    OverlayServiceImpl overlayService(queries);
+    DataServiceImpl dataService(queries);
+
+    ServerBuilder builder;
+    builder.AddListeningPort(node.listenAddress, grpc::InsecureServerCredentials());
+    builder.RegisterService(&overlayService);
+    if (node.entry) builder.RegisterService(&dataService);
+    std::unique_ptr<ChromeTraceExporter> exporter;
+    if (!node.traceFile.empty()) {
+        exporter = std::make_unique<ChromeTraceExporter>(traces, node.traceFile);
+        if (!exporter->ok()) std::cerr << node.name << ": Cannot write trace file " << node.traceFile << std::endl;
+    }
+    std::unique_ptr<PartitionTail> tail;
+    if (node.tail.count() > 0 && epochs.current()) {
+        tail = std::make_unique<PartitionTail>(epochs, node.dataFile, node.partition, loadedBytes, node.tail,
+                                               [](size_t rows, const VectorizedDataSet::CsvErrors& errors, const PartitionEpoch& epoch) {
+            metrics.rowsAppended.add(rows);
+            reportCsvErrors(errors);
+            std::cout << node.name << ": Appended " << rows << " records, " << epoch.rows << " in " << epoch.segments.size()
+                      << " segments at epoch " << epoch.epoch << "." << std::endl;
+        });
+    }
+    std::unique_ptr<MetricsFileWriter> metricsWriter;
+    if (!node.metricsFile.empty())
+        metricsWriter = std::make_unique<MetricsFileWriter>([] { return metrics.registry.prometheus(node.name); }, node.metricsFile);
+    std::unique_ptr<Server> server(builder.BuildAndStart());
+    if (!server) {
+        std::cerr << node.name << ": Cannot listen on " << node.listenAddress << std::endl;
+        return;
+    }
+    std::cout << "Server " << node.name << " listening on " << node.listenAddress << std::endl;
+    server->Wait();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: overlay_node <node name> [overlay config]" << std::endl;
+        return 1;
+    }
+    if (!loadConfig(argc > 2 ? argv[2] : "../config/overlay_config.json", argv[1])) return 1;
+    omp_set_num_threads(node.threads);
+    ScanPool::configure(node.threads, node.pinWorkers);   // before the load first-touches the columns
+    children.connect(node.children);
+    uint64_t loadedBytes = loadDataset();  // Load the data partition before starting the service.
+    RunServer(loadedBytes);
+    return 0;
+}
@@ -0,0 +1,369 @@
+#ifndef COLUMN_H
+#define COLUMN_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <omp.h>
+
+using namespace std;
+
+// Allocator of column storage. Values it constructs without arguments are left uninitialized, so
+// grow() can size a column without writing it; large buffers start on a page boundary, so a block
+// of rows covers whole pages (see ScanPool::firstTouch).
+template <typename T>
+struct ColumnAllocator {
+    using value_type = T;
+    static const size_t kPageAlignAbove = 1 << 16;   // bytes
+
+    ColumnAllocator() = default;
+    template <typename U>
+    ColumnAllocator(const ColumnAllocator<U> &) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(::operator new(n * sizeof(T), alignmentOf(n))); }
+    void deallocate(T *p, size_t n) { ::operator delete(p, alignmentOf(n)); }
+
+    template <typename U>
+    void construct(U *p) noexcept(is_nothrow_default_constructible_v<U>) { ::new (static_cast<void *>(p)) U; }
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&...args) { ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...); }
+
+    template <typename U>
+    bool operator==(const ColumnAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const ColumnAllocator<U> &) const { return false; }
+
+private:
+    static align_val_t alignmentOf(size_t n) {
+        return align_val_t(n * sizeof(T) >= kPageAlignAbove ? 4096 : max<size_t>(alignof(T), 64));
+    }
+};
+
+// Fixed-width column. It either owns its values or views a read-only region such as a
+// mapped snapshot. Views are read-only: anything that changes the size detaches first.
+template <typename T>
+class Column {
+public:
+    using value_type = T;
+
+    Column() = default;
+    Column(const Column &other) { *this = other; }
+    Column &operator=(const Column &other) {
+        if (this == &other) return *this;
+        owned = other.owned;
+        isView = other.isView;
+        len = other.len;
+        ptr = isView ? other.ptr : owned.data();
+        return *this;
+    }
+    Column(Column &&) = default;
+    Column &operator=(Column &&) = default;
+
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    size_t bytes() const { return len * sizeof(T); }
+    bool is_view() const { return isView; }
+
+    const T *data() const { return ptr; }
+    T *data() { return ptr; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+    T &operator[](size_t i) { return ptr[i]; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + len; }
+    const T &back() const { return ptr[len - 1]; }
+
+    void resize(size_t n) {
+        detach();
+        owned.resize(n, T());
+        sync();
+    }
+    // Resize leaving new values uninitialized; the caller writes every one of them.
+    void grow(size_t n) {
+        detach();
+        owned.resize(n);
+        sync();
+    }
+    void reserve(size_t n) {
+        detach();
+        owned.reserve(n);
+        sync();
+    }
+    void push_back(const T &v) {
+        detach();
+        owned.push_back(v);
+        sync();
+    }
+    void append(const T *values, size_t n) {
+        detach();
+        owned.insert(owned.end(), values, values + n);
+        sync();
+    }
+    void clear() {
+        owned.clear();
+        isView = false;
+        sync();
+    }
+
+    // Point the column at n values owned by someone else (they must outlive the column).
+    void view(const T *values, size_t n) {
+        owned = decltype(owned)();
+        ptr = const_cast<T *>(values);
+        len = n;
+        isView = true;
+    }
+
+    // Copy viewed values into owned storage so the column can be modified.
+    void detach() {
+        if (!isView) return;
+        owned.assign(ptr, ptr + len);
+        isView = false;
+        sync();
+    }
+
+private:
+    void sync() {
+        ptr = owned.data();
+        len = owned.size();
+    }
+
+    vector<T, ColumnAllocator<T>> owned;
+    T *ptr = nullptr;
+    size_t len = 0;
+    bool isView = false;
+};
+
+template <typename Col>
+struct FixedWidthTag : false_type {};
+template <typename T>
+struct FixedWidthTag<Column<T>> : true_type {};
+template <typename Col>
+constexpr bool is_fixed_width = FixedWidthTag<Col>::value;
+
+// Variable-length strings packed into one character buffer plus size() + 1 offsets.
+class StringColumn {
+public:
+    StringColumn() { offsets.push_back(0); }
+
+    size_t size() const { return offsets.size() - 1; }
+    bool empty() const { return size() == 0; }
+    size_t bytes() const { return offsets.bytes() + chars.bytes(); }
+
+    string_view operator[](size_t i) const {
+        return string_view(chars.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+    void push_back(string_view s) {
+        chars.append(s.data(), s.size());
+        offsets.push_back(chars.size());
+    }
+
+    // Room for 'rows' more strings of 'nchars' characters in all.
+    void reserve(size_t rows, size_t nchars) {
+        offsets.reserve(offsets.size() + rows);
+        chars.reserve(chars.size() + nchars);
+    }
+
+    void clear() {
+        offsets.clear();
+        offsets.push_back(0);
+        chars.clear();
+    }
+
+    // Append several columns in order. Sizes are summed first and the copies run in parallel.
+    void append(const vector<StringColumn> &parts) {
+        size_t rows = size(), nchars = chars.size();
+        vector<size_t> rowAt(parts.size()), charAt(parts.size());
+        for (size_t i = 0; i < parts.size(); i++) {
+            rowAt[i] = rows;
+            charAt[i] = nchars;
+            rows += parts[i].size();
+            nchars += parts[i].chars.size();
+        }
+        offsets.resize(rows + 1);
+        chars.resize(nchars);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < parts.size(); i++) {
+            const StringColumn &part = parts[i];
+            if (!part.chars.empty()) memcpy(chars.data() + charAt[i], part.chars.data(), part.chars.size());
+            for (size_t r = 0; r < part.size(); r++) offsets[rowAt[i] + r + 1] = charAt[i] + part.offsets[r + 1];
+        }
+    }
+
+    // Raw storage, used by the snapshot writer.
+    const Column<uint64_t> &offsetData() const { return offsets; }
+    const Column<char> &charData() const { return chars; }
+
+    // View 'rows' strings stored elsewhere as rows + 1 offsets and their character buffer.
+    void view(const uint64_t *offs, size_t rows, const char *buffer, size_t nchars) {
+        offsets.view(offs, rows + 1);
+        chars.view(buffer, nchars);
+    }
+
+private:
+    Column<uint64_t> offsets;
+    Column<char> chars;
+};
+
+// Low-cardinality strings stored as dense codes into a per-column dictionary. Predicates are
+// evaluated on the codes: a value (or set of values) is looked up once and rows compare integers.
+// The empty string (a missing value) is always code 0. The dictionary's values live in one
+// StringColumn and its lookup index is a flat open-addressing table of codes that compares
+// values in place, so interning allocates nothing per value and teardown frees a few buffers.
+template <typename Code>
+class DictColumn {
+public:
+    using code_type = Code;
+    static const size_t kMaxEntries = size_t(numeric_limits<Code>::max()) + 1;
+
+    DictColumn() {
+        slots.assign(kMinSlots, Slot());
+        intern(string_view());
+    }
+    DictColumn(const DictColumn &) = delete;
+    DictColumn &operator=(const DictColumn &) = delete;
+    DictColumn(DictColumn &&) = default;
+    DictColumn &operator=(DictColumn &&) = default;
+
+    size_t size() const { return codes.size(); }
+    bool empty() const { return codes.empty(); }
+    size_t bytes() const { return codes.bytes() + dict.bytes(); }
+
+    string_view operator[](size_t i) const { return dict[codes[i]]; }
+    Code code(size_t i) const { return codes[i]; }
+    const Column<Code> &codeData() const { return codes; }
+    const StringColumn &dictionary() const { return dict; }
+    size_t cardinality() const { return dict.size(); }
+    // Rows whose value did not fit in the dictionary; they were stored as the empty string.
+    size_t overflowed() const { return overflow; }
+
+    // Code of 'value', or -1 when it is not in the dictionary.
+    int64_t find(string_view value) const {
+        size_t at;
+        return lookup(value, hashOf(value), at);
+    }
+
+    void push_back(string_view value) {
+        Code c = intern(value);
+        overflow += c == 0 && !value.empty();
+        codes.push_back(c);
+    }
+
+    void clear() {
+        codes.clear();
+        dict.clear();
+        slots.assign(kMinSlots, Slot());
+        overflow = 0;
+        intern(string_view());
+    }
+
+    // Room for n more rows without regrowing the codes.
+    void reserve(size_t n) { codes.reserve(codes.size() + n); }
+
+    // Table indexed by code with 1 for every code whose value is in 'values'.
+    vector<uint8_t> matchTable(const vector<string> &values) const {
+        vector<uint8_t> table(dict.size(), 0);
+        for (const auto &v : values) {
+            int64_t c = find(v);
+            if (c >= 0) table[c] = 1;
+        }
+        return table;
+    }
+
+    // Append several columns in order. Their dictionaries are merged first (small, serial) and the
+    // codes are then rewritten in parallel, so new codes follow first appearance in part order.
+    void append(const vector<DictColumn> &parts) {
+        size_t rows = size();
+        vector<size_t> rowAt(parts.size());
+        vector<vector<Code>> remap(parts.size());
+        for (size_t i = 0; i < parts.size(); i++) {
+            rowAt[i] = rows;
+            rows += parts[i].size();
+            overflow += parts[i].overflow;
+            remap[i].resize(parts[i].cardinality());
+            for (size_t c = 0; c < parts[i].cardinality(); c++) remap[i][c] = intern(parts[i].dict[c]);
+        }
+        codes.resize(rows);
+        size_t lost = 0;   // rows whose value no longer fits in the merged dictionary
+        #pragma omp parallel for schedule(dynamic, 1) reduction(+:lost)
+        for (size_t i = 0; i < parts.size(); i++) {
+            const Code *src = parts[i].codes.data();
+            const Code *map = remap[i].data();
+            Code *dst = codes.data() + rowAt[i];
+            size_t n = parts[i].size();
+            for (size_t r = 0; r < n; r++) {
+                dst[r] = map[src[r]];
+                lost += dst[r] == 0 && src[r] != 0;
+            }
+        }
+        overflow += lost;
+    }
+
+    // View codes and a dictionary stored elsewhere; only the small lookup index is rebuilt.
+    void view(const Code *values, size_t rows, const uint64_t *dictOffsets, size_t dictSize,
+              const char *dictChars, size_t nchars) {
+        codes.view(values, rows);
+        dict.view(dictOffsets, dictSize, dictChars, nchars);
+        rebuildIndex();
+        overflow = 0;
+    }
+
+private:
+    // A slot of the index: code + 1 (0 while empty) and the hash of its value.
+    struct Slot {
+        uint32_t hash = 0;
+        uint32_t code = 0;
+    };
+    static const size_t kMinSlots = 16;
+
+    static uint32_t hashOf(string_view value) { return uint32_t(std::hash<string_view>()(value)); }
+
+    // Code of 'value', or -1 with 'at' set to the empty slot where it would go.
+    int64_t lookup(string_view value, uint32_t h, size_t &at) const {
+        size_t mask = slots.size() - 1;
+        for (at = h & mask;; at = (at + 1) & mask) {
+            const Slot &s = slots[at];
+            if (s.code == 0) return -1;
+            if (s.hash == h && dict[s.code - 1] == value) return int64_t(s.code - 1);
+        }
+    }
+
+    // Size the index for the dictionary (at most half full) and place every code.
+    void rebuildIndex() {
+        size_t n = kMinSlots;
+        while (n < 2 * (dict.size() + 1)) n *= 2;
+        slots.assign(n, Slot());
+        for (size_t c = 0; c < dict.size(); c++) {
+            uint32_t h = hashOf(dict[c]);
+            size_t at;
+            if (lookup(dict[c], h, at) < 0) slots[at] = {h, uint32_t(c + 1)};
+        }
+    }
+
+    Code intern(string_view value) {
+        if (value.empty() && dict.size() > 0) return 0;   // most missing values never reach the index
+        uint32_t h = hashOf(value);
+        size_t at;
+        int64_t found = lookup(value, h, at);
+        if (found >= 0) return Code(found);
+        if (dict.size() == kMaxEntries) return 0;   // full: the caller counts the row as overflowed
+        Code c = Code(dict.size());
+        dict.push_back(value);
+        if (2 * (dict.size() + 1) > slots.size()) rebuildIndex();
+        else slots[at] = {h, uint32_t(c) + 1};
+        return c;
+    }
+
+    Column<Code> codes;
+    StringColumn dict;
+    vector<Slot> slots;   // index over 'dict', owned or mapped; size is a power of two
+    size_t overflow = 0;
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef CSV_TOKENIZER_H
+#define CSV_TOKENIZER_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "scan_kernels.h"
+
+using namespace std;
+
+// RFC 4180 structure of CSV text, found 64 bytes at a time. Each block is classified into bitmasks
+// of its quotes, commas and newlines (two 32-byte AVX2 compares per class, or a scalar loop). A
+// prefix XOR of the quote bits, carried from block to block, marks the bytes inside quoted fields;
+// commas and newlines there are data, not separators. The doubled quote of an escaped quote
+// toggles the state twice, so it needs no special case. The collision export quotes LOCATION
+// ("(40.7, -73.9)") and some street names, which contain commas.
+class CsvTokenizer {
+public:
+    struct Masks {
+        uint64_t quote = 0, comma = 0, newline = 0;
+    };
+
+    // Classify the n <= 64 bytes at p; bits past n are clear.
+    static Masks classify(const char *p, size_t n) {
+        static const ScanKernels::Isa isa = ScanKernels::isa();
+        return classifyWith(isa, p, n);
+    }
+
+    // The same with the kernels of 'isa', which the CPU must support (AVX-512 uses the AVX2 ones).
+    static Masks classifyWith(ScanKernels::Isa isa, const char *p, size_t n) {
+#ifdef SCAN_KERNELS_X86
+        if (isa >= ScanKernels::AVX2) {
+            if (n == 64) return classifyAVX2(p);
+            alignas(32) char block[64] = {};
+            memcpy(block, p, n);
+            return classifyAVX2(block);
+        }
+#endif
+        return classifyScalar(p, n);
+    }
+
+    // Bits of a block inside quotes (an opening quote counts as inside, a closing one as outside).
+    // 'inQuotes' is all ones while a quoted field continues into the next block, else zero.
+    static uint64_t quotedMask(uint64_t quotes, uint64_t &inQuotes) {
+        uint64_t m = quotes;
+        m ^= m << 1;
+        m ^= m << 2;
+        m ^= m << 4;
+        m ^= m << 8;
+        m ^= m << 16;
+        m ^= m << 32;
+        m ^= inQuotes;
+        inQuotes = uint64_t(int64_t(m) >> 63);
+        return m;
+    }
+
+    // Start of the row after the one that starts at p (outside quotes).
+    static const char *rowEnd(const char *p, const char *end) { return nextRowAt(p, end, false); }
+
+    // Start of the first row after p, for a p inside quotes or not: just past the first newline
+    // outside quotes at or after p, or end.
+    static const char *nextRowAt(const char *p, const char *end, bool quoted) {
+        uint64_t inQuotes = quoted ? ~uint64_t(0) : 0;
+        for (const char *block = p; block < end; block += 64) {
+            Masks m = classify(block, min<size_t>(64, end - block));
+            uint64_t newlines = m.newline & ~quotedMask(m.quote, inQuotes);
+            if (newlines) return block + __builtin_ctzll(newlines) + 1;
+        }
+        return end;
+    }
+
+    // Rows in [p, end), which starts a row: newlines outside quotes, plus a last row without one.
+    static size_t countRows(const char *p, const char *end) {
+        size_t rows = 0;
+        uint64_t inQuotes = 0;
+        const char *last = p;   // just past the last row end
+        for (const char *block = p; block < end; block += 64) {
+            Masks m = classify(block, min<size_t>(64, end - block));
+            uint64_t newlines = m.newline & ~quotedMask(m.quote, inQuotes);
+            if (!newlines) continue;
+            rows += __builtin_popcountll(newlines);
+            last = block + 63 - __builtin_clzll(newlines) + 1;
+        }
+        return rows + (last < end);
+    }
+
+    // Just past the last row end in [p, end), which starts a row; p when no row ends there.
+    static const char *lastRowEnd(const char *p, const char *end) {
+        uint64_t inQuotes = 0;
+        const char *last = p;
+        for (const char *block = p; block < end; block += 64) {
+            Masks m = classify(block, min<size_t>(64, end - block));
+            uint64_t newlines = m.newline & ~quotedMask(m.quote, inQuotes);
+            if (newlines) last = block + 63 - __builtin_clzll(newlines) + 1;
+        }
+        return last;
+    }
+
+    // Whether [p, end) holds an odd number of quotes.
+    static bool oddQuotes(const char *p, const char *end) {
+        size_t n = 0;
+        for (const char *block = p; block < end; block += 64) n += __builtin_popcountll(classify(block, min<size_t>(64, end - block)).quote);
+        return n & 1;
+    }
+
+    // Split the row starting at p (outside quotes) into fields and return the start of the next
+    // row. The first 'max' (at most 64) fields go to 'out' without their enclosing quotes;
+    // fields with doubled quotes are unescaped into 'scratch', which the views then point into
+    // until the next call. 'count' is the number of fields the row has.
+    static const char *row(const char *p, const char *end, string_view *out, size_t max, size_t &count, string &scratch) {
+        count = 0;
+        uint64_t escaped = 0;   // fields with a doubled quote
+        auto emit = [&](const char *a, const char *b) {
+            if (count < max) {
+                if (b - a >= 2 && *a == '"' && b[-1] == '"') {
+                    a++;
+                    b--;
+                    if (memchr(a, '"', b - a)) escaped |= uint64_t(1) << count;
+                }
+                out[count] = string_view(a, b - a);
+            }
+            count++;
+        };
+        const char *field = p, *stop = end, *next = end;
+        uint64_t inQuotes = 0;
+        for (const char *block = p; block < end && next == end; block += 64) {
+            Masks m = classify(block, min<size_t>(64, end - block));
+            uint64_t outside = ~quotedMask(m.quote, inQuotes);
+            uint64_t commas = m.comma & outside, newlines = m.newline & outside;
+            if (newlines) {
+                uint64_t first = newlines & (0 - newlines);
+                commas &= first - 1;
+                stop = block + __builtin_ctzll(first);
+                next = stop + 1;
+            }
+            for (; commas; commas &= commas - 1) {
+                const char *at = block + __builtin_ctzll(commas);
+                emit(field, at);
+                field = at + 1;
+            }
+        }
+        if (stop > field && stop[-1] == '\r') stop--;
+        emit(field, stop);
+        if (escaped) unescape(out, escaped, scratch);
+        return next;
+    }
+
+private:
+#ifdef SCAN_KERNELS_X86
+    __attribute__((target("avx2")))
+    static uint64_t matchAVX2(__m256i lo, __m256i hi, char c) {
+        __m256i v = _mm256_set1_epi8(c);
+        return uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, v)))) |
+               uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, v)))) << 32;
+    }
+
+    __attribute__((target("avx2")))
+    static Masks classifyAVX2(const char *p) {
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+        Masks m;
+        m.quote = matchAVX2(lo, hi, '"');
+        m.comma = matchAVX2(lo, hi, ',');
+        m.newline = matchAVX2(lo, hi, '\n');
+        return m;
+    }
+#endif
+
+    static Masks classifyScalar(const char *p, size_t n) {
+        Masks m;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t bit = uint64_t(1) << i;
+            if (p[i] == '"') m.quote |= bit;
+            else if (p[i] == ',') m.comma |= bit;
+            else if (p[i] == '\n') m.newline |= bit;
+        }
+        return m;
+    }
+
+    // Replace each doubled quote by one in the fields marked in 'escaped', copying them to 'scratch'.
+    static void unescape(string_view *out, uint64_t escaped, string &scratch) {
+        size_t bytes = 0;
+        for (uint64_t e = escaped; e; e &= e - 1) bytes += out[__builtin_ctzll(e)].size();
+        scratch.resize(bytes);
+        char *w = scratch.data();
+        for (uint64_t e = escaped; e; e &= e - 1) {
+            string_view &f = out[__builtin_ctzll(e)];
+            char *start = w;
+            for (size_t i = 0; i < f.size(); i++) {
+                *w++ = f[i];
+                if (f[i] == '"' && i + 1 < f.size() && f[i + 1] == '"') i++;
+            }
+            f = string_view(start, w - start);
+        }
+    }
+};
+
+#endif
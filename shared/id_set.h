@@ -0,0 +1,181 @@
+#ifndef ID_SET_H
+#define ID_SET_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "query.pb.h"
+
+using namespace std;
+
+// Sets of 32-bit ids (query::IdSet) in the roaring layout. A container holds the ids sharing their
+// high 16 bits: up to kDenseAbove of them as varint gaps between the sorted low halves, more as
+// an 8 KiB bitmap, whichever is smaller. Unions work on the encoded containers, so an
+// intermediate node merges its children's sets without expanding them into id vectors.
+class IdSets {
+public:
+    static const uint32_t kDenseAbove = 4096;
+    static const size_t kBitmapBytes = 65536 / 8;
+
+    // Set of 'ids', given in any order.
+    static query::IdSet of(vector<uint32_t> ids) {
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        query::IdSet out;
+        for (size_t i = 0; i < ids.size();) {
+            uint32_t high = ids[i] >> 16;
+            size_t end = i;
+            while (end < ids.size() && ids[end] >> 16 == high) end++;
+            query::IdContainer *c = out.add_containers();
+            c->set_high(high);
+            c->set_count(uint32_t(end - i));
+            string &low = *c->mutable_low();
+            if (end - i > kDenseAbove) {
+                c->set_dense(true);
+                low.assign(kBitmapBytes, '\0');
+                for (; i < end; i++) setBit(low, ids[i] & 0xffff);
+            } else {
+                uint32_t prev = 0;
+                for (; i < end; i++) {
+                    putVarint(low, (ids[i] & 0xffff) - prev);
+                    prev = ids[i] & 0xffff;
+                }
+            }
+        }
+        return out;
+    }
+
+    // Add the ids of 'from' to 'into'.
+    static void merge(query::IdSet &into, const query::IdSet &from) {
+        if (from.containers_size() == 0) return;
+        auto *mine = into.mutable_containers();
+        query::IdSet out;
+        int i = 0, j = 0;
+        while (i < mine->size() || j < from.containers_size()) {
+            if (j == from.containers_size() || (i < mine->size() && mine->Get(i).high() < from.containers(j).high())) {
+                out.add_containers()->Swap(mine->Mutable(i++));
+            } else if (i == mine->size() || from.containers(j).high() < mine->Get(i).high()) {
+                *out.add_containers() = from.containers(j++);
+            } else {
+                unite(*mine->Mutable(i), from.containers(j++));
+                out.add_containers()->Swap(mine->Mutable(i++));
+            }
+        }
+        into.Swap(&out);
+    }
+
+    static uint64_t count(const query::IdSet &s) {
+        uint64_t n = 0;
+        for (const auto &c : s.containers()) n += c.count();
+        return n;
+    }
+
+    // f(id) for every id, in increasing order.
+    template <typename F>
+    static void forEach(const query::IdSet &s, F &&f) {
+        for (const auto &c : s.containers()) {
+            uint32_t base = c.high() << 16;
+            forEachLow(c, [&](uint32_t low) { f(base | low); });
+        }
+    }
+
+private:
+    template <typename F>
+    static void forEachLow(const query::IdContainer &c, F &&f) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(c.low().data()), *end = p + c.low().size();
+        if (c.dense()) {
+            for (size_t w = 0; w * 8 < c.low().size(); w++) {
+                uint64_t bits;
+                memcpy(&bits, p + w * 8, 8);
+                for (; bits; bits &= bits - 1) f(uint32_t(w * 64 + __builtin_ctzll(bits)));
+            }
+            return;
+        }
+        uint32_t value = 0;
+        while (p < end) {
+            value += getVarint(p, end);
+            f(value);
+        }
+    }
+
+    // c |= o, for two containers with the same high bits.
+    static void unite(query::IdContainer &c, const query::IdContainer &o) {
+        if (!c.dense() && !o.dense()) {
+            // Both sparse: merge the two gap streams into a third, decoding one value at a time.
+            const string &a = c.low(), &b = o.low();
+            const uint8_t *pa = reinterpret_cast<const uint8_t *>(a.data()), *ea = pa + a.size();
+            const uint8_t *pb = reinterpret_cast<const uint8_t *>(b.data()), *eb = pb + b.size();
+            string low;
+            low.reserve(a.size() + b.size());
+            uint32_t va = 0, vb = 0, prev = 0, n = 0;
+            bool hasA = pa < ea, hasB = pb < eb;
+            if (hasA) va = getVarint(pa, ea);
+            if (hasB) vb = getVarint(pb, eb);
+            while (hasA || hasB) {
+                uint32_t v = !hasB || (hasA && va <= vb) ? va : vb;
+                putVarint(low, v - prev);
+                prev = v;
+                n++;
+                if (hasA && va == v) {
+                    hasA = pa < ea;
+                    if (hasA) va += getVarint(pa, ea);
+                }
+                if (hasB && vb == v) {
+                    hasB = pb < eb;
+                    if (hasB) vb += getVarint(pb, eb);
+                }
+            }
+            c.set_low(std::move(low));
+            c.set_count(n);
+            if (n > kDenseAbove) toDense(c);
+            return;
+        }
+        if (!c.dense()) toDense(c);
+        string &bitmap = *c.mutable_low();
+        bitmap.resize(kBitmapBytes, '\0');
+        if (o.dense()) {
+            size_t n = min(bitmap.size(), o.low().size());
+            for (size_t k = 0; k < n; k++) bitmap[k] = char(uint8_t(bitmap[k]) | uint8_t(o.low()[k]));
+        } else {
+            forEachLow(o, [&](uint32_t low) { setBit(bitmap, low); });
+        }
+        uint32_t n = 0;
+        for (size_t w = 0; w < kBitmapBytes / 8; w++) {
+            uint64_t bits;
+            memcpy(&bits, bitmap.data() + w * 8, 8);
+            n += __builtin_popcountll(bits);
+        }
+        c.set_count(n);
+    }
+
+    static void toDense(query::IdContainer &c) {
+        string bitmap(kBitmapBytes, '\0');
+        forEachLow(c, [&](uint32_t low) { setBit(bitmap, low); });
+        c.set_low(std::move(bitmap));
+        c.set_dense(true);
+    }
+
+    static void setBit(string &bitmap, uint32_t low) { bitmap[low >> 3] = char(uint8_t(bitmap[low >> 3]) | (1u << (low & 7))); }
+
+    static void putVarint(string &out, uint32_t v) {
+        while (v >= 0x80) {
+            out.push_back(char(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(char(v));
+    }
+
+    static uint32_t getVarint(const uint8_t *&p, const uint8_t *end) {
+        uint32_t v = 0;
+        for (int shift = 0; p < end && shift < 35; shift += 7) {
+            uint8_t b = *p++;
+            v |= uint32_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    }
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Read-only memory mapping of a whole file. The mapping lives as long as the object.
+class MappedFile {
+public:
+    MappedFile() = default;
+    explicit MappedFile(const string &path, bool sequential = true) { open(path, sequential); }
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&other) noexcept : addr(other.addr), length(other.length) {
+        other.addr = nullptr;
+        other.length = 0;
+    }
+    MappedFile &operator=(MappedFile &&other) noexcept {
+        if (this != &other) {
+            close();
+            addr = other.addr;
+            length = other.length;
+            other.addr = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+
+    // Map the file read-only. 'sequential' hints the kernel to read ahead aggressively.
+    bool open(const string &path, bool sequential = true) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);  // The mapping keeps its own reference to the file.
+        if (p == MAP_FAILED) return false;
+        madvise(p, st.st_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        addr = p;
+        length = st.st_size;
+        return true;
+    }
+
+    void close() {
+        if (addr) munmap(addr, length);
+        addr = nullptr;
+        length = 0;
+    }
+
+    bool is_open() const { return addr != nullptr; }
+    const char *data() const { return static_cast<const char *>(addr); }
+    size_t size() const { return length; }
+
+private:
+    void *addr = nullptr;
+    size_t length = 0;
+};
+
+#endif
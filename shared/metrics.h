@@ -0,0 +1,254 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+
+using namespace std;
+
+// Writers touch only the shard picked for their thread, so hot counters do not bounce one cache
+// line between cores.
+inline size_t metricShard(size_t shards) {
+    static atomic<size_t> nextThread{0};
+    thread_local size_t mine = nextThread++;
+    return mine % shards;
+}
+
+// Monotonic counter made of per-thread shards; add() is one relaxed atomic add.
+class Counter {
+public:
+    static const size_t kShards = 16;
+
+    void add(uint64_t n = 1) { shards[metricShard(kShards)].v.fetch_add(n, memory_order_relaxed); }
+
+    uint64_t value() const {
+        uint64_t sum = 0;
+        for (const auto &s : shards) sum += s.v.load(memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> v{0};
+    };
+    Shard shards[kShards];
+};
+
+// HDR-style latency histogram in microseconds: log-linear buckets with 16 sub-buckets per power
+// of two, so any recorded value is reported within 1/16 (6.25%) of itself from 1 us up to 2^40 us.
+// Recording is lock-free (relaxed atomic adds into the thread's shard); quantiles merge the
+// shards when read.
+class LatencyHistogram {
+public:
+    static const int kSubBits = 4;
+    static const int kSub = 1 << kSubBits;
+    static const int kMaxExponent = 40;
+    static const int kBuckets = (kMaxExponent - kSubBits + 1) * kSub + kSub;
+    static const size_t kShards = 8;
+
+    struct Snapshot {
+        uint64_t count = 0;
+        uint64_t sumUs = 0;
+        uint64_t maxUs = 0;
+        vector<uint64_t> buckets;
+
+        // Nearest-rank quantile: the bound of the bucket holding the ceil(q * count)-th value.
+        uint64_t quantile(double q) const {
+            if (count == 0) return 0;
+            uint64_t rank = max<uint64_t>(1, uint64_t(ceil(q * double(count)))), seen = 0;
+            for (int b = 0; b < int(buckets.size()); b++) {
+                seen += buckets[b];
+                if (seen >= rank) return min(upperBound(b), maxUs);
+            }
+            return maxUs;
+        }
+    };
+
+    void record(uint64_t us) {
+        Shard &s = shards[metricShard(kShards)];
+        s.buckets[bucketOf(us)].fetch_add(1, memory_order_relaxed);
+        s.count.fetch_add(1, memory_order_relaxed);
+        s.sum.fetch_add(us, memory_order_relaxed);
+        uint64_t seen = s.max.load(memory_order_relaxed);
+        while (us > seen && !s.max.compare_exchange_weak(seen, us, memory_order_relaxed)) {}
+    }
+
+    Snapshot snapshot() const {
+        Snapshot out;
+        out.buckets.assign(kBuckets, 0);
+        for (const auto &s : shards) {
+            out.count += s.count.load(memory_order_relaxed);
+            out.sumUs += s.sum.load(memory_order_relaxed);
+            out.maxUs = max(out.maxUs, s.max.load(memory_order_relaxed));
+            for (int b = 0; b < kBuckets; b++) out.buckets[b] += s.buckets[b].load(memory_order_relaxed);
+        }
+        return out;
+    }
+
+    static int bucketOf(uint64_t v) {
+        if (v < uint64_t(kSub)) return int(v);
+        int e = min(63 - __builtin_clzll(v), kMaxExponent);
+        if (e == kMaxExponent) return kBuckets - 1;
+        int sub = int(v >> (e - kSubBits)) & (kSub - 1);
+        return (e - kSubBits + 1) * kSub + sub;
+    }
+
+    // Largest value that falls in bucket b.
+    static uint64_t upperBound(int b) {
+        if (b < kSub) return uint64_t(b);
+        int e = b / kSub + kSubBits - 1, sub = b % kSub;
+        return ((uint64_t(kSub + sub) << (e - kSubBits)) + (uint64_t(1) << (e - kSubBits))) - 1;
+    }
+
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> buckets[kBuckets] = {};
+        atomic<uint64_t> count{0}, sum{0}, max{0};
+    };
+    Shard shards[kShards];
+};
+
+// Named counters, histograms and gauges of one node, registered once at startup (references
+// stay valid) and rendered for the Stats RPC or in the Prometheus text exposition format.
+class MetricsRegistry {
+public:
+    struct Named {
+        string name;   // Prometheus metric name without the common prefix
+        string help;
+    };
+
+    explicit MetricsRegistry(string prefix) : prefix(std::move(prefix)) {}
+
+    Counter &counter(const string &name, const string &help) {
+        counters.emplace_back();
+        counters.back().first = {name, help};
+        return counters.back().second;
+    }
+
+    LatencyHistogram &histogram(const string &name, const string &help) {
+        histograms.emplace_back();
+        histograms.back().first = {name, help};
+        return histograms.back().second;
+    }
+
+    // A value read when metrics are rendered (queue depth, loaded rows, cache sizes...).
+    void gauge(const string &name, const string &help, function<double()> read) {
+        gauges.push_back({{name, help}, std::move(read)});
+    }
+
+    // A counter kept elsewhere (e.g. ResultCache::Stats), read when metrics are rendered.
+    void counterFrom(const string &name, const string &help, function<uint64_t()> read) {
+        readCounters.push_back({{name, help}, std::move(read)});
+    }
+
+    template <typename F>
+    void forEachCounter(F &&f) const {
+        for (const auto &c : counters) f(c.first, c.second.value());
+        for (const auto &c : readCounters) f(c.first, c.second());
+    }
+    template <typename F>
+    void forEachHistogram(F &&f) const { for (const auto &h : histograms) f(h.first, h.second.snapshot()); }
+    template <typename F>
+    void forEachGauge(F &&f) const { for (const auto &g : gauges) f(g.first, g.second()); }
+
+    // Prometheus text exposition: counters, gauges, and histograms as summaries with quantiles.
+    string prometheus(const string &node) const {
+        string out;
+        char line[512];
+        string label = "node=\"" + node + "\"";
+        forEachCounter([&](const Named &n, uint64_t v) {
+            out += "# HELP " + prefix + n.name + " " + n.help + "\n# TYPE " + prefix + n.name + " counter\n";
+            snprintf(line, sizeof(line), "%s%s{%s} %llu\n", prefix.c_str(), n.name.c_str(), label.c_str(), (unsigned long long)v);
+            out += line;
+        });
+        forEachGauge([&](const Named &n, double v) {
+            out += "# HELP " + prefix + n.name + " " + n.help + "\n# TYPE " + prefix + n.name + " gauge\n";
+            snprintf(line, sizeof(line), "%s%s{%s} %.17g\n", prefix.c_str(), n.name.c_str(), label.c_str(), v);
+            out += line;
+        });
+        forEachHistogram([&](const Named &n, const LatencyHistogram::Snapshot &s) {
+            out += "# HELP " + prefix + n.name + " " + n.help + "\n# TYPE " + prefix + n.name + " summary\n";
+            for (double q : kQuantiles) {
+                snprintf(line, sizeof(line), "%s%s{%s,quantile=\"%g\"} %llu\n", prefix.c_str(), n.name.c_str(), label.c_str(), q,
+                         (unsigned long long)s.quantile(q));
+                out += line;
+            }
+            snprintf(line, sizeof(line), "%s%s_sum{%s} %llu\n%s%s_count{%s} %llu\n", prefix.c_str(), n.name.c_str(), label.c_str(),
+                     (unsigned long long)s.sumUs, prefix.c_str(), n.name.c_str(), label.c_str(), (unsigned long long)s.count);
+            out += line;
+        });
+        return out;
+    }
+
+    static constexpr double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+private:
+    const string prefix;
+    deque<pair<Named, Counter>> counters;
+    deque<pair<Named, LatencyHistogram>> histograms;
+    vector<pair<Named, function<double()>>> gauges;
+    vector<pair<Named, function<uint64_t()>>> readCounters;
+};
+
+// Rewrites a Prometheus text file from a background thread, for the node_exporter textfile
+// collector or any scraper that reads files. Each dump goes to a temporary file that is then
+// renamed over the target, so readers never see a partial file.
+class MetricsFileWriter {
+public:
+    MetricsFileWriter(function<string()> render, string path, chrono::milliseconds every = chrono::seconds(5))
+        : render(std::move(render)), path(std::move(path)) {
+        worker = thread([this, every] {
+            unique_lock<mutex> lock(m);
+            while (!stopping) {
+                lock.unlock();
+                write();
+                lock.lock();
+                wake.wait_for(lock, every, [this] { return stopping; });
+            }
+        });
+    }
+    MetricsFileWriter(const MetricsFileWriter &) = delete;
+    MetricsFileWriter &operator=(const MetricsFileWriter &) = delete;
+
+    ~MetricsFileWriter() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    // False once a dump could not be written.
+    bool ok() const { return healthy; }
+
+private:
+    void write() {
+        string text = render(), tmp = path + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "w");
+        bool done = f && fwrite(text.data(), 1, text.size(), f) == text.size();
+        if (f) done = fclose(f) == 0 && done;
+        healthy = done && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    function<string()> render;
+    const string path;
+    atomic<bool> healthy{true};
+    mutex m;
+    condition_variable wake;
+    thread worker;
+    bool stopping = false;
+};
+
+#endif
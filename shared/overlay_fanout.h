@@ -0,0 +1,297 @@
+#ifndef OVERLAY_FANOUT_H
+#define OVERLAY_FANOUT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
+#include "overlay.grpc.pb.h"
+#include "metrics.h"
+#include "trace.h"
+
+using namespace std;
+
+// Persistent channels and stubs to a node's children. They are created once at startup from the
+// overlay config, so queries reuse the HTTP/2 connections instead of dialing at every hop. A
+// child is a list of replicas serving the same subtree, the primary first; each replica keeps
+// the latency of its replies, which sets when a query hedges to the next one.
+class OverlayChildren {
+public:
+    // A failed replica is asked last for this long.
+    static constexpr chrono::milliseconds kRetryAfter{2000};
+    // Replies seen before a replica's p95 is trusted for hedging.
+    static const uint64_t kMinSamples = 20;
+
+    struct Replica {
+        string target;
+        shared_ptr<grpc::Channel> channel;
+        unique_ptr<overlay::OverlayComm::Stub> stub;
+        LatencyHistogram latency;                  // successful PushData replies, microseconds
+        atomic<uint64_t> failedAtUs{0};            // last failed call, 0 if none
+        atomic<uint64_t> p95Us{0}, p95AtUs{0};     // hedge delay, recomputed at most every 100 ms
+
+        bool healthy(uint64_t nowUs) const {
+            uint64_t failed = failedAtUs.load(memory_order_relaxed);
+            return failed == 0 || nowUs - failed > uint64_t(chrono::microseconds(kRetryAfter).count());
+        }
+
+        // How long to wait for this replica before hedging; 0 while it has too few replies to tell.
+        uint64_t hedgeDelayUs(uint64_t nowUs) {
+            if (nowUs - p95AtUs.load(memory_order_relaxed) > 100000) {
+                LatencyHistogram::Snapshot s = latency.snapshot();
+                p95Us.store(s.count >= kMinSamples ? max<uint64_t>(s.quantile(0.95), 1) : 0, memory_order_relaxed);
+                p95AtUs.store(nowUs, memory_order_relaxed);
+            }
+            return p95Us.load(memory_order_relaxed);
+        }
+    };
+
+    struct Child {
+        string target;                           // the primary's address, used in logs and spans
+        vector<unique_ptr<Replica>> replicas;    // primary first
+
+        // Replicas in the order to ask them: those that have not failed lately first, in config order.
+        vector<Replica *> order() const {
+            uint64_t now = Tracing::nowUs();
+            vector<Replica *> out;
+            for (const auto &r : replicas) if (r->healthy(now)) out.push_back(r.get());
+            for (const auto &r : replicas) if (!r->healthy(now)) out.push_back(r.get());
+            return out;
+        }
+
+        // The replica to ask for a single call (summaries, row streams).
+        Replica &preferred() const { return *order().front(); }
+    };
+
+    // One list of replica addresses per child.
+    void connect(const vector<vector<string>> &targets) {
+        children.clear();
+        for (const auto &addresses : targets) {
+            Child c;
+            c.target = addresses.front();
+            for (const auto &target : addresses) {
+                grpc::ChannelArguments args;
+                // Keep idle connections alive between queries.
+                args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, 30000);
+                args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+                auto r = make_unique<Replica>();
+                r->target = target;
+                r->channel = grpc::CreateCustomChannel(target, grpc::InsecureChannelCredentials(), args);
+                r->stub = overlay::OverlayComm::NewStub(r->channel);
+                c.replicas.push_back(std::move(r));
+            }
+            children.push_back(std::move(c));
+        }
+    }
+
+    size_t size() const { return children.size(); }
+    bool empty() const { return children.empty(); }
+    const Child &operator[](size_t i) const { return children[i]; }
+
+private:
+    vector<Child> children;
+};
+
+// Background thread that asks each of a node's children in turn for what it advertises: every
+// second until all of them are settled, then every 'interval'. fetch(i, replica) makes one call to
+// a replica of child i, keeps the reply and tells whether it answered; replicas hold the same
+// subtree, so the first that answers will do. settled(i) tells whether child i needs no faster
+// refresh. Owners declare their poller last, so it stops before the state fetch writes goes away.
+class ChildPoller {
+public:
+    using Fetch = function<bool(size_t child, OverlayChildren::Replica &replica)>;
+    using Settled = function<bool(size_t child)>;
+
+    ChildPoller() = default;
+    ChildPoller(const ChildPoller &) = delete;
+    ChildPoller &operator=(const ChildPoller &) = delete;
+
+    ~ChildPoller() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (poller.joinable()) poller.join();
+    }
+
+    void start(const OverlayChildren &children, chrono::milliseconds interval, Fetch fetch, Settled settled) {
+        if (children.empty()) return;
+        poller = thread([this, &children, interval, fetch = std::move(fetch), settled = std::move(settled)] {
+            unique_lock<mutex> lock(m);
+            while (!stopping) {
+                lock.unlock();
+                bool all = true;
+                for (size_t i = 0; i < children.size(); i++) {
+                    for (OverlayChildren::Replica *r : children[i].order())
+                        if (fetch(i, *r)) break;
+                    all = settled(i) && all;
+                }
+                lock.lock();
+                wake.wait_for(lock, all ? interval : chrono::milliseconds(1000), [this] { return stopping; });
+            }
+        });
+    }
+
+private:
+    mutex m;
+    condition_variable wake;
+    thread poller;
+    bool stopping = false;
+};
+
+// One PushData call to each of the 'targets' (indices into children), all in flight at once.
+// start() returns immediately; each child's reply is handed to onReply(outcome, status, ack) on a
+// gRPC thread as it arrives, so the latency is the slowest branch rather than the sum. Calls to
+// onReply never overlap, and there is exactly one per target.
+//
+// Every call carries 'deadline'. When a child has replicas, a call that fails is retried on the
+// next replica while time remains, and a call still running past the replica's p95 latency is
+// hedged: the same request goes to the next replica, the first reply wins and the other call is
+// cancelled. A non-zero traceId is passed on in the calls' metadata.
+class OverlayFanOut {
+public:
+    // How a child's reply was obtained.
+    struct Outcome {
+        string child;           // the child's primary address
+        string target;          // replica that answered, or the last one that failed
+        size_t hedges = 0;      // duplicate calls sent because a replica was slower than its p95
+        size_t failovers = 0;   // calls sent because a replica failed
+    };
+
+    template <typename OnReply>
+    static void start(const OverlayChildren &children, const vector<size_t> &targets, const overlay::OverlayRequest &request,
+                      chrono::system_clock::time_point deadline, uint64_t traceId, OnReply onReply) {
+        if (targets.empty()) return;
+        auto state = make_shared<State<OnReply>>(request, deadline, traceId, std::move(onReply));
+        state->branches.resize(targets.size());
+        for (size_t i = 0; i < targets.size(); i++) {
+            Branch &b = state->branches[i];
+            b.replicas = children[targets[i]].order();
+            b.outcome.child = children[targets[i]].target;
+            Attempt *a;
+            {
+                lock_guard<mutex> lock(state->replyMutex);
+                a = next(b);
+            }
+            launch(state, i, a);
+        }
+    }
+
+private:
+    struct Attempt {
+        OverlayChildren::Replica *replica;
+        grpc::ClientContext ctx;
+        overlay::OverlayAck ack;
+        uint64_t startUs = 0;
+    };
+
+    // The calls made for one child.
+    struct Branch {
+        vector<OverlayChildren::Replica *> replicas;   // in the order to try them
+        deque<Attempt> attempts;                       // ClientContext is not movable
+        size_t running = 0;
+        bool done = false;
+        Outcome outcome;
+        unique_ptr<grpc::Alarm> hedge;
+    };
+
+    // Shared by the outstanding calls and released with the last one.
+    template <typename OnReply>
+    struct State {
+        State(const overlay::OverlayRequest &req, chrono::system_clock::time_point deadline, uint64_t traceId, OnReply f)
+            : request(req), deadline(deadline), traceId(traceId), onReply(std::move(f)) {}
+        deque<Branch> branches;
+        overlay::OverlayRequest request;
+        const chrono::system_clock::time_point deadline;
+        const uint64_t traceId;
+        OnReply onReply;
+        mutex replyMutex;   // guards the branches and serializes onReply
+    };
+
+    // A new call to the branch's next untried replica; null when none is left. Called locked.
+    static Attempt *next(Branch &b) {
+        if (b.attempts.size() >= b.replicas.size()) return nullptr;
+        b.attempts.emplace_back();
+        Attempt &a = b.attempts.back();
+        a.replica = b.replicas[b.attempts.size() - 1];
+        b.running++;
+        return &a;
+    }
+
+    template <typename OnReply>
+    static void launch(const shared_ptr<State<OnReply>> &state, size_t i, Attempt *a) {
+        a->ctx.set_deadline(state->deadline);
+        Tracing::propagate(a->ctx, state->traceId);
+        a->startUs = Tracing::nowUs();
+        armHedge(state, i, a);
+        a->replica->stub->async()->PushData(&a->ctx, &state->request, &a->ack, [state, i, a](grpc::Status status) {
+            finished(state, i, a, status);
+        });
+    }
+
+    // Hedge to the next replica once 'a' has taken longer than its replica's p95.
+    template <typename OnReply>
+    static void armHedge(const shared_ptr<State<OnReply>> &state, size_t i, Attempt *a) {
+        Branch &b = state->branches[i];
+        uint64_t delay = a->replica->hedgeDelayUs(a->startUs);
+        auto at = chrono::system_clock::now() + chrono::microseconds(delay);
+        lock_guard<mutex> lock(state->replyMutex);
+        if (b.done || delay == 0 || b.attempts.size() >= b.replicas.size() || at >= state->deadline) return;
+        b.hedge = make_unique<grpc::Alarm>();
+        weak_ptr<State<OnReply>> weak = state;
+        b.hedge->Set(at, [weak, i](bool fired) {
+            shared_ptr<State<OnReply>> state = weak.lock();
+            if (!fired || !state) return;
+            Attempt *h;
+            {
+                lock_guard<mutex> lock(state->replyMutex);
+                Branch &b = state->branches[i];
+                if (b.done || !(h = next(b))) return;
+                b.outcome.hedges++;
+            }
+            launch(state, i, h);
+        });
+    }
+
+    template <typename OnReply>
+    static void finished(const shared_ptr<State<OnReply>> &state, size_t i, Attempt *a, const grpc::Status &status) {
+        uint64_t now = Tracing::nowUs();
+        Attempt *retry = nullptr;
+        vector<grpc::ClientContext *> losers;
+        {
+            lock_guard<mutex> lock(state->replyMutex);
+            Branch &b = state->branches[i];
+            b.running--;
+            if (b.done) return;   // a cancelled or late duplicate
+            if (status.ok()) {
+                a->replica->latency.record(now - a->startUs);
+                a->replica->failedAtUs.store(0, memory_order_relaxed);
+            } else if (status.error_code() != grpc::StatusCode::CANCELLED) {
+                a->replica->failedAtUs.store(now, memory_order_relaxed);
+            }
+            b.outcome.target = a->replica->target;
+            if (!status.ok() && status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED &&
+                chrono::system_clock::now() < state->deadline && (retry = next(b))) {
+                b.outcome.failovers++;
+            } else if (status.ok() || b.running == 0) {
+                b.done = true;
+                for (Attempt &other : b.attempts)
+                    if (&other != a) losers.push_back(&other.ctx);
+                state->onReply(b.outcome, status, a->ack);
+            }
+        }
+        for (grpc::ClientContext *ctx : losers) ctx->TryCancel();
+        if (retry) launch(state, i, retry);
+    }
+};
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef PARTITION_EPOCHS_H
+#define PARTITION_EPOCHS_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <cstring>
+#include "vectorized_dataset.h"
+#include "query_engine.h"
+#include "partition_summary.h"
+#include "rollup_cube.h"
+
+using namespace std;
+
+// Rows of a partition that never change once published: the rows loaded at startup, or rows
+// appended to the data file in epochs firstEpoch..lastEpoch. Each segment carries its own indexes,
+// zone maps, summary and rollup cube, built when it is loaded.
+struct PartitionSegment {
+    VectorizedDataSet data;
+    query::PartitionSummary summary;
+    shared_ptr<const RollupCube> cube;
+    uint64_t firstEpoch = 0;
+    uint64_t lastEpoch = 0;
+};
+
+// A node's partition as of one epoch: the startup segment followed by the appended ones. An epoch
+// is immutable; a query takes the current one when it starts and keeps it to the end, so appends
+// never block or disturb it.
+struct PartitionEpoch {
+    uint64_t epoch = 0;                  // 0 at startup, then one more per append
+    uint64_t baseVersion = 0;            // identity of the file and partition loaded at startup
+    uint64_t version = 0;                // data_version of results: baseVersion + epoch
+    size_t rows = 0;
+    vector<shared_ptr<const PartitionSegment>> segments;
+    query::PartitionSummary summary;     // zone maps of all segments
+    shared_ptr<const RollupCube> cube;   // rollup of all segments, at 'version'
+
+    // The epoch a result of data_version 'v' was computed at, if it is this one or an earlier one.
+    bool epochOf(uint64_t v, uint64_t &out) const {
+        if (v < baseVersion || v > version) return false;
+        out = v - baseVersion;
+        return true;
+    }
+
+    // The segments holding exactly the rows appended after epoch 'since'; false when they were
+    // compacted together with older rows.
+    bool appendedSince(uint64_t since, vector<const VectorizedDataSet *> &out) const {
+        for (const auto &s : segments) {
+            if (s->lastEpoch <= since) continue;
+            if (s->firstEpoch <= since) return false;
+            out.push_back(&s->data);
+        }
+        return true;
+    }
+
+    // q over the given segments (all of them by default), merged.
+    query::QueryResult evaluate(const query::Query &q, const vector<const VectorizedDataSet *> *only = nullptr) const {
+        vector<const VectorizedDataSet *> all;
+        if (!only) {
+            for (const auto &s : segments) all.push_back(&s->data);
+            only = &all;
+        }
+        query::QueryResult result = QueryEngine::emptyResult(q);
+        for (const VectorizedDataSet *ds : *only) QueryEngine::merge(result, QueryEngine::evaluate(*ds, q), q);
+        result.set_data_version(version);
+        return result;
+    }
+
+    // Several queries over all segments, in their order; each segment is scanned once for all of them.
+    vector<query::QueryResult> evaluateBatch(const vector<const query::Query *> &qs) const {
+        vector<query::QueryResult> results;
+        for (const query::Query *q : qs) results.push_back(QueryEngine::emptyResult(*q));
+        for (const auto &s : segments) {
+            vector<query::QueryResult> part = QueryEngine::evaluateBatch(s->data, qs);
+            for (size_t k = 0; k < qs.size(); k++) QueryEngine::merge(results[k], part[k], *qs[k]);
+        }
+        for (auto &r : results) r.set_data_version(version);
+        return results;
+    }
+};
+
+// The current epoch of a node's partition. Readers load it with one atomic shared_ptr read; the
+// single writer (the loader, then the tail) builds the next epoch aside and publishes it whole.
+class PartitionEpochs {
+public:
+    static const size_t kMaxAppendedSegments = 8;
+
+    shared_ptr<const PartitionEpoch> current() const { return atomic_load(&head); }
+
+    // Publish epoch 0: the rows loaded at startup, with their summary and cube (computed by the
+    // loader, or stored in the partition's snapshot).
+    void reset(VectorizedDataSet base, uint64_t version, query::PartitionSummary summary, shared_ptr<const RollupCube> cube) {
+        auto segment = make_shared<PartitionSegment>();
+        segment->data = std::move(base);
+        segment->summary = std::move(summary);
+        segment->cube = std::move(cube);
+        auto e = make_shared<PartitionEpoch>();
+        e->baseVersion = e->version = version;
+        e->rows = segment->data.size();
+        e->summary = segment->summary;
+        e->cube = segment->cube;
+        e->segments.push_back(std::move(segment));
+        atomic_store(&head, shared_ptr<const PartitionEpoch>(std::move(e)));
+    }
+
+    // Publish the next epoch, which adds 'rows'. When 'replacesAppended' is set, 'rows' holds every
+    // appended row (a compaction) and takes the place of the appended segments. The summary and
+    // the cube are extended rather than recomputed.
+    void append(VectorizedDataSet rows, bool replacesAppended) {
+        shared_ptr<const PartitionEpoch> last = current();
+        auto e = make_shared<PartitionEpoch>(*last);
+        e->epoch = last->epoch + 1;
+        e->version = e->baseVersion + e->epoch;
+        auto segment = make_shared<PartitionSegment>();
+        segment->data = std::move(rows);
+        segment->summary = PartitionSummaries::of(segment->data, 0);
+        segment->cube = make_shared<const RollupCube>(RollupCube::of(segment->data, 0));
+        segment->firstEpoch = replacesAppended ? 1 : e->epoch;
+        segment->lastEpoch = e->epoch;
+        if (replacesAppended) e->segments.resize(1);
+        // A compaction's segment re-reads the appended rows, so it extends the startup segment's
+        // summary and cube rather than the last epoch's.
+        e->summary = PartitionSummaries::combine({replacesAppended ? e->segments[0]->summary : last->summary, segment->summary});
+        e->summary.set_data_version(e->version);
+        auto cube = make_shared<RollupCube>(replacesAppended ? *e->segments[0]->cube : *last->cube);
+        cube->merge(*segment->cube);
+        cube->version = e->version;
+        e->cube = std::move(cube);
+        e->segments.push_back(std::move(segment));
+        e->rows = 0;
+        for (const auto &s : e->segments) e->rows += s->data.size();
+        atomic_store(&head, shared_ptr<const PartitionEpoch>(std::move(e)));
+    }
+
+private:
+    shared_ptr<const PartitionEpoch> head;
+};
+
+// Follows the data file for rows appended after startup (new collisions arrive daily). A
+// background thread checks the file every 'interval', parses the whole rows added since the
+// last check, keeps the ones the partition spec assigns to this node and publishes them as a new
+// epoch. Only the new rows are parsed and indexed; once kMaxAppendedSegments segments have been
+// appended, the next append re-reads all appended rows from the file as one segment. Writers
+// must append whole rows; the file is expected to only grow, and following stops if it shrinks.
+class PartitionTail {
+public:
+    // Called after each append with the rows this node kept, the malformed input among the new
+    // rows and the new epoch.
+    using OnAppend = function<void(size_t rows, const VectorizedDataSet::CsvErrors &errors, const PartitionEpoch &epoch)>;
+
+    // 'bytes' is where the whole rows the startup load read end (see DatasetSnapshot::loadPartition).
+    PartitionTail(PartitionEpochs &epochs, string dataFile, PartitionSpec spec, uint64_t bytes, chrono::milliseconds interval,
+                  OnAppend onAppend)
+        : epochs(epochs), dataFile(std::move(dataFile)), spec(std::move(spec)), onAppend(std::move(onAppend)),
+          baseBytes(bytes), offset(bytes) {
+        worker = thread([this, interval] {
+            unique_lock<mutex> lock(m);
+            while (!stopping) {
+                wake.wait_for(lock, interval, [this] { return stopping; });
+                if (stopping) break;
+                lock.unlock();
+                bool more = poll();
+                lock.lock();
+                if (!more) break;
+            }
+        });
+    }
+    PartitionTail(const PartitionTail &) = delete;
+    PartitionTail &operator=(const PartitionTail &) = delete;
+
+    ~PartitionTail() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+private:
+    // Read what was appended since the last call; false once the file can no longer be followed.
+    bool poll() {
+        shared_ptr<const PartitionEpoch> last = epochs.current();
+        if (!last) return false;
+        MappedFile file(dataFile, false);
+        if (!file.is_open() || file.size() < offset) {
+            cerr << "Data file " << dataFile << " shrank or disappeared; no longer following it" << endl;
+            return false;
+        }
+        const char *data = file.data(), *start = data + offset;
+        const char *end = CsvTokenizer::lastRowEnd(start, data + file.size());   // a partial last row waits for the next call
+        if (end == start) return true;
+
+        size_t appended = last->segments.size() - 1;
+        bool compact = appended >= PartitionEpochs::kMaxAppendedSegments;
+        VectorizedDataSet rows;
+        if (!rows.loadAppended(compact ? data + baseBytes : start, end, spec)) return false;
+        offset = uint64_t(end - data);
+        size_t kept = compact ? rows.size() - (last->rows - last->segments[0]->data.size()) : rows.size();
+        VectorizedDataSet::CsvErrors errors = rows.csvErrors;
+        if (compact) {
+            // The rows read again were counted when first appended.
+            for (size_t i = 1; i < last->segments.size(); i++) {
+                errors.rows -= last->segments[i]->data.csvErrors.rows;
+                errors.fields -= last->segments[i]->data.csvErrors.fields;
+                errors.overflowed -= last->segments[i]->data.csvErrors.overflowed;
+            }
+        }
+        if (kept == 0 && !compact) return true;
+        epochs.append(std::move(rows), compact);
+        onAppend(kept, errors, *epochs.current());
+        return true;
+    }
+
+    PartitionEpochs &epochs;
+    const string dataFile;
+    const PartitionSpec spec;
+    const OnAppend onAppend;
+    const uint64_t baseBytes;   // the whole rows the startup load read
+    uint64_t offset;            // the file has been read up to here, always a row end
+    mutex m;
+    condition_variable wake;
+    thread worker;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef PARTITION_SUMMARY_H
+#define PARTITION_SUMMARY_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <grpcpp/grpcpp.h>
+#include "overlay.grpc.pb.h"
+#include "query_engine.h"
+#include "overlay_fanout.h"
+
+using namespace std;
+
+// Zone maps of a subtree (query::PartitionSummary): for every numeric column the smallest and
+// largest non-missing value, and for every dictionary column the values present when there are at
+// most kMaxValues of them. Each node advertises the summary of its subtree to its parent, which
+// skips the children a query cannot match. Pruning never changes a result: a subtree is skipped
+// only when its summary is complete and proves that no row passes some predicate.
+class PartitionSummaries {
+public:
+    static const size_t kMaxValues = 256;
+
+    // Summary of one partition.
+    static query::PartitionSummary of(const VectorizedDataSet &ds, uint64_t dataVersion) {
+        query::PartitionSummary s;
+        s.set_rows(ds.size());
+        s.set_complete(true);
+        s.set_data_version(dataVersion);
+        for (int c = query::Column_MIN; c <= query::Column_MAX; c++) {
+            if (c == query::COLUMN_UNSPECIFIED) continue;
+            query::ColumnSummary out;
+            out.set_column(query::Column(c));
+            bool known = visit([&](auto col) {
+                using Ref = decltype(col);
+                if constexpr (is_same_v<Ref, const Column<int32_t> *>) {
+                    return range(col->data(), col->size(), [](int32_t v) { return v != VectorizedDataSet::kNullDate; }, out);
+                } else if constexpr (is_same_v<Ref, const Column<int16_t> *>) {
+                    return range(col->data(), col->size(), [](int16_t v) { return v >= 0; }, out);
+                } else if constexpr (is_same_v<Ref, const Column<float> *>) {
+                    return range(col->data(), col->size(), [](float v) { return !std::isnan(v); }, out);
+                } else if constexpr (is_same_v<Ref, const DictColumn<uint16_t> *>) {
+                    vector<uint8_t> present(col->cardinality(), 0);
+                    const uint16_t *codes = col->codeData().data();
+                    for (size_t i = 0; i < col->size(); i++) present[codes[i]] = 1;
+                    set<string_view> values;
+                    for (size_t code = 0; code < present.size(); code++)
+                        if (present[code]) values.insert(col->dictionary()[code]);
+                    if (values.size() > kMaxValues) return false;
+                    for (string_view v : values) out.add_values(string(v));
+                    return true;
+                } else {
+                    return false;   // free-text columns are not summarized
+                }
+            }, QueryEngine::columnOf(ds, query::Column(c)));
+            if (known) *s.add_columns() = std::move(out);
+        }
+        return s;
+    }
+
+    // Summary of a subtree from those of its parts. A column is kept only if every non-empty part
+    // summarizes it.
+    static query::PartitionSummary combine(const vector<query::PartitionSummary> &parts) {
+        query::PartitionSummary s;
+        s.set_complete(true);
+        bool first = true;
+        for (const auto &p : parts) {
+            s.set_rows(s.rows() + p.rows());
+            s.set_complete(s.complete() && p.complete());
+            s.set_data_version(s.data_version() + p.data_version());
+            if (p.rows() == 0) continue;
+            if (first) {
+                *s.mutable_columns() = p.columns();
+                first = false;
+                continue;
+            }
+            google::protobuf::RepeatedPtrField<query::ColumnSummary> kept;
+            for (const auto &c : s.columns()) {
+                const query::ColumnSummary *other = columnSummary(p, c.column());
+                if (!other) continue;
+                query::ColumnSummary merged = c;
+                if (other->has_min() && (!merged.has_min() || other->min() < merged.min())) merged.set_min(other->min());
+                if (other->has_max() && (!merged.has_max() || other->max() > merged.max())) merged.set_max(other->max());
+                if (c.values_size() || other->values_size()) {
+                    set<string> values(c.values().begin(), c.values().end());
+                    values.insert(other->values().begin(), other->values().end());
+                    if (values.size() > kMaxValues) continue;
+                    merged.clear_values();
+                    for (const auto &v : values) merged.add_values(v);
+                }
+                *kept.Add() = std::move(merged);
+            }
+            s.mutable_columns()->Swap(&kept);
+        }
+        return s;
+    }
+
+    // False only when no row summarized by s can match every predicate of q.
+    static bool mayMatch(const query::PartitionSummary &s, const query::Query &q) {
+        if (!s.complete()) return true;
+        if (s.rows() == 0) return false;
+        const double inf = numeric_limits<double>::infinity();
+        for (const auto &p : q.where()) {
+            if (p.test_case() == query::Predicate::kBox || p.test_case() == query::Predicate::kRadius) {
+                // No overlap between the predicate's box and the subtree's coordinates.
+                SpatialGrid::Box b = QueryEngine::geoBounds(p);
+                const query::ColumnSummary *lat = columnSummary(s, query::LATITUDE), *lon = columnSummary(s, query::LONGITUDE);
+                if (lat && (!lat->has_min() || b.maxLat < lat->min() || b.minLat > lat->max())) return false;
+                if (lon && (!lon->has_min() || b.maxLon < lon->min() || b.minLon > lon->max())) return false;
+                continue;
+            }
+            const query::ColumnSummary *c = columnSummary(s, p.column());
+            if (!c) continue;
+            double lo = -inf, hi = inf;
+            switch (p.test_case()) {
+            case query::Predicate::kDateWindow:
+                if (!p.date_window().from().empty()) lo = VectorizedDataSet::parseDate(p.date_window().from());
+                if (!p.date_window().to().empty()) hi = VectorizedDataSet::parseDate(p.date_window().to());
+                break;
+            case query::Predicate::kRange:
+                if (p.range().has_min()) lo = p.range().min();
+                if (p.range().has_max()) hi = p.range().max();
+                break;
+            case query::Predicate::kEquals:
+                if (!contains(*c, p.equals())) return false;
+                continue;
+            case query::Predicate::kIn:
+                if (none_of(p.in().values().begin(), p.in().values().end(), [&](const string &v) { return contains(*c, v); }))
+                    return false;
+                continue;
+            default:
+                continue;
+            }
+            // Only missing values, which no range matches, or no overlap with the range.
+            if (!c->has_min() || hi < c->min() || lo > c->max()) return false;
+        }
+        return true;
+    }
+
+private:
+    template <typename T, typename Present>
+    static bool range(const T *v, size_t n, Present present, query::ColumnSummary &out) {
+        double lo = numeric_limits<double>::infinity(), hi = -lo;
+        #pragma omp parallel for reduction(min:lo) reduction(max:hi)
+        for (size_t i = 0; i < n; i++) {
+            if (!present(v[i])) continue;
+            lo = min(lo, double(v[i]));
+            hi = max(hi, double(v[i]));
+        }
+        if (lo <= hi) {
+            out.set_min(lo);
+            out.set_max(hi);
+        }
+        return true;
+    }
+
+    static const query::ColumnSummary *columnSummary(const query::PartitionSummary &s, query::Column column) {
+        for (const auto &c : s.columns())
+            if (c.column() == column) return &c;
+        return nullptr;
+    }
+
+    // Dictionary columns list their values; a numeric column never matches a string test.
+    static bool contains(const query::ColumnSummary &c, const string &value) {
+        return std::find(c.values().begin(), c.values().end(), value) != c.values().end();
+    }
+};
+
+// The summaries a node's children advertise. A ChildPoller calls Describe on every child:
+// every second until all of them have answered with a complete summary, then every 'interval'.
+class ChildSummaries {
+public:
+    void start(const OverlayChildren &children, const string &origin, chrono::milliseconds interval = chrono::seconds(10)) {
+        known.assign(children.size(), false);
+        summaries.assign(children.size(), query::PartitionSummary());
+        poller.start(children, interval, [this, origin](size_t i, OverlayChildren::Replica &r) {
+            overlay::DescribeRequest request;
+            request.set_origin(origin);
+            query::PartitionSummary s;
+            grpc::ClientContext ctx;
+            ctx.set_deadline(chrono::system_clock::now() + chrono::seconds(2));
+            if (!r.stub->Describe(&ctx, request, &s).ok()) return false;
+            lock_guard<mutex> lock(m);
+            summaries[i] = std::move(s);
+            known[i] = true;
+            return true;
+        }, [this](size_t i) {
+            lock_guard<mutex> lock(m);
+            return known[i] && summaries[i].complete();
+        });
+    }
+
+    // Child i's last summary; false when it has not answered yet.
+    bool get(size_t i, query::PartitionSummary &out) const {
+        lock_guard<mutex> lock(m);
+        if (!known[i]) return false;
+        out = summaries[i];
+        return true;
+    }
+
+    // Summary of every child; an unknown child counts as an incomplete, empty subtree.
+    vector<query::PartitionSummary> all() const {
+        lock_guard<mutex> lock(m);
+        vector<query::PartitionSummary> out = summaries;
+        for (size_t i = 0; i < out.size(); i++)
+            if (!known[i]) out[i].set_complete(false);
+        return out;
+    }
+
+    // Sum of the children's data versions, the share of a merged result's version they account for.
+    uint64_t version() const {
+        lock_guard<mutex> lock(m);
+        uint64_t v = 0;
+        for (size_t i = 0; i < summaries.size(); i++)
+            if (known[i]) v += summaries[i].data_version();
+        return v;
+    }
+
+private:
+    mutable mutex m;
+    vector<bool> known;
+    vector<query::PartitionSummary> summaries;
+    ChildPoller poller;
+};
+
+#endif
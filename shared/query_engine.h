@@ -0,0 +1,764 @@
+#ifndef QUERY_ENGINE_H
+#define QUERY_ENGINE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <charconv>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <omp.h>
+#include "vectorized_dataset.h"
+#include "scan_kernels.h"
+#include "id_set.h"
+#include "spatial_index.h"
+#include "query.pb.h"
+
+using namespace std;
+
+// Evaluates query::Query messages against one VectorizedDataSet partition and merges partial
+// results from several partitions. A partial result holds per-group row counts and aggregate
+// values that combine associatively (COUNT/SUM add, MIN/MAX compare), so a parent can merge its
+// children's results without seeing their rows.
+class QueryEngine {
+public:
+    // Legacy payload: rows with at least minInjured persons injured.
+    static query::Query fromThreshold(int minInjured) {
+        query::Query q;
+        query::Predicate *p = q.add_where();
+        p->set_column(query::NUMBER_OF_PERSONS_INJURED);
+        p->mutable_range()->set_min(minInjured);
+        return q;
+    }
+
+    // The request's structured query, or its legacy threshold payload when no query is set.
+    template <typename Request>
+    static bool fromRequest(const Request &request, query::Query &out, string &error) {
+        if (request.has_query()) {
+            out = request.query();
+            return true;
+        }
+        const string &payload = request.payload();
+        int threshold = 0;
+        auto res = from_chars(payload.data(), payload.data() + payload.size(), threshold);
+        if (payload.empty() || res.ec != errc() || res.ptr != payload.data() + payload.size()) {
+            error = "payload is not an integer threshold and no query is set";
+            return false;
+        }
+        out = fromThreshold(threshold);
+        return true;
+    }
+
+    // Empty when the query is valid for the dataset's schema, otherwise what is wrong with it.
+    static string validate(const query::Query &q) {
+        const VectorizedDataSet &schema = schemaDataset();
+        for (const auto &p : q.where()) {
+            ColumnRef col = columnOf(schema, p.column());
+            string name = query::Column_Name(p.column());
+            if (holds_alternative<monostate>(col)) return "predicate on unknown column " + name;
+            switch (p.test_case()) {
+            case query::Predicate::kRange:
+                if (p.column() == query::CRASH_DATE) return "use date_window for CRASH_DATE";
+                if (!isNumeric(col)) return "range predicate on non-numeric column " + name;
+                if ((p.range().has_min() && isnan(p.range().min())) || (p.range().has_max() && isnan(p.range().max())))
+                    return "range bound is not a number";
+                break;
+            case query::Predicate::kEquals:
+            case query::Predicate::kIn:
+                if (isNumeric(col)) return "string predicate on numeric column " + name + " (use range)";
+                break;
+            case query::Predicate::kBox:
+            case query::Predicate::kRadius:
+                if (p.column() != query::LOCATION) return "box and radius apply to LOCATION only";
+                if (string e = validateGeo(p); !e.empty()) return e;
+                break;
+            case query::Predicate::kDateWindow:
+                if (p.column() != query::CRASH_DATE) return "date_window applies to CRASH_DATE only";
+                if ((!p.date_window().from().empty() && VectorizedDataSet::parseDate(p.date_window().from()) == VectorizedDataSet::kNullDate) ||
+                    (!p.date_window().to().empty() && VectorizedDataSet::parseDate(p.date_window().to()) == VectorizedDataSet::kNullDate))
+                    return "date_window bound is not a date";
+                break;
+            default:
+                return "predicate on " + name + " has no test";
+            }
+        }
+        for (const auto &a : q.aggregates()) {
+            if (a.op() == query::COUNT) continue;
+            ColumnRef col = columnOf(schema, a.column());
+            if (!isNumeric(col)) return "aggregate over non-numeric column " + query::Column_Name(a.column());
+            if (a.op() == query::SUM && (a.column() == query::CRASH_DATE || a.column() == query::CRASH_TIME))
+                return "SUM over " + query::Column_Name(a.column()) + " is not meaningful";
+        }
+        if (q.group_by() != query::COLUMN_UNSPECIFIED &&
+            !holds_alternative<const DictColumn<uint16_t> *>(columnOf(schema, q.group_by())))
+            return "group_by needs a dictionary-encoded column, not " + query::Column_Name(q.group_by());
+        return "";
+    }
+
+    // Partial result of a validated query over this partition.
+    static query::QueryResult evaluate(const VectorizedDataSet &ds, const query::Query &q) {
+        return std::move(evaluateBatch(ds, {&q})[0]);
+    }
+
+    // Partial results of several validated queries over this partition, in their order. The
+    // queries that need a scan share one pass over the blocks: a block's task runs every query
+    // whose plan keeps the block while its columns are still in cache, so N queries cost about
+    // one trip through memory instead of N.
+    static vector<query::QueryResult> evaluateBatch(const VectorizedDataSet &ds, const vector<const query::Query *> &qs) {
+        vector<Evaluation> evals;
+        evals.reserve(qs.size());
+        for (const query::Query *q : qs) evals.push_back(prepare(ds, *q));
+
+        // The planned blocks of all queries, by block: entries[first[b], first[b + 1]) are the
+        // queries that scan block b.
+        size_t n = ds.size(), blocks = (n + ScanKernels::kBlockRows - 1) / ScanKernels::kBlockRows;
+        vector<uint32_t> first(blocks + 1, 0);
+        for (const auto &e : evals)
+            for (const auto &b : e.plan) first[b.block + 1]++;
+        for (size_t b = 0; b < blocks; b++) first[b + 1] += first[b];
+        vector<pair<uint32_t, uint64_t>> entries(first[blocks]);   // query, filters to test
+        vector<uint32_t> next(first.begin(), first.end() - 1);
+        for (size_t k = 0; k < evals.size(); k++)
+            for (const auto &b : evals[k].plan) entries[next[b.block]++] = {uint32_t(k), b.test};
+        vector<size_t> scanned;
+        for (size_t b = 0; b < blocks; b++)
+            if (first[b + 1] > first[b]) scanned.push_back(b);
+
+        ScanPool &pool = ScanPool::shared();
+        vector<vector<Accumulator>> perSlot;   // query x slot
+        for (const auto &e : evals)
+            perSlot.emplace_back(e.plan.empty() ? 0 : pool.slots(), Accumulator(e.groups, e.metrics.size()));
+        vector<BlockScratch> scratch(pool.slots());
+        pool.forEach(scanned.size(), [&](size_t i) { return scanned[i]; }, [&](size_t i, size_t slot) {
+            size_t b = scanned[i];
+            for (uint32_t j = first[b]; j < first[b + 1]; j++) {
+                size_t k = entries[j].first;
+                evals[k].scan(b, entries[j].second, n, perSlot[k][slot], scratch[slot]);
+            }
+        });
+
+        vector<query::QueryResult> results;
+        results.reserve(qs.size());
+        for (size_t k = 0; k < evals.size(); k++) {
+            for (const auto &acc : perSlot[k]) evals[k].total.absorb(acc, evals[k].metrics);
+            results.push_back(finish(ds, *qs[k], evals[k]));
+        }
+        return results;
+    }
+
+    // COLLISION_IDs of the given rows; ids that are not numbers are left out.
+    static query::IdSet idsOf(const VectorizedDataSet &ds, const vector<RowId> &rows) {
+        vector<uint32_t> ids;
+        ids.reserve(rows.size());
+        for (RowId r : rows) {
+            string_view s = ds.collision_id[r];
+            uint32_t id;
+            auto res = from_chars(s.data(), s.data() + s.size(), id);
+            if (res.ec == errc() && res.ptr == s.data() + s.size()) ids.push_back(id);
+        }
+        return IdSets::of(std::move(ids));
+    }
+
+    // Rows of this partition matching every predicate of a validated query, in row order.
+    // Aggregates and group_by are ignored.
+    static vector<RowId> select(const VectorizedDataSet &ds, const query::Query &q) {
+        size_t n = ds.size();
+        vector<Filter> filters;
+        for (const auto &p : q.where()) {
+            filters.push_back(compileFilter(ds, p));
+            if (filters.back().kind == Filter::NONE) return {};
+        }
+        vector<RowId> located;
+        if (fromGrid(ds, filters, located)) return located;
+        if (filters.size() == 1 && filters[0].kind == Filter::INT32_RANGE) {
+            const Filter &f = filters[0];
+            const ValueIndex *index = ds.indexFor(f.i32);
+            if (index && index->count(f.lo, f.hi) * VectorizedDataSet::kIndexSelectivity < n) return index->rows(f.lo, f.hi);
+            return ScanKernels::indicesInRange(f.i32, n, f.lo, f.hi, ds.blockPlan(f.i32, f.lo, f.hi));
+        }
+
+        vector<BlockScan> plan = planBlocks(filters, n);
+        vector<vector<RowId>> parts(plan.size());
+        ScanPool &pool = ScanPool::shared();
+        vector<BlockScratch> scratch(pool.slots());
+        pool.forEach(plan.size(), [&](size_t i) { return plan[i].block; }, [&](size_t i, size_t slot) {
+            uint64_t *words = scratch[slot].words();
+            size_t begin = plan[i].block * ScanKernels::kBlockRows, len = min(ScanKernels::kBlockRows, n - begin);
+            size_t nw = blockMask(filters, plan[i].test, begin, len, words, scratch[slot].spare());
+            for (size_t w = 0; w < nw; w++)
+                for (uint64_t bits = words[w]; bits; bits &= bits - 1)
+                    parts[i].push_back(RowId(begin + w * 64 + __builtin_ctzll(bits)));
+        });
+        size_t total = 0;
+        for (const auto &p : parts) total += p.size();
+        vector<RowId> rows;
+        rows.reserve(total);
+        for (const auto &p : parts) rows.insert(rows.end(), p.begin(), p.end());
+        return rows;
+    }
+
+    // Fold a partial result into 'into'. Both must come from the same query. 'partial' may hold
+    // its groups packed; they are merged from the packed columns, and 'into' keeps plain groups.
+    static void merge(query::QueryResult &into, const query::QueryResult &partial, const query::Query &q) {
+        into.set_rows_scanned(into.rows_scanned() + partial.rows_scanned());
+        into.set_data_version(into.data_version() + partial.data_version());
+        if (partial.partial()) into.set_partial(true);
+        for (const auto &m : partial.missing()) into.add_missing(m);
+        if (partial.has_ids()) IdSets::merge(*into.mutable_ids(), partial.ids());
+        unordered_map<string, int> at;
+        for (int i = 0; i < into.groups_size(); i++) at[into.groups(i).key()] = i;
+        auto absorb = [&](const string &key, uint64_t rows, int values, auto valueOf) {
+            auto it = at.find(key);
+            if (it == at.end()) {
+                at[key] = into.groups_size();
+                query::GroupResult *g = into.add_groups();
+                g->set_key(key);
+                g->set_rows(rows);
+                for (int m = 0; m < values; m++) *g->add_values() = valueOf(m);
+                return;
+            }
+            query::GroupResult *g = into.mutable_groups(it->second);
+            g->set_rows(g->rows() + rows);
+            for (int m = 0; m < q.aggregates_size() && m < values && m < g->values_size(); m++) {
+                combine(q.aggregates(m).op(), *g->mutable_values(m), valueOf(m));
+            }
+        };
+        for (const auto &pg : partial.groups())
+            absorb(pg.key(), pg.rows(), pg.values_size(), [&](int m) -> const query::AggregateValue & { return pg.values(m); });
+        const query::PackedGroups &packed = partial.packed();
+        for (int i = 0; i < packed.keys_size() && i < packed.rows_size(); i++)
+            absorb(packed.keys(i), packed.rows(i), packed.values_size(), [&](int m) { return unpackValue(packed.values(m), i); });
+        sortGroups(into);
+    }
+
+    // Move r's groups into r.packed, one array per field, for a caller that asked for packed results.
+    static void pack(query::QueryResult &r) {
+        query::PackedGroups *packed = r.mutable_packed();
+        int values = r.groups_size() ? r.groups(0).values_size() : 0;
+        for (int m = 0; m < values; m++) {
+            query::PackedValues *v = packed->add_values();
+            bool doubles = any_of(r.groups().begin(), r.groups().end(), [m](const query::GroupResult &g) {
+                return m < g.values_size() && g.values(m).has_double_value();
+            });
+            for (int i = 0; i < r.groups_size(); i++) {
+                const query::GroupResult &g = r.groups(i);
+                bool set = m < g.values_size() && g.values(m).value_case() != query::AggregateValue::VALUE_NOT_SET;
+                if (!set) v->add_unset(i);
+                if (doubles) v->add_doubles(set ? g.values(m).double_value() : 0);
+                else v->add_ints(set ? g.values(m).int_value() : 0);
+            }
+        }
+        for (auto &g : *r.mutable_groups()) {
+            packed->add_keys(std::move(*g.mutable_key()));
+            packed->add_rows(g.rows());
+        }
+        r.clear_groups();
+    }
+
+    // Result of a query over no rows, shaped like evaluate()'s: one empty group when not grouped.
+    static query::QueryResult emptyResult(const query::Query &q) {
+        query::QueryResult result;
+        if (q.group_by() != query::COLUMN_UNSPECIFIED) return result;
+        query::GroupResult *g = result.add_groups();
+        for (const auto &a : q.aggregates()) {
+            query::AggregateValue *v = g->add_values();
+            if (a.op() == query::COUNT) v->set_int_value(0);
+            else if (a.op() == query::SUM && holds_alternative<const Column<float> *>(columnOf(schemaDataset(), a.column()))) v->set_double_value(0);
+            else if (a.op() == query::SUM) v->set_int_value(0);
+        }
+        return result;
+    }
+
+    // Matching rows over all groups, plain or packed.
+    static uint64_t totalRows(const query::QueryResult &r) {
+        uint64_t rows = 0;
+        for (const auto &g : r.groups()) rows += g.rows();
+        for (uint64_t n : r.packed().rows()) rows += n;
+        return rows;
+    }
+
+    // The dataset column a query::Column names (monostate for COLUMN_UNSPECIFIED).
+    static ColumnRef columnOf(const VectorizedDataSet &ds, query::Column c) {
+        if (c == query::COLUMN_UNSPECIFIED || !query::Column_IsValid(c)) return ColumnRef();
+        string name = query::Column_Name(c);
+        transform(name.begin(), name.end(), name.begin(), [](unsigned char ch) { return char(tolower(ch)); });
+        return ds.column(name);
+    }
+
+    // Latitude/longitude box a box or radius predicate lies in.
+    static SpatialGrid::Box geoBounds(const query::Predicate &p) {
+        if (p.test_case() == query::Predicate::kRadius)
+            return SpatialGrid::Circle::around(p.radius().latitude(), p.radius().longitude(), p.radius().meters()).bounds();
+        const query::GeoBox &b = p.box();
+        return {b.min_latitude(), b.min_longitude(), b.max_latitude(), b.max_longitude()};
+    }
+
+private:
+    static string validateGeo(const query::Predicate &p) {
+        if (p.has_radius()) {
+            const query::GeoRadius &r = p.radius();
+            if (!(fabs(r.latitude()) <= 90) || !(fabs(r.longitude()) <= 180)) return "radius centre is not a latitude/longitude";
+            if (!(r.meters() >= 0) || !(r.meters() < SpatialGrid::kEarthRadiusMeters)) return "radius must be between 0 and the Earth's radius";
+            return "";
+        }
+        const query::GeoBox &b = p.box();
+        for (double v : {b.min_latitude(), b.min_longitude(), b.max_latitude(), b.max_longitude()})
+            if (!isfinite(v)) return "box bound is not a number";
+        return "";
+    }
+
+    static const VectorizedDataSet &schemaDataset() {
+        static const VectorizedDataSet schema;
+        return schema;
+    }
+
+    static bool isNumeric(const ColumnRef &col) {
+        return holds_alternative<const Column<int32_t> *>(col) || holds_alternative<const Column<int16_t> *>(col) ||
+               holds_alternative<const Column<float> *>(col);
+    }
+
+    // Value of group i in one packed aggregate.
+    static query::AggregateValue unpackValue(const query::PackedValues &v, int i) {
+        query::AggregateValue out;
+        if (find(v.unset().begin(), v.unset().end(), uint32_t(i)) != v.unset().end()) return out;
+        if (i < v.doubles_size()) out.set_double_value(v.doubles(i));
+        else if (i < v.ints_size()) out.set_int_value(v.ints(i));
+        return out;
+    }
+
+    static void sortGroups(query::QueryResult &r) {
+        sort(r.mutable_groups()->begin(), r.mutable_groups()->end(),
+             [](const query::GroupResult &a, const query::GroupResult &b) { return a.key() < b.key(); });
+    }
+
+    // One predicate compiled against this partition's columns.
+    struct Filter {
+        enum Kind { INT32_RANGE, INT16_RANGE, FLOAT_RANGE, CODE_SET, STRING_SET, GEO_BOX, GEO_RADIUS, NONE } kind = NONE;
+        const int32_t *i32 = nullptr;
+        const int16_t *i16 = nullptr;
+        const float *f32 = nullptr;
+        const uint16_t *codes = nullptr;
+        const StringColumn *strings = nullptr;
+        const ZoneMap *zones = nullptr;   // of the range column, when it has one
+        int32_t lo = 0, hi = 0;
+        double flo = 0, fhi = 0;
+        vector<uint8_t> codeMatch;
+        unordered_set<string_view> values;
+        const float *lat = nullptr, *lon = nullptr;
+        const ZoneMap *latZones = nullptr, *lonZones = nullptr;
+        SpatialGrid::Box box{};           // GEO_BOX, or the bounds of the GEO_RADIUS circle
+        SpatialGrid::Circle circle;
+
+        bool test(size_t row) const {
+            switch (kind) {
+            case INT32_RANGE: return i32[row] >= lo && i32[row] <= hi;
+            case INT16_RANGE: return i16[row] >= lo && i16[row] <= hi;
+            case FLOAT_RANGE: return f32[row] >= flo && f32[row] <= fhi;
+            case CODE_SET: return codeMatch[codes[row]] != 0;
+            case STRING_SET: return values.count((*strings)[row]) != 0;
+            case GEO_BOX: return box.contains(lat[row], lon[row]);
+            case GEO_RADIUS: return circle.contains(lat[row], lon[row]);
+            case NONE: return false;
+            }
+            return false;
+        }
+
+        template <typename Pred>
+        static void fillBits(size_t n, uint64_t *words, Pred pred) {
+            for (size_t w = 0; w < (n + 63) / 64; w++) {
+                uint64_t bits = 0;
+                size_t end = min(n, w * 64 + 64);
+                for (size_t i = w * 64; i < end; i++) bits |= uint64_t(pred(i)) << (i & 63);
+                words[w] = bits;
+            }
+        }
+
+        // How the rows of block b relate to this predicate, as far as the zone map tells.
+        ZoneMap::Match zoneMatch(size_t b) const {
+            if (kind == NONE) return ZoneMap::NONE;
+            if (kind == GEO_BOX || kind == GEO_RADIUS) {
+                if (!latZones || !lonZones) return ZoneMap::SOME;
+                ZoneMap::Match a = latZones->match(b, box.minLat, box.maxLat), o = lonZones->match(b, box.minLon, box.maxLon);
+                if (a == ZoneMap::NONE || o == ZoneMap::NONE) return ZoneMap::NONE;
+                return kind == GEO_BOX && a == ZoneMap::ALL && o == ZoneMap::ALL ? ZoneMap::ALL : ZoneMap::SOME;
+            }
+            if (!zones) return ZoneMap::SOME;
+            return kind == FLOAT_RANGE ? zones->match(b, flo, fhi) : zones->match(b, lo, hi);
+        }
+
+        // AND this predicate's matches for rows [begin, begin + n) into words.
+        void apply(size_t begin, size_t n, uint64_t *words, uint64_t *scratch) const {
+            switch (kind) {
+            case INT32_RANGE:
+                ScanKernels::selectBlock(i32 + begin, n, lo, hi, scratch);
+                break;
+            case INT16_RANGE:
+                fillBits(n, scratch, [&](size_t i) { return i16[begin + i] >= lo && i16[begin + i] <= hi; });
+                break;
+            case FLOAT_RANGE:
+                fillBits(n, scratch, [&](size_t i) { return f32[begin + i] >= flo && f32[begin + i] <= fhi; });
+                break;
+            case CODE_SET:
+                fillBits(n, scratch, [&](size_t i) { return codeMatch[codes[begin + i]] != 0; });
+                break;
+            case STRING_SET:
+                fillBits(n, scratch, [&](size_t i) { return values.count((*strings)[begin + i]) != 0; });
+                break;
+            case GEO_BOX:
+                fillBits(n, scratch, [&](size_t i) { return box.contains(lat[begin + i], lon[begin + i]); });
+                break;
+            case GEO_RADIUS:
+                fillBits(n, scratch, [&](size_t i) { return circle.contains(lat[begin + i], lon[begin + i]); });
+                break;
+            case NONE:
+                fill(scratch, scratch + (n + 63) / 64, 0);
+                break;
+            }
+            for (size_t w = 0; w < (n + 63) / 64; w++) words[w] &= scratch[w];
+        }
+    };
+
+    // Selection words of one block and room for blockMask's intermediate words, allocated by the
+    // first task of a loop that runs on a slot.
+    struct BlockScratch {
+        vector<uint64_t> buffer;
+
+        uint64_t *words() {
+            if (buffer.empty()) buffer.resize(2 * ScanKernels::kBlockRows / 64);
+            return buffer.data();
+        }
+        uint64_t *spare() { return buffer.data() + ScanKernels::kBlockRows / 64; }
+    };
+
+    // A block that may hold matches and the filters its rows must still be tested against: bit f
+    // for filter f (filters past the 64th are always tested).
+    struct BlockScan {
+        size_t block;
+        uint64_t test;
+    };
+
+    // Blocks of n rows that the zone maps cannot rule out; filters a block satisfies entirely are
+    // dropped from its test mask.
+    static vector<BlockScan> planBlocks(const vector<Filter> &filters, size_t n) {
+        size_t blocks = (n + ScanKernels::kBlockRows - 1) / ScanKernels::kBlockRows;
+        vector<BlockScan> plan;
+        plan.reserve(blocks);
+        for (size_t b = 0; b < blocks; b++) {
+            uint64_t test = ~uint64_t(0);
+            bool skip = false;
+            for (size_t f = 0; f < filters.size() && !skip; f++) {
+                ZoneMap::Match m = filters[f].zoneMatch(b);
+                skip = m == ZoneMap::NONE;
+                if (m == ZoneMap::ALL && f < 64) test &= ~(uint64_t(1) << f);
+            }
+            if (!skip) plan.push_back({b, test});
+        }
+        return plan;
+    }
+
+    // Selection words for rows [begin, begin + len) under the filters in 'test'; returns the word count.
+    static size_t blockMask(const vector<Filter> &filters, uint64_t test, size_t begin, size_t len, uint64_t *words, uint64_t *scratch) {
+        size_t nw = (len + 63) / 64;
+        fill(words, words + nw, ~uint64_t(0));
+        if (len % 64) words[nw - 1] = (uint64_t(1) << (len % 64)) - 1;
+        for (size_t f = 0; f < filters.size(); f++) {
+            if (f >= 64 || (test >> f) & 1) filters[f].apply(begin, len, words, scratch);
+        }
+        return nw;
+    }
+
+    // The rows matching every filter, in row order, when one of them is a box or radius the
+    // spatial grid narrows to fewer than 1 / kIndexSelectivity of the rows: the grid's rows for
+    // that filter, tested one by one against the others. False when the filters should be scanned.
+    static bool fromGrid(const VectorizedDataSet &ds, const vector<Filter> &filters, vector<RowId> &rows) {
+        const SpatialGrid *grid = ds.spatialIndex();
+        if (!grid) return false;
+        size_t best = filters.size(), fewest = ds.size() / VectorizedDataSet::kIndexSelectivity;
+        for (size_t f = 0; f < filters.size(); f++) {
+            if (filters[f].kind != Filter::GEO_BOX && filters[f].kind != Filter::GEO_RADIUS) continue;
+            size_t n = grid->candidates(filters[f].box);
+            if (n < fewest) {
+                best = f;
+                fewest = n;
+            }
+        }
+        if (best == filters.size()) return false;
+        const Filter &g = filters[best];
+        rows = g.kind == Filter::GEO_BOX ? grid->rows(g.box) : grid->rows(g.circle);
+        if (filters.size() > 1) {
+            rows.erase(remove_if(rows.begin(), rows.end(), [&](RowId r) {
+                for (size_t f = 0; f < filters.size(); f++)
+                    if (f != best && !filters[f].test(r)) return true;
+                return false;
+            }), rows.end());
+        }
+        return true;
+    }
+
+    // The integers of [lo, hi] that lie in [least, most], which may be none (or a bound NaN).
+    static bool integerBounds(double lo, double hi, int32_t least, int32_t most, int32_t &outLo, int32_t &outHi) {
+        lo = max(ceil(lo), double(least));
+        hi = min(floor(hi), double(most));
+        if (!(lo <= hi)) return false;
+        outLo = int32_t(lo);
+        outHi = int32_t(hi);
+        return true;
+    }
+
+    static Filter compileFilter(const VectorizedDataSet &ds, const query::Predicate &p) {
+        Filter f;
+        ColumnRef col = columnOf(ds, p.column());
+        if (p.test_case() == query::Predicate::kDateWindow) {
+            const auto &w = p.date_window();
+            f.kind = Filter::INT32_RANGE;
+            f.i32 = get<const Column<int32_t> *>(col)->data();
+            f.lo = w.from().empty() ? VectorizedDataSet::kNullDate + 1 : VectorizedDataSet::parseDate(w.from());
+            f.hi = w.to().empty() ? INT32_MAX : VectorizedDataSet::parseDate(w.to());
+            f.zones = ds.zonesFor(f.i32);
+            if (f.lo > f.hi) f.kind = Filter::NONE;   // the range kernels would wrap around
+        } else if (p.test_case() == query::Predicate::kBox || p.test_case() == query::Predicate::kRadius) {
+            f.kind = p.test_case() == query::Predicate::kBox ? Filter::GEO_BOX : Filter::GEO_RADIUS;
+            f.lat = ds.latitude.data();
+            f.lon = ds.longitude.data();
+            f.latZones = ds.zonesFor(f.lat);
+            f.lonZones = ds.zonesFor(f.lon);
+            f.box = geoBounds(p);
+            if (f.kind == Filter::GEO_RADIUS) f.circle = SpatialGrid::Circle::around(p.radius().latitude(), p.radius().longitude(), p.radius().meters());
+            if (f.box.minLat > f.box.maxLat || f.box.minLon > f.box.maxLon) f.kind = Filter::NONE;
+        } else if (p.test_case() == query::Predicate::kRange) {
+            const auto &r = p.range();
+            double lo = r.has_min() ? r.min() : -numeric_limits<double>::infinity();
+            double hi = r.has_max() ? r.max() : numeric_limits<double>::infinity();
+            bool empty = false;
+            if (auto c = get_if<const Column<int32_t> *>(&col)) {
+                f.kind = Filter::INT32_RANGE;
+                f.i32 = (*c)->data();
+                empty = !integerBounds(lo, hi, INT32_MIN + 1, INT32_MAX, f.lo, f.hi);  // INT32_MIN is the null marker
+            } else if (auto c = get_if<const Column<int16_t> *>(&col)) {
+                f.kind = Filter::INT16_RANGE;
+                f.i16 = (*c)->data();
+                empty = !integerBounds(lo, hi, 0, INT16_MAX, f.lo, f.hi);  // negative times are the null marker
+            } else {
+                f.kind = Filter::FLOAT_RANGE;
+                f.f32 = get<const Column<float> *>(col)->data();
+                f.flo = lo;
+                f.fhi = hi;
+                empty = !(lo <= hi);
+            }
+            f.zones = ds.zonesFor(f.i32 ? (const void *)f.i32 : f.i16 ? (const void *)f.i16 : (const void *)f.f32);
+            if (empty) f.kind = Filter::NONE;
+        } else {
+            vector<string> wanted;
+            if (p.test_case() == query::Predicate::kEquals) wanted.push_back(p.equals());
+            else wanted.assign(p.in().values().begin(), p.in().values().end());
+            if (auto c = get_if<const DictColumn<uint16_t> *>(&col)) {
+                f.kind = Filter::CODE_SET;
+                f.codes = (*c)->codeData().data();
+                f.codeMatch = (*c)->matchTable(wanted);
+                if (find(f.codeMatch.begin(), f.codeMatch.end(), 1) == f.codeMatch.end()) f.kind = Filter::NONE;
+            } else {
+                f.kind = Filter::STRING_SET;
+                f.strings = get<const StringColumn *>(col);
+                // Views into the query message, which outlives the evaluation.
+                if (p.test_case() == query::Predicate::kEquals) f.values.insert(p.equals());
+                else for (const auto &v : p.in().values()) f.values.insert(v);
+            }
+        }
+        return f;
+    }
+
+    // Running value of one aggregate in one group.
+    struct Acc {
+        int64_t i = 0;
+        double d = 0;
+        bool has = false;
+    };
+
+    // One aggregate compiled against this partition's columns.
+    struct Metric {
+        query::AggregateOp op = query::COUNT;
+        const int32_t *i32 = nullptr;
+        const int16_t *i16 = nullptr;
+        const float *f32 = nullptr;
+
+        void add(Acc &a, size_t row) const {
+            if (op == query::COUNT) return;
+            if (f32) {
+                double v = f32[row];
+                if (std::isnan(v)) return;
+                a.d = !a.has ? v : op == query::SUM ? a.d + v : op == query::MIN ? min(a.d, v) : max(a.d, v);
+            } else {
+                int64_t v = i32 ? i32[row] : i16[row];
+                if ((i32 && v == VectorizedDataSet::kNullDate) || (i16 && v < 0)) return;
+                a.i = !a.has ? v : op == query::SUM ? a.i + v : op == query::MIN ? min(a.i, v) : max(a.i, v);
+            }
+            a.has = true;
+        }
+
+        void absorb(Acc &into, const Acc &from) const {
+            if (!from.has) return;
+            if (!into.has) {
+                into = from;
+                return;
+            }
+            if (op == query::SUM) {
+                into.i += from.i;
+                into.d += from.d;
+            } else if (op == query::MIN) {
+                into.i = min(into.i, from.i);
+                into.d = min(into.d, from.d);
+            } else if (op == query::MAX) {
+                into.i = max(into.i, from.i);
+                into.d = max(into.d, from.d);
+            }
+        }
+
+        void emit(const Acc &a, uint64_t rows, query::AggregateValue *out) const {
+            if (op == query::COUNT) {
+                out->set_int_value(rows);
+            } else if (f32) {
+                if (a.has || op == query::SUM) out->set_double_value(a.d);
+            } else if (a.has || op == query::SUM) {
+                out->set_int_value(a.i);
+            }
+        }
+    };
+
+    static Metric compileMetric(const VectorizedDataSet &ds, const query::Aggregate &a) {
+        Metric m;
+        m.op = a.op();
+        if (m.op == query::COUNT) return m;
+        ColumnRef col = columnOf(ds, a.column());
+        if (auto c = get_if<const Column<int32_t> *>(&col)) m.i32 = (*c)->data();
+        else if (auto c = get_if<const Column<int16_t> *>(&col)) m.i16 = (*c)->data();
+        else m.f32 = get<const Column<float> *>(col)->data();
+        return m;
+    }
+
+    struct Accumulator {
+        vector<uint64_t> rows;
+        vector<Acc> values;  // groups x metrics
+        Accumulator(size_t groups, size_t metrics) : rows(groups, 0), values(groups * metrics) {}
+
+        void absorb(const Accumulator &other, const vector<Metric> &metrics) {
+            for (size_t g = 0; g < rows.size(); g++) {
+                rows[g] += other.rows[g];
+                for (size_t m = 0; m < metrics.size(); m++) {
+                    metrics[m].absorb(values[g * metrics.size() + m], other.values[g * metrics.size() + m]);
+                }
+            }
+        }
+    };
+
+    // One query compiled for evaluate(): the matches found without a scan in 'total', and the
+    // blocks left to scan in 'plan'.
+    struct Evaluation {
+        vector<Filter> filters;
+        vector<Metric> metrics;
+        const DictColumn<uint16_t> *group = nullptr;
+        const uint16_t *codes = nullptr;
+        size_t groups = 1;
+        bool countOnly = false;
+        Accumulator total{1, 0};
+        vector<BlockScan> plan;
+
+        void add(Accumulator &acc, size_t row) const {
+            size_t g = codes ? codes[row] : 0;
+            acc.rows[g]++;
+            for (size_t m = 0; m < metrics.size(); m++) metrics[m].add(acc.values[g * metrics.size() + m], row);
+        }
+
+        // Fold the matches of block b of n rows, under the filters in 'test', into acc.
+        void scan(size_t b, uint64_t test, size_t n, Accumulator &acc, BlockScratch &scratch) const {
+            uint64_t *words = scratch.words();
+            size_t begin = b * ScanKernels::kBlockRows, len = min(ScanKernels::kBlockRows, n - begin);
+            size_t nw = blockMask(filters, test, begin, len, words, scratch.spare());
+            if (countOnly) {
+                for (size_t w = 0; w < nw; w++) acc.rows[0] += __builtin_popcountll(words[w]);
+                return;
+            }
+            for (size_t w = 0; w < nw; w++)
+                for (uint64_t bits = words[w]; bits; bits &= bits - 1) add(acc, begin + w * 64 + __builtin_ctzll(bits));
+        }
+    };
+
+    // Compile q and answer what needs no scan: a predicate that matches nothing, a box or radius
+    // read from the spatial grid, a bare count, or one counted range from its histogram.
+    static Evaluation prepare(const VectorizedDataSet &ds, const query::Query &q) {
+        Evaluation e;
+        size_t n = ds.size();
+        bool none = false;
+        for (const auto &p : q.where()) {
+            e.filters.push_back(compileFilter(ds, p));
+            none |= e.filters.back().kind == Filter::NONE;
+        }
+        for (const auto &a : q.aggregates()) e.metrics.push_back(compileMetric(ds, a));
+        if (q.group_by() != query::COLUMN_UNSPECIFIED) e.group = get<const DictColumn<uint16_t> *>(columnOf(ds, q.group_by()));
+        e.groups = e.group ? e.group->cardinality() : 1;
+        e.countOnly = !e.group && all_of(e.metrics.begin(), e.metrics.end(), [](const Metric &m) { return m.op == query::COUNT; });
+        e.codes = e.group ? e.group->codeData().data() : nullptr;
+        e.total = Accumulator(e.groups, e.metrics.size());
+
+        vector<RowId> located;
+        if (none) {
+            return e;
+        } else if (fromGrid(ds, e.filters, located)) {
+            // A box or radius read from the spatial grid: only the rows of the cells it overlaps are visited.
+            if (e.countOnly) e.total.rows[0] = located.size();
+            else for (RowId row : located) e.add(e.total, row);
+            return e;
+        } else if (e.countOnly && e.filters.empty()) {
+            e.total.rows[0] = n;
+            return e;
+        } else if (e.countOnly && e.filters.size() == 1 && e.filters[0].kind == Filter::INT32_RANGE) {
+            // One range on a number_of_* column is answered from its histogram without a scan.
+            const Filter &f = e.filters[0];
+            const ValueIndex *index = ds.indexFor(f.i32);
+            e.total.rows[0] = index ? index->count(f.lo, f.hi) : ScanKernels::countInRange(f.i32, n, f.lo, f.hi, ds.blockPlan(f.i32, f.lo, f.hi));
+            return e;
+        }
+        e.plan = planBlocks(e.filters, n);
+        return e;
+    }
+
+    // The result of an evaluation whose scan has been folded into its total.
+    static query::QueryResult finish(const VectorizedDataSet &ds, const query::Query &q, const Evaluation &e) {
+        query::QueryResult result;
+        result.set_rows_scanned(ds.size());
+        for (size_t g = 0; g < e.groups; g++) {
+            if (e.group && e.total.rows[g] == 0) continue;
+            query::GroupResult *out = result.add_groups();
+            if (e.group) out->set_key(string(e.group->dictionary()[g]));
+            out->set_rows(e.total.rows[g]);
+            for (size_t m = 0; m < e.metrics.size(); m++) {
+                e.metrics[m].emit(e.total.values[g * e.metrics.size() + m], e.total.rows[g], out->add_values());
+            }
+        }
+        sortGroups(result);
+        if (q.collect_ids()) *result.mutable_ids() = idsOf(ds, select(ds, q));
+        return result;
+    }
+
+    static void combine(query::AggregateOp op, query::AggregateValue &into, const query::AggregateValue &from) {
+        if (from.value_case() == query::AggregateValue::VALUE_NOT_SET) return;
+        if (into.value_case() == query::AggregateValue::VALUE_NOT_SET) {
+            into = from;
+            return;
+        }
+        bool isInt = from.value_case() == query::AggregateValue::kIntValue;
+        if (op == query::COUNT || op == query::SUM) {
+            if (isInt) into.set_int_value(into.int_value() + from.int_value());
+            else into.set_double_value(into.double_value() + from.double_value());
+        } else {
+            bool takeMin = op == query::MIN;
+            if (isInt) into.set_int_value(takeMin ? min(into.int_value(), from.int_value()) : max(into.int_value(), from.int_value()));
+            else into.set_double_value(takeMin ? min(into.double_value(), from.double_value()) : max(into.double_value(), from.double_value()));
+        }
+    }
+};
+
+#endif
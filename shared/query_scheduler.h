@@ -0,0 +1,121 @@
+#ifndef QUERY_SCHEDULER_H
+#define QUERY_SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include "query_engine.h"
+
+using namespace std;
+
+// Runs local scans on a fixed pool of workers so gRPC threads never block on a scan. At most
+// 'workers' scans run at once and up to 'queueLimit' more wait in an admission queue; beyond that
+// submit() refuses the work. The running scans share the cores through ScanPool: their block tasks
+// queue on the same workers, so concurrent queries do not oversubscribe.
+class QueryScheduler {
+public:
+    explicit QueryScheduler(int cores, int workers = 0, size_t queueLimit = 64)
+        : queueLimit(queueLimit) {
+        if (workers <= 0) workers = max(1, cores);
+        for (int i = 0; i < workers; i++) pool.emplace_back([this] { work(); });
+    }
+    QueryScheduler(const QueryScheduler &) = delete;
+    QueryScheduler &operator=(const QueryScheduler &) = delete;
+
+    ~QueryScheduler() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto &t : pool) t.join();
+    }
+
+    // Queue a scan; false when the admission queue is full.
+    bool submit(function<void()> scan) {
+        {
+            lock_guard<mutex> lock(m);
+            if (queue.size() >= queueLimit) return false;
+            queue.push_back(std::move(scan));
+        }
+        ready.notify_one();
+        return true;
+    }
+
+    int running() const { return active.load(); }
+    size_t queued() const {
+        lock_guard<mutex> lock(m);
+        return queue.size();
+    }
+
+private:
+    void work() {
+        for (;;) {
+            function<void()> scan;
+            {
+                unique_lock<mutex> lock(m);
+                ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                scan = std::move(queue.front());
+                queue.pop_front();
+            }
+            ++active;
+            scan();
+            --active;
+        }
+    }
+
+    const size_t queueLimit;
+    mutable mutex m;
+    condition_variable ready;
+    deque<function<void()>> queue;
+    vector<thread> pool;
+    atomic<int> active{0};
+    bool stopping = false;
+};
+
+// Joins the partial results of one query (the local scan and each child) and calls done with the
+// merged result and the number of parts that failed once all 'parts' have reported. add() and
+// skip() may be called from any thread.
+class PartialResults {
+public:
+    PartialResults(const query::Query &q, size_t parts, function<void(query::QueryResult &, size_t failed)> done)
+        : q(q), remaining(parts), done(std::move(done)) {}
+
+    void add(const query::QueryResult &partial) {
+        unique_lock<mutex> lock(m);
+        QueryEngine::merge(merged, partial, q);
+        finishOne(lock);
+    }
+
+    // A part that failed or ran out of time; the result is merged from the others and marked
+    // partial, with 'part' listed as missing.
+    void skip(const string &part) {
+        unique_lock<mutex> lock(m);
+        failed++;
+        merged.set_partial(true);
+        merged.add_missing(part);
+        finishOne(lock);
+    }
+
+private:
+    void finishOne(unique_lock<mutex> &lock) {
+        if (--remaining > 0) return;
+        lock.unlock();
+        done(merged, failed);
+    }
+
+    const query::Query q;
+    mutex m;
+    size_t remaining;
+    size_t failed = 0;
+    query::QueryResult merged;
+    function<void(query::QueryResult &, size_t failed)> done;
+};
+
+#endif
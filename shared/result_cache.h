@@ -0,0 +1,165 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include "query_engine.h"
+
+using namespace std;
+
+// Bounded LRU cache of query results. Entries are keyed by the normalized query and remember the
+// data version they were computed from; a lookup with any other version is a miss, so reloaded
+// data is never answered from the cache. An optional time to live bounds how long an entry is
+// trusted when the version cannot be checked up front (A caches its children's merged results).
+class ResultCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+    };
+
+    explicit ResultCache(size_t capacity = 256, chrono::milliseconds ttl = chrono::milliseconds(0))
+        : capacity(max<size_t>(1, capacity)), ttl(ttl) {}
+
+    // Canonical form of a query: equivalent predicates in any order give the same key.
+    static string keyOf(const query::Query &q) {
+        query::Query n = q;
+        for (auto &p : *n.mutable_where()) {
+            if (p.test_case() == query::Predicate::kEquals) {
+                string v = p.equals();
+                p.mutable_in()->add_values(std::move(v));
+            }
+            if (p.test_case() == query::Predicate::kIn) {
+                auto *values = p.mutable_in()->mutable_values();
+                sort(values->begin(), values->end());
+                values->erase(unique(values->begin(), values->end()), values->end());
+            }
+            if (p.test_case() == query::Predicate::kDateWindow) {
+                // "MM/DD/YYYY" and "YYYY-MM-DD" spell the same bound.
+                auto *w = p.mutable_date_window();
+                if (!w->from().empty()) w->set_from(VectorizedDataSet::formatDate(VectorizedDataSet::parseDate(w->from())));
+                if (!w->to().empty()) w->set_to(VectorizedDataSet::formatDate(VectorizedDataSet::parseDate(w->to())));
+            }
+        }
+        vector<pair<string, query::Predicate>> preds;
+        for (const auto &p : n.where()) preds.emplace_back(serialize(p), p);
+        sort(preds.begin(), preds.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+        n.clear_where();
+        for (auto &p : preds) *n.add_where() = std::move(p.second);
+        return serialize(n);
+    }
+
+    bool get(const string &key, uint64_t version, query::QueryResult &out) {
+        lock_guard<mutex> lock(m);
+        auto it = index.find(key);
+        if (it != index.end() && (it->second->version != version || expired(*it->second))) {
+            lru.erase(it->second);
+            index.erase(it);
+            it = index.end();
+        }
+        if (it == index.end()) {
+            counters.misses++;
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        out = it->second->result;
+        counters.hits++;
+        return true;
+    }
+
+    enum Lookup { MISS, HIT, STALE };
+
+    // Like get(), but an entry computed from another version is returned too (STALE, a miss), with
+    // that version in 'stored', for callers that can bring an older result up to date.
+    Lookup lookup(const string &key, uint64_t version, query::QueryResult &out, uint64_t &stored) {
+        lock_guard<mutex> lock(m);
+        auto it = index.find(key);
+        if (it != index.end() && expired(*it->second)) {
+            lru.erase(it->second);
+            index.erase(it);
+            it = index.end();
+        }
+        if (it == index.end()) {
+            counters.misses++;
+            return MISS;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        out = it->second->result;
+        stored = it->second->version;
+        if (stored != version) {
+            counters.misses++;
+            return STALE;
+        }
+        counters.hits++;
+        return HIT;
+    }
+
+    void put(const string &key, uint64_t version, const query::QueryResult &result) {
+        lock_guard<mutex> lock(m);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        lru.push_front(Entry{key, version, chrono::steady_clock::now(), result});
+        index[key] = lru.begin();
+        while (lru.size() > capacity) {
+            index.erase(lru.back().key);
+            lru.pop_back();
+            counters.evictions++;
+        }
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(m);
+        lru.clear();
+        index.clear();
+    }
+
+    Stats stats() const {
+        lock_guard<mutex> lock(m);
+        Stats s = counters;
+        s.entries = lru.size();
+        return s;
+    }
+
+private:
+    struct Entry {
+        string key;
+        uint64_t version;
+        chrono::steady_clock::time_point stored;
+        query::QueryResult result;
+    };
+
+    static string serialize(const google::protobuf::Message &msg) {
+        string out;
+        {
+            google::protobuf::io::StringOutputStream stream(&out);
+            google::protobuf::io::CodedOutputStream coded(&stream);
+            coded.SetSerializationDeterministic(true);
+            msg.SerializeToCodedStream(&coded);
+        }
+        return out;
+    }
+
+    bool expired(const Entry &e) const {
+        return ttl.count() > 0 && chrono::steady_clock::now() - e.stored > ttl;
+    }
+
+    const size_t capacity;
+    const chrono::milliseconds ttl;
+    mutable mutex m;
+    list<Entry> lru;   // most recently used first
+    unordered_map<string, list<Entry>::iterator> index;
+    Stats counters;
+};
+
+#endif
@@ -0,0 +1,334 @@
+#ifndef ROLLUP_CUBE_H
+#define ROLLUP_CUBE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <omp.h>
+#include <grpcpp/grpcpp.h>
+#include "overlay.grpc.pb.h"
+#include "vectorized_dataset.h"
+#include "overlay_fanout.h"
+
+using namespace std;
+
+// COUNT and SUM of the number_of_* columns per (CRASH_DATE, BOROUGH, CONTRIBUTING_FACTOR_VEHICLE_1)
+// cell, for the per-day, per-borough and per-factor queries of dashboards. Each partition segment
+// gets a cube when it is loaded and each epoch the cube of all its segments; cubes of disjoint rows
+// add up, so the entry node merges its own with its children's and answers the queries answers()
+// accepts without a scan, exactly as evaluate() would. Cells are sorted by day, borough code and
+// factor code; the codes index the cube's own dictionaries.
+class RollupCube {
+public:
+    static const size_t kSums = VectorizedDataSet::kNumCountColumns;
+
+    struct Cell {
+        int32_t day;                 // VectorizedDataSet::kNullDate when missing
+        uint32_t borough, factor;
+        uint64_t rows;
+        int64_t sums[kSums];         // of the number_of_* columns, in column order
+    };
+
+    uint64_t version = 0;            // data_version of the rows it holds
+    vector<string> boroughs, factors;
+    vector<Cell> cells;
+
+    size_t bytes() const { return cells.size() * sizeof(Cell); }
+
+    // Cube of one partition's rows.
+    static RollupCube of(const VectorizedDataSet &ds, uint64_t version) {
+        RollupCube cube = keyedBy(ds, version);
+        const int *sums[kSums] = {
+            ds.number_of_persons_injured.data(), ds.number_of_persons_killed.data(), ds.number_of_pedestrians_injured.data(),
+            ds.number_of_pedestrians_killed.data(), ds.number_of_cyclist_injured.data(), ds.number_of_cyclist_killed.data(),
+            ds.number_of_motorist_injured.data(), ds.number_of_motorist_killed.data()};
+        const int32_t *days = ds.crash_date.data();
+        const uint16_t *b = ds.borough.codeData().data(), *f = ds.contributing_factor_vehicle_1.codeData().data();
+        size_t n = ds.size();
+
+        // Row ids by cell key: a counting sort by day (the days of a partition span a few thousand
+        // values, missing ones first), then each day's rows by borough and factor.
+        int32_t first = INT32_MAX, last = INT32_MIN;
+        for (size_t r = 0; r < n; r++) {
+            if (days[r] == VectorizedDataSet::kNullDate) continue;
+            first = min(first, days[r]);
+            last = max(last, days[r]);
+        }
+        size_t span = first <= last ? size_t(int64_t(last) - first) + 1 : 0;
+        auto bucketOf = [&](size_t r) { return days[r] == VectorizedDataSet::kNullDate ? 0 : size_t(days[r] - first) + 1; };
+        vector<pair<uint32_t, uint32_t>> keyed(n);   // (borough << 16 | factor, row)
+        if (span <= 4 * n + 65536) {
+            vector<uint32_t> offsets(span + 2, 0);
+            for (size_t r = 0; r < n; r++) offsets[bucketOf(r) + 1]++;
+            for (size_t d = 0; d <= span; d++) offsets[d + 1] += offsets[d];
+            vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+            for (size_t r = 0; r < n; r++) keyed[next[bucketOf(r)]++] = {uint32_t(b[r]) << 16 | f[r], uint32_t(r)};
+            for (size_t d = 0; d <= span; d++) sort(keyed.begin() + offsets[d], keyed.begin() + offsets[d + 1]);
+        } else {
+            // Stray dates far apart: a comparison sort.
+            for (size_t r = 0; r < n; r++) keyed[r] = {uint32_t(b[r]) << 16 | f[r], uint32_t(r)};
+            sort(keyed.begin(), keyed.end(), [&](const pair<uint32_t, uint32_t> &x, const pair<uint32_t, uint32_t> &y) {
+                int32_t dx = days[x.second], dy = days[y.second];
+                return dx != dy ? dx < dy : x < y;
+            });
+        }
+
+        // One cell per run of equal keys; the sums are then added in row order.
+        vector<uint32_t> cellOf(n);
+        for (size_t i = 0; i < n; i++) {
+            uint32_t r = keyed[i].second;
+            if (i == 0 || keyed[i].first != keyed[i - 1].first || days[r] != days[keyed[i - 1].second])
+                cube.cells.push_back(Cell{days[r], b[r], f[r], 0, {}});
+            cellOf[r] = uint32_t(cube.cells.size() - 1);
+        }
+        for (size_t r = 0; r < n; r++) {
+            Cell &c = cube.cells[cellOf[r]];
+            c.rows++;
+            // INT32_MIN counts as missing, as in QueryEngine's SUM.
+            for (size_t s = 0; s < kSums; s++)
+                if (sums[s][r] != INT32_MIN) c.sums[s] += sums[s][r];
+        }
+        return cube;
+    }
+
+    // Empty cube whose codes are those of the partition's own dictionaries, for cells computed
+    // from its rows (of()) or stored along with them (a snapshot).
+    static RollupCube keyedBy(const VectorizedDataSet &ds, uint64_t version) {
+        RollupCube cube;
+        cube.version = version;
+        for (size_t i = 0; i < ds.borough.cardinality(); i++) cube.boroughs.emplace_back(ds.borough.dictionary()[i]);
+        for (size_t i = 0; i < ds.contributing_factor_vehicle_1.cardinality(); i++)
+            cube.factors.emplace_back(ds.contributing_factor_vehicle_1.dictionary()[i]);
+        return cube;
+    }
+
+    // Add the cells of a cube of other rows.
+    void merge(const RollupCube &other) {
+        vector<uint32_t> b = remap(boroughs, other.boroughs), f = remap(factors, other.factors);
+        size_t mine = cells.size();
+        cells.reserve(mine + other.cells.size());
+        for (Cell c : other.cells) {
+            c.borough = b[c.borough];
+            c.factor = f[c.factor];
+            cells.push_back(c);
+        }
+        sort(cells.begin() + mine, cells.end(), before);
+        inplace_merge(cells.begin(), cells.begin() + mine, cells.end(), before);
+        coalesce();
+        version += other.version;
+    }
+
+    void toProto(query::RollupCube &out) const {
+        out.set_data_version(version);
+        for (const string &s : boroughs) out.add_boroughs(s);
+        for (const string &s : factors) out.add_factors(s);
+        int64_t day = 0;
+        for (const Cell &c : cells) {
+            out.add_days(int64_t(c.day) - day);
+            day = c.day;
+            out.add_borough_codes(c.borough);
+            out.add_factor_codes(c.factor);
+            out.add_rows(c.rows);
+            for (size_t s = 0; s < kSums; s++) out.add_sums(c.sums[s]);
+        }
+    }
+
+    // False when the message is not a well-formed cube.
+    static bool fromProto(const query::RollupCube &in, RollupCube &out) {
+        size_t n = in.days_size();
+        if (size_t(in.borough_codes_size()) != n || size_t(in.factor_codes_size()) != n || size_t(in.rows_size()) != n ||
+            size_t(in.sums_size()) != n * kSums)
+            return false;
+        out.version = in.data_version();
+        out.boroughs.assign(in.boroughs().begin(), in.boroughs().end());
+        out.factors.assign(in.factors().begin(), in.factors().end());
+        out.cells.resize(n);
+        int64_t day = 0;
+        for (size_t i = 0; i < n; i++) {
+            Cell &c = out.cells[i];
+            day += in.days(i);
+            if (day < INT32_MIN || day > INT32_MAX || in.borough_codes(i) >= out.boroughs.size() || in.factor_codes(i) >= out.factors.size())
+                return false;
+            c.day = int32_t(day);
+            c.borough = in.borough_codes(i);
+            c.factor = in.factor_codes(i);
+            c.rows = in.rows(i);
+            for (size_t s = 0; s < kSums; s++) c.sums[s] = in.sums(i * kSums + s);
+            if (i > 0 && !before(out.cells[i - 1], c)) return false;
+        }
+        return true;
+    }
+
+    // Whether a validated query can be answered from a cube: no ids, grouped by nothing, BOROUGH
+    // or CONTRIBUTING_FACTOR_VEHICLE_1, filtered only by date windows and by equals/in on those two
+    // columns, and aggregating only COUNT and SUM of number_of_* columns.
+    static bool answers(const query::Query &q) {
+        if (q.collect_ids()) return false;
+        if (q.group_by() != query::COLUMN_UNSPECIFIED && !isKey(q.group_by())) return false;
+        for (const auto &p : q.where()) {
+            bool window = p.test_case() == query::Predicate::kDateWindow;
+            bool values = isKey(p.column()) && (p.test_case() == query::Predicate::kEquals || p.test_case() == query::Predicate::kIn);
+            if (!window && !values) return false;
+        }
+        for (const auto &a : q.aggregates())
+            if (a.op() != query::COUNT && !(a.op() == query::SUM && sumOf(a.column()) < kSums)) return false;
+        return true;
+    }
+
+    // Result of a query answers() accepts, as merging evaluate()'s over the cube's rows would give
+    // it; no rows are scanned.
+    query::QueryResult answer(const query::Query &q) const {
+        int32_t lo = INT32_MIN, hi = INT32_MAX;
+        vector<char> boroughOk(boroughs.size(), 1), factorOk(factors.size(), 1);
+        for (const auto &p : q.where()) {
+            if (p.test_case() == query::Predicate::kDateWindow) {
+                // An open bound still leaves out rows without a date.
+                const auto &w = p.date_window();
+                lo = max(lo, w.from().empty() ? VectorizedDataSet::kNullDate + 1 : VectorizedDataSet::parseDate(w.from()));
+                if (!w.to().empty()) hi = min(hi, VectorizedDataSet::parseDate(w.to()));
+                continue;
+            }
+            unordered_set<string_view> wanted;
+            if (p.test_case() == query::Predicate::kEquals) wanted.insert(p.equals());
+            else wanted.insert(p.in().values().begin(), p.in().values().end());
+            bool borough = p.column() == query::BOROUGH;
+            vector<char> &ok = borough ? boroughOk : factorOk;
+            const vector<string> &dict = borough ? boroughs : factors;
+            for (size_t i = 0; i < dict.size(); i++) ok[i] &= wanted.count(dict[i]) > 0;
+        }
+
+        bool grouped = q.group_by() != query::COLUMN_UNSPECIFIED, byBorough = q.group_by() == query::BOROUGH;
+        const vector<string> &keys = byBorough ? boroughs : factors;
+        size_t groups = grouped ? keys.size() : 1;
+        vector<uint64_t> rows(groups, 0);
+        vector<int64_t> sums(groups * kSums, 0);
+        auto first = lower_bound(cells.begin(), cells.end(), lo, [](const Cell &c, int32_t day) { return c.day < day; });
+        for (auto c = first; c != cells.end() && c->day <= hi; ++c) {
+            if (!boroughOk[c->borough] || !factorOk[c->factor]) continue;
+            size_t g = !grouped ? 0 : byBorough ? c->borough : c->factor;
+            rows[g] += c->rows;
+            for (size_t s = 0; s < kSums; s++) sums[g * kSums + s] += c->sums[s];
+        }
+
+        query::QueryResult result;
+        for (size_t g = 0; g < groups; g++) {
+            if (grouped && rows[g] == 0) continue;
+            query::GroupResult *out = result.add_groups();
+            if (grouped) out->set_key(keys[g]);
+            out->set_rows(rows[g]);
+            for (const auto &a : q.aggregates())
+                out->add_values()->set_int_value(a.op() == query::COUNT ? int64_t(rows[g]) : sums[g * kSums + sumOf(a.column())]);
+        }
+        sort(result.mutable_groups()->begin(), result.mutable_groups()->end(),
+             [](const query::GroupResult &a, const query::GroupResult &b) { return a.key() < b.key(); });
+        result.set_data_version(version);
+        return result;
+    }
+
+private:
+    static bool before(const Cell &a, const Cell &b) {
+        if (a.day != b.day) return a.day < b.day;
+        if (a.borough != b.borough) return a.borough < b.borough;
+        return a.factor < b.factor;
+    }
+
+    static bool isKey(query::Column c) { return c == query::BOROUGH || c == query::CONTRIBUTING_FACTOR_VEHICLE_1; }
+
+    // Index of a number_of_* column in Cell::sums; kSums for any other column.
+    static size_t sumOf(query::Column c) {
+        return c >= query::NUMBER_OF_PERSONS_INJURED && c <= query::NUMBER_OF_MOTORIST_KILLED ? size_t(c - query::NUMBER_OF_PERSONS_INJURED) : kSums;
+    }
+
+    // Codes in 'into' of the values of 'from', adding those it lacks.
+    static vector<uint32_t> remap(vector<string> &into, const vector<string> &from) {
+        unordered_map<string_view, uint32_t> at;
+        for (size_t i = 0; i < into.size(); i++) at.emplace(into[i], uint32_t(i));
+        vector<uint32_t> codes(from.size());
+        for (size_t i = 0; i < from.size(); i++) {
+            auto it = at.find(from[i]);
+            if (it != at.end()) {
+                codes[i] = it->second;
+                continue;
+            }
+            codes[i] = uint32_t(into.size());
+            into.push_back(from[i]);
+        }
+        return codes;
+    }
+
+    // Fold runs of cells with the same key, in a sorted vector, into one.
+    void coalesce() {
+        size_t w = 0;
+        for (size_t i = 0; i < cells.size(); i++) {
+            if (w > 0 && !before(cells[w - 1], cells[i])) {
+                cells[w - 1].rows += cells[i].rows;
+                for (size_t s = 0; s < kSums; s++) cells[w - 1].sums[s] += cells[i].sums[s];
+            } else {
+                cells[w++] = cells[i];
+            }
+        }
+        cells.resize(w);
+    }
+};
+
+// The subtree cubes of a node's children, fetched with the Rollup RPC by a ChildPoller as
+// often as their summaries. A child sends its cells only when its cube changed since the last call.
+class ChildRollups {
+public:
+    void start(const OverlayChildren &children, const string &origin, chrono::milliseconds interval = chrono::seconds(10)) {
+        cubes.assign(children.size(), nullptr);
+        poller.start(children, interval, [this, origin](size_t i, OverlayChildren::Replica &r) {
+            overlay::RollupRequest request;
+            request.set_origin(origin);
+            shared_ptr<const RollupCube> known;
+            {
+                lock_guard<mutex> lock(m);
+                known = cubes[i];
+            }
+            if (known) request.set_known_version(known->version);
+            query::RollupCube reply;
+            grpc::ClientContext ctx;
+            ctx.set_deadline(chrono::system_clock::now() + chrono::seconds(5));
+            if (!r.stub->Rollup(&ctx, request, &reply).ok()) return false;
+            auto cube = make_shared<RollupCube>();
+            if (!(known && reply.data_version() == known->version) && RollupCube::fromProto(reply, *cube)) {
+                lock_guard<mutex> lock(m);
+                cubes[i] = std::move(cube);
+                changes++;
+            }
+            return true;
+        }, [this](size_t i) {
+            lock_guard<mutex> lock(m);
+            return cubes[i] != nullptr;
+        });
+    }
+
+    // Every child's latest cube; false while some child's is unknown.
+    bool all(vector<shared_ptr<const RollupCube>> &out) const {
+        lock_guard<mutex> lock(m);
+        for (const auto &c : cubes)
+            if (!c) return false;
+        out = cubes;
+        return true;
+    }
+
+    // Changes whenever a child's cube does.
+    uint64_t generation() const {
+        lock_guard<mutex> lock(m);
+        return changes;
+    }
+
+private:
+    mutable mutex m;
+    vector<shared_ptr<const RollupCube>> cubes;   // null until a child's is known
+    uint64_t changes = 0;
+    ChildPoller poller;
+};
+
+#endif
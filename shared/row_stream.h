@@ -0,0 +1,383 @@
+#ifndef ROW_STREAM_H
+#define ROW_STREAM_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <grpcpp/grpcpp.h>
+#include "overlay.grpc.pb.h"
+#include "query_engine.h"
+#include "query_scheduler.h"
+#include "overlay_fanout.h"
+#include "partition_epochs.h"
+
+using namespace std;
+
+// Columnar RowBatch encoding of dataset rows.
+class RowBatches {
+public:
+    static const uint32_t kDefaultBatchRows = 4096;
+    static const uint32_t kMaxBatchRows = 65536;
+
+    // Empty when the request is valid, otherwise what is wrong with it.
+    static string validate(const query::RowQuery &request) {
+        string error = QueryEngine::validate(request.query());
+        if (!error.empty()) return error;
+        for (int c : request.columns()) {
+            if (c == query::COLUMN_UNSPECIFIED || !query::Column_IsValid(c)) return "projection names an unknown column";
+        }
+        return "";
+    }
+
+    // Projected columns in output order; every column when the request names none.
+    static vector<query::Column> projection(const query::RowQuery &request) {
+        vector<query::Column> cols;
+        for (int c : request.columns()) cols.push_back(query::Column(c));
+        if (cols.empty()) {
+            for (int c = query::Column_MIN; c <= query::Column_MAX; c++)
+                if (c != query::COLUMN_UNSPECIFIED) cols.push_back(query::Column(c));
+        }
+        return cols;
+    }
+
+    static size_t batchRows(const query::RowQuery &request) {
+        if (request.batch_rows() == 0) return kDefaultBatchRows;
+        return min<size_t>(request.batch_rows(), kMaxBatchRows);
+    }
+
+    // Encode rows[begin, end) of ds into 'out' with one chunk per projected column.
+    static void fill(const VectorizedDataSet &ds, const vector<RowId> &rows, size_t begin, size_t end,
+                     const vector<query::Column> &cols, query::RowBatch *out) {
+        out->Clear();
+        out->set_rows(uint32_t(end - begin));
+        for (query::Column c : cols) {
+            query::ColumnChunk *chunk = out->add_columns();
+            chunk->set_column(c);
+            visit([&](auto col) {
+                using Ref = decltype(col);
+                if constexpr (is_same_v<Ref, const Column<int32_t> *> || is_same_v<Ref, const Column<int16_t> *>) {
+                    chunk->mutable_ints()->Reserve(int(end - begin));
+                    for (size_t i = begin; i < end; i++) chunk->add_ints((*col)[rows[i]]);
+                } else if constexpr (is_same_v<Ref, const Column<float> *>) {
+                    chunk->mutable_floats()->Reserve(int(end - begin));
+                    for (size_t i = begin; i < end; i++) chunk->add_floats((*col)[rows[i]]);
+                } else if constexpr (!is_same_v<Ref, monostate>) {
+                    chunk->mutable_strings()->Reserve(int(end - begin));
+                    for (size_t i = begin; i < end; i++) {
+                        string_view v = (*col)[rows[i]];
+                        chunk->add_strings()->assign(v.data(), v.size());
+                    }
+                }
+            }, QueryEngine::columnOf(ds, c));
+        }
+    }
+
+    // Keep only the first 'rows' rows of a batch.
+    static void truncate(query::RowBatch &batch, uint32_t rows) {
+        if (rows >= batch.rows()) return;
+        for (auto &chunk : *batch.mutable_columns()) {
+            if (chunk.ints_size() > int(rows)) chunk.mutable_ints()->Truncate(int(rows));
+            if (chunk.floats_size() > int(rows)) chunk.mutable_floats()->Truncate(int(rows));
+            if (chunk.strings_size() > int(rows)) chunk.mutable_strings()->DeleteSubrange(int(rows), chunk.strings_size() - int(rows));
+        }
+        batch.set_rows(rows);
+    }
+};
+
+// Server side of a row stream (DataPortal.FetchRows / OverlayComm.PullRows). The node's own
+// matching rows (if it has data) and every child's PullRows stream are relayed to the caller as
+// batches become ready, without buffering whole results. Only one write is in flight and a child
+// is asked for its next batch only once its previous one has been written, so a slow reader
+// holds back the whole subtree through gRPC flow control. A child that fails before any of its
+// rows were relayed is asked again on its next replica; one that fails later, or on every
+// replica, is left out, and the stream ends with a batch marked partial that lists it (and
+// whatever the children's own final batches listed).
+class RowStream : public grpc::ServerWriteReactor<query::RowBatch> {
+public:
+    // epoch and scheduler may be null for a node without a partition (A) or whose partition cannot
+    // match; only the children listed in 'targets' are asked for rows, each from the replicas in
+    // their order() until one answers. Child calls end at 'deadline'. The stream's queueing, scan
+    // and total time are recorded in 'trace', whose id is passed on to the children.
+    static RowStream *start(const query::RowQuery &request, const string &origin, shared_ptr<const PartitionEpoch> epoch,
+                            QueryScheduler *scheduler, const OverlayChildren &children, const vector<size_t> &targets,
+                            chrono::system_clock::time_point deadline, shared_ptr<QueryTrace> trace) {
+        bool local = epoch != nullptr;
+        RowStream *s = new RowStream(request, origin, std::move(epoch), deadline, std::move(trace));
+        string error = RowBatches::validate(request);
+        if (!error.empty()) {
+            s->finishNow(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, error));
+            return s;
+        }
+        for (size_t i : targets) s->sources.push_back({children[i].target, children[i].order()});
+        for (size_t i = 0; i < targets.size(); i++) s->children.push_back(make_unique<ChildStream>(s, i, 0));
+        s->refs = 1 + s->children.size() + (local ? 1 : 0);
+        s->sourcesOpen = s->children.size() + (local ? 1 : 0);
+        uint64_t submitted = Tracing::nowUs();
+        if (local && !scheduler->submit([s, submitted] { s->scanLocal(submitted); })) {
+            s->refs = 1;
+            s->finishNow(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, origin + ": too many queued scans"));
+            return s;
+        }
+        for (size_t i = 0; i < targets.size(); i++) s->pull(s->children[i].get());
+        s->step();
+        return s;
+    }
+
+    void OnWriteDone(bool ok) override {
+        ChildStream *from;
+        {
+            lock_guard<mutex> lock(m);
+            writing = false;
+            from = writtenFrom;
+            writtenFrom = nullptr;
+            if (!ok) cancelled = true;
+        }
+        if (from) from->StartRead(&from->batch);
+        step();
+    }
+
+    void OnCancel() override {
+        {
+            lock_guard<mutex> lock(m);
+            cancelled = true;
+        }
+        step();
+    }
+
+    void OnDone() override {
+        trace->span("total", startedUs, Tracing::nowUs(), "rows " + to_string(sent));
+        release();
+    }
+
+private:
+    // A child subtree and the replicas to ask for its rows, in order.
+    struct Source {
+        string target;   // the primary's address, listed when the subtree's rows are missing
+        vector<OverlayChildren::Replica *> replicas;
+    };
+
+    // One PullRows call to one replica of sources[source].
+    struct ChildStream : public grpc::ClientReadReactor<query::RowBatch> {
+        ChildStream(RowStream *parent, size_t source, size_t attempt) : parent(parent), source(source), attempt(attempt) {}
+        void OnReadDone(bool ok) override { parent->childRead(this, ok); }
+        void OnDone(const grpc::Status &status) override { parent->childDone(this, status); }
+
+        RowStream *parent;
+        size_t source, attempt;   // attempt indexes the source's replicas
+        bool relayed = false;     // some of its batches have been queued for the caller
+        grpc::ClientContext ctx;
+        query::RowBatch batch;
+    };
+
+    RowStream(const query::RowQuery &request, const string &origin, shared_ptr<const PartitionEpoch> epoch,
+              chrono::system_clock::time_point deadline, shared_ptr<QueryTrace> trace)
+        : request(request), origin(origin), epoch(std::move(epoch)), cols(RowBatches::projection(request)),
+          batchRows(RowBatches::batchRows(request)), limit(request.limit()), deadline(deadline), trace(std::move(trace)),
+          startedUs(Tracing::nowUs()) {}
+
+    void pull(ChildStream *c) {
+        OverlayChildren::Replica *replica = sources[c->source].replicas[c->attempt];
+        c->ctx.set_deadline(deadline);
+        Tracing::propagate(c->ctx, trace->id());
+        replica->stub->async()->PullRows(&c->ctx, &request, c);
+        c->AddHold();   // OnDone waits until the stream end has been seen
+        c->StartRead(&c->batch);
+        c->StartCall();
+    }
+
+    void finishNow(const grpc::Status &status) {
+        finished = true;
+        Finish(status);
+    }
+
+    void scanLocal(uint64_t submitted) {
+        uint64_t begin = Tracing::nowUs();
+        vector<pair<const VectorizedDataSet *, vector<RowId>>> rows;
+        for (const auto &segment : epoch->segments) {
+            vector<RowId> matched = QueryEngine::select(segment->data, request.query());
+            if (!matched.empty()) rows.emplace_back(&segment->data, std::move(matched));
+        }
+        trace->span("queue", submitted, begin);
+        trace->span("scan", begin, Tracing::nowUs());
+        {
+            lock_guard<mutex> lock(m);
+            localRows = std::move(rows);
+            localReady = true;
+            if (localRows.empty()) sourcesOpen--;
+        }
+        step();
+        release();
+    }
+
+    void childRead(ChildStream *c, bool ok) {
+        bool resume = false;
+        {
+            lock_guard<mutex> lock(m);
+            if (!ok) {
+                // The stream has ended; childDone() tells how.
+            } else if (finished) {
+                resume = true;   // drain; the read fails once the cancellation lands
+            } else if (c->batch.partial()) {
+                // A child's final batch: its own missing subtrees become ours.
+                for (const auto &t : c->batch.missing()) missing.push_back(t);
+                resume = true;
+            } else {
+                c->relayed = true;
+                queue.push_back({std::move(c->batch), c});
+            }
+        }
+        if (!ok) c->RemoveHold();
+        else if (resume) c->StartRead(&c->batch);
+        step();
+    }
+
+    void childDone(ChildStream *c, const grpc::Status &status) {
+        uint64_t now = Tracing::nowUs();
+        OverlayChildren::Replica *replica = sources[c->source].replicas[c->attempt];
+        ChildStream *retry = nullptr;
+        bool failed;
+        {
+            lock_guard<mutex> lock(m);
+            failed = !status.ok() && !(finished && status.error_code() == grpc::StatusCode::CANCELLED);
+            if (status.ok()) {
+                replica->failedAtUs.store(0, memory_order_relaxed);
+            } else if (status.error_code() != grpc::StatusCode::CANCELLED) {
+                replica->failedAtUs.store(now, memory_order_relaxed);
+            }
+            if (!failed) {
+                sourcesOpen--;
+            } else if (!c->relayed && !finished && status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED &&
+                       c->attempt + 1 < sources[c->source].replicas.size()) {
+                // Nothing of this child has reached the caller, so its next replica can start over.
+                children.push_back(make_unique<ChildStream>(this, c->source, c->attempt + 1));
+                retry = children.back().get();
+                refs++;
+            } else {
+                missing.push_back(sources[c->source].target);
+                sourcesOpen--;
+            }
+        }
+        if (failed) {
+            std::cerr << origin << ": Row stream from " << replica->target << " failed: " << status.error_message()
+                      << (retry ? ", trying the next replica" : "") << std::endl;
+            trace->span("downstream", now, now, replica->target + (retry ? " failed over" : " failed"));
+        }
+        if (retry) pull(retry);
+        step();
+        release();
+    }
+
+    // Start the next write or finish the call, whichever is due. Safe to call from any thread.
+    void step() {
+        enum { NOTHING, WRITE, WRITE_LOCAL, WRITE_MISSING, FINISH } action = NOTHING;
+        size_t segment = 0, begin = 0, end = 0;
+        vector<ChildStream *> drain;
+        grpc::Status status;
+        {
+            lock_guard<mutex> lock(m);
+            if (finished || writing) return;
+            bool full = limit && sent >= limit;
+            if (cancelled) {
+                action = FINISH;
+                status = grpc::Status::CANCELLED;
+            } else if (full) {
+                action = missing.empty() || missingSent ? FINISH : WRITE_MISSING;
+            } else if (!queue.empty()) {
+                current = std::move(queue.front().first);
+                writtenFrom = queue.front().second;
+                queue.pop_front();
+                if (limit) RowBatches::truncate(current, uint32_t(min<uint64_t>(current.rows(), limit - sent)));
+                sent += current.rows();
+                action = WRITE;
+            } else if (localReady && localSegment < localRows.size()) {
+                // Batches do not span segments.
+                segment = localSegment;
+                size_t n = localRows[segment].second.size();
+                begin = localCursor;
+                end = min(n, begin + batchRows);
+                if (limit) end = min<size_t>(end, begin + (limit - sent));
+                localCursor = end;
+                if (localCursor == n) {
+                    localSegment++;
+                    localCursor = 0;
+                    if (localSegment == localRows.size()) sourcesOpen--;
+                }
+                sent += end - begin;
+                action = WRITE_LOCAL;
+            } else if (sourcesOpen == 0) {
+                // Every source has ended; say which subtrees could not add their rows.
+                action = missing.empty() || missingSent ? FINISH : WRITE_MISSING;
+            }
+            if (action == WRITE_MISSING) {
+                missingSent = true;
+                current.Clear();
+                current.set_origin(origin);
+                current.set_partial(true);
+                for (const auto &t : missing) current.add_missing(t);
+            }
+            if (action == FINISH) {
+                finished = true;
+                for (auto &q : queue) drain.push_back(q.second);
+                queue.clear();
+            } else if (action != NOTHING) {
+                writing = true;
+            }
+        }
+        switch (action) {
+        case WRITE_LOCAL:
+            RowBatches::fill(*localRows[segment].first, localRows[segment].second, begin, end, cols, &current);
+            current.set_origin(origin);
+            // fall through
+        case WRITE:
+        case WRITE_MISSING:
+            StartWrite(&current);
+            break;
+        case FINISH:
+            for (auto &c : children) c->ctx.TryCancel();
+            for (ChildStream *c : drain) c->StartRead(&c->batch);
+            Finish(status);
+            break;
+        case NOTHING:
+            break;
+        }
+    }
+
+    // Drop one reference (the server call, a child call or the local scan); the last one frees.
+    void release() {
+        bool last;
+        {
+            lock_guard<mutex> lock(m);
+            last = --refs == 0;
+        }
+        if (last) delete this;
+    }
+
+    const query::RowQuery request;
+    const string origin;
+    const shared_ptr<const PartitionEpoch> epoch;   // the partition as of the stream's start
+    const vector<query::Column> cols;
+    const size_t batchRows;
+    const uint64_t limit;
+    const chrono::system_clock::time_point deadline;
+    const shared_ptr<QueryTrace> trace;
+    const uint64_t startedUs;
+
+    mutex m;
+    vector<Source> sources;
+    vector<unique_ptr<ChildStream>> children;            // every call made, retries after the first ones
+    deque<pair<query::RowBatch, ChildStream *>> queue;   // child batches waiting to be written
+    query::RowBatch current;                             // the batch being written
+    ChildStream *writtenFrom = nullptr;                  // child to resume once 'current' is written
+    vector<pair<const VectorizedDataSet *, vector<RowId>>> localRows;   // matching rows of each segment with some
+    size_t localSegment = 0, localCursor = 0;
+    vector<string> missing;                              // children whose rows are left out
+    bool localReady = false, writing = false, finished = false, cancelled = false, missingSent = false;
+    size_t sourcesOpen = 0;
+    uint64_t sent = 0;
+    size_t refs = 1;
+};
+
+#endif
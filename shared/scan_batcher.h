@@ -0,0 +1,102 @@
+#ifndef SCAN_BATCHER_H
+#define SCAN_BATCHER_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include "partition_epochs.h"
+#include "query_scheduler.h"
+#include "trace.h"
+
+using namespace std;
+
+// Groups the full local scans that arrive within 'window' of each other into one pass over the
+// partition (see QueryEngine::evaluateBatch), so concurrent queries share the trip through memory.
+// The first scan of a batch is queued on the scheduler; the worker that takes it waits out what
+// is left of the window, closes the batch and evaluates every scan in it, each getting its own
+// result. Scans join a batch only while it is open and reads the same epoch, up to kMaxScans.
+// A zero window queues every scan on its own.
+class ScanBatcher {
+public:
+    static const size_t kMaxScans = 64;
+
+    struct Scan {
+        query::Query query;
+        chrono::system_clock::time_point deadline;
+        uint64_t submittedUs = 0;
+        // Called on the worker with the scan's result, the time the batch started and the number
+        // of scans in it; with a null result when the deadline passed before the batch ran.
+        function<void(query::QueryResult *, uint64_t beginUs, size_t batched)> done;
+    };
+
+    struct Stats {
+        uint64_t batches = 0;   // passes run
+        uint64_t scans = 0;     // scans they served
+    };
+
+    explicit ScanBatcher(chrono::microseconds window) : window(window) {}
+
+    // False, without calling done, when a new batch is needed and the scheduler's admission queue is full.
+    bool submit(QueryScheduler &scheduler, shared_ptr<const PartitionEpoch> epoch, Scan scan) {
+        auto batch = make_shared<Batch>();
+        batch->epoch = std::move(epoch);
+        batch->closes = chrono::steady_clock::now() + window;
+        lock_guard<mutex> lock(m);
+        if (window.count() > 0 && open && open->epoch == batch->epoch && open->scans.size() < kMaxScans) {
+            open->scans.push_back(std::move(scan));
+            return true;
+        }
+        batch->scans.push_back(std::move(scan));
+        if (!scheduler.submit([this, batch] { run(batch); })) return false;
+        if (window.count() > 0) open = batch;
+        return true;
+    }
+
+    Stats stats() const { return {batches.load(), scans.load()}; }
+
+private:
+    struct Batch {
+        shared_ptr<const PartitionEpoch> epoch;
+        chrono::steady_clock::time_point closes;
+        vector<Scan> scans;
+    };
+
+    void run(const shared_ptr<Batch> &batch) {
+        this_thread::sleep_until(batch->closes);
+        vector<Scan> taken;
+        {
+            lock_guard<mutex> lock(m);
+            if (open == batch) open.reset();
+            taken = std::move(batch->scans);
+        }
+        uint64_t begin = Tracing::nowUs();
+        auto now = chrono::system_clock::now();
+        vector<const query::Query *> qs;
+        vector<Scan *> live;
+        for (auto &s : taken) {
+            if (now >= s.deadline) {
+                // The caller has given up; leave the scan out rather than add to the pass.
+                s.done(nullptr, begin, taken.size());
+                continue;
+            }
+            qs.push_back(&s.query);
+            live.push_back(&s);
+        }
+        if (live.empty()) return;
+        vector<query::QueryResult> results = batch->epoch->evaluateBatch(qs);
+        batches++;
+        scans += live.size();
+        for (size_t k = 0; k < live.size(); k++) live[k]->done(&results[k], begin, live.size());
+    }
+
+    const chrono::microseconds window;
+    mutex m;
+    shared_ptr<Batch> open;   // accepting scans until its worker closes it
+    atomic<uint64_t> batches{0}, scans{0};
+};
+
+#endif
@@ -0,0 +1,361 @@
+#ifndef SCAN_KERNELS_H
+#define SCAN_KERNELS_H
+
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include "scan_pool.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_KERNELS_X86 1
+#endif
+
+using namespace std;
+
+// Row position inside one node's partition.
+using RowId = uint32_t;
+
+// One bit per row; bit i of words[i / 64] is row i.
+class SelectionBitmap {
+public:
+    SelectionBitmap() = default;
+    explicit SelectionBitmap(size_t rows) : words((rows + 63) / 64, 0), rows(rows) {}
+
+    size_t size() const { return rows; }
+    bool test(size_t i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+    void set(size_t i) { words[i >> 6] |= uint64_t(1) << (i & 63); }
+    uint64_t *data() { return words.data(); }
+    const uint64_t *data() const { return words.data(); }
+    size_t wordCount() const { return words.size(); }
+
+    size_t count() const {
+        size_t n = 0;
+        for (uint64_t w : words) n += __builtin_popcountll(w);
+        return n;
+    }
+
+    // Keep only rows also selected in 'other' (same size).
+    void intersect(const SelectionBitmap &other) {
+        for (size_t i = 0; i < words.size(); i++) words[i] &= other.words[i];
+    }
+
+private:
+    vector<uint64_t> words;
+    size_t rows = 0;
+};
+
+// A block of kBlockRows rows that a scan visits; 'all' when every row of it is known to match
+// (from a zone map), so the block is taken without testing a row.
+struct BlockRef {
+    uint32_t block;
+    bool all;
+};
+
+// Range-predicate scans over int32 columns: lo <= v[i] <= hi. Each kernel has a scalar version
+// and AVX2/AVX-512 versions chosen once at runtime from the CPU's features; the SCAN_ISA
+// environment variable ("scalar", "avx2", "avx512") caps the choice for benchmarking.
+// The parallel entry points split the rows into kBlockRows blocks, one ScanPool task each. A block
+// plan (see ZoneMap) narrows them to the blocks that can match.
+class ScanKernels {
+public:
+    enum Isa { SCALAR = 0, AVX2 = 1, AVX512 = 2 };
+
+    static const size_t kBlockRows = 1 << 16;  // a multiple of 64 so blocks own whole bitmap words
+
+    static Isa isa() {
+        static const Isa chosen = detectIsa();
+        return chosen;
+    }
+
+    static const char *isaName(Isa i) {
+        return i == AVX512 ? "avx512" : i == AVX2 ? "avx2" : "scalar";
+    }
+
+    // Whether the CPU can run the kernels of 'i', whatever SCAN_ISA says.
+    static bool supports(Isa i) { return i <= hardwareIsa(); }
+
+    // Every block of n rows, none known to match entirely.
+    static vector<BlockRef> allBlocks(size_t n) {
+        vector<BlockRef> plan((n + kBlockRows - 1) / kBlockRows);
+        for (size_t b = 0; b < plan.size(); b++) plan[b] = {uint32_t(b), false};
+        return plan;
+    }
+
+    // Number of rows in range.
+    static size_t countInRange(const int32_t *v, size_t n, int32_t lo, int32_t hi) {
+        return countInRange(v, n, lo, hi, allBlocks(n));
+    }
+    static size_t countInRange(const int32_t *v, size_t n, int32_t lo, int32_t hi, const vector<BlockRef> &plan) {
+        if (lo > hi) return 0;
+        vector<size_t> counts(plan.size());
+        ScanPool::shared().forEach(plan.size(), [&](size_t i) { return plan[i].block; }, [&](size_t i, size_t) {
+            size_t begin = plan[i].block * kBlockRows, len = min(kBlockRows, n - begin);
+            counts[i] = plan[i].all ? len : countBlock(v + begin, len, lo, hi);
+        });
+        size_t count = 0;
+        for (size_t c : counts) count += c;
+        return count;
+    }
+
+    // Bitmap of rows in range.
+    static SelectionBitmap selectInRange(const int32_t *v, size_t n, int32_t lo, int32_t hi) {
+        return selectInRange(v, n, lo, hi, allBlocks(n));
+    }
+    static SelectionBitmap selectInRange(const int32_t *v, size_t n, int32_t lo, int32_t hi, const vector<BlockRef> &plan) {
+        SelectionBitmap out(n);
+        if (lo > hi) return out;
+        ScanPool::shared().forEach(plan.size(), [&](size_t i) { return plan[i].block; }, [&](size_t i, size_t) {
+            size_t begin = plan[i].block * kBlockRows, len = min(kBlockRows, n - begin);
+            uint64_t *words = out.data() + begin / 64;
+            if (plan[i].all) {
+                fill(words, words + len / 64, ~uint64_t(0));
+                if (len % 64) words[len / 64] = (uint64_t(1) << (len % 64)) - 1;
+            } else {
+                selectBlock(v + begin, len, lo, hi, words);
+            }
+        });
+        return out;
+    }
+
+    // Ascending row ids of rows in range. Blocks compact into their own buffers, which are then
+    // copied into place, so the result is ordered without any locking.
+    static vector<RowId> indicesInRange(const int32_t *v, size_t n, int32_t lo, int32_t hi) {
+        return indicesInRange(v, n, lo, hi, allBlocks(n));
+    }
+    static vector<RowId> indicesInRange(const int32_t *v, size_t n, int32_t lo, int32_t hi, const vector<BlockRef> &plan) {
+        vector<RowId> out;
+        if (lo > hi) return out;
+        vector<vector<RowId>> parts(plan.size());
+        ScanPool &pool = ScanPool::shared();
+        auto blockOf = [&](size_t i) { return plan[i].block; };
+        pool.forEach(plan.size(), blockOf, [&](size_t i, size_t) {
+            size_t begin = plan[i].block * kBlockRows, len = min(kBlockRows, n - begin);
+            if (plan[i].all) {
+                parts[i].resize(len);
+                for (size_t r = 0; r < len; r++) parts[i][r] = RowId(begin + r);
+                return;
+            }
+            parts[i].resize(len + 16);  // the SIMD compaction stores whole vectors
+            parts[i].resize(compactBlock(v + begin, len, lo, hi, RowId(begin), parts[i].data()));
+        });
+        vector<size_t> at(plan.size() + 1, 0);
+        for (size_t i = 0; i < plan.size(); i++) at[i + 1] = at[i] + parts[i].size();
+        out.resize(at[plan.size()]);
+        pool.forEach(plan.size(), blockOf, [&](size_t i, size_t) {
+            if (!parts[i].empty()) memcpy(out.data() + at[i], parts[i].data(), parts[i].size() * sizeof(RowId));
+        });
+        return out;
+    }
+
+    // Single-threaded kernels over one block, dispatched on isa() unless 'with' (which the CPU must
+    // support) names other ones.
+    static size_t countBlock(const int32_t *v, size_t n, int32_t lo, int32_t hi, Isa with = isa()) {
+#ifdef SCAN_KERNELS_X86
+        if (with == AVX512) return countAVX512(v, n, lo, hi);
+        if (with == AVX2) return countAVX2(v, n, lo, hi);
+#endif
+        return countScalar(v, n, lo, hi);
+    }
+
+    // Writes (n + 63) / 64 words; bits past n are zero.
+    static void selectBlock(const int32_t *v, size_t n, int32_t lo, int32_t hi, uint64_t *words, Isa with = isa()) {
+#ifdef SCAN_KERNELS_X86
+        if (with == AVX512) return selectAVX512(v, n, lo, hi, words);
+        if (with == AVX2) return selectAVX2(v, n, lo, hi, words);
+#endif
+        selectScalar(v, n, lo, hi, words);
+    }
+
+    // Writes base + i for every row in range to 'out', which must have room for n + 16 ids.
+    static size_t compactBlock(const int32_t *v, size_t n, int32_t lo, int32_t hi, RowId base, RowId *out, Isa with = isa()) {
+#ifdef SCAN_KERNELS_X86
+        if (with == AVX512) return compactAVX512(v, n, lo, hi, base, out);
+        if (with == AVX2) return compactAVX2(v, n, lo, hi, base, out);
+#endif
+        return compactScalar(v, n, lo, hi, base, out);
+    }
+
+private:
+    static Isa hardwareIsa() {
+        static const Isa best = [] {
+            Isa found = SCALAR;
+#ifdef SCAN_KERNELS_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) found = AVX2;
+            if (__builtin_cpu_supports("avx512f")) found = AVX512;
+#endif
+            return found;
+        }();
+        return best;
+    }
+
+    static Isa detectIsa() {
+        Isa best = hardwareIsa();
+        if (const char *cap = getenv("SCAN_ISA")) {
+            string c = cap;
+            Isa limit = c == "scalar" ? SCALAR : c == "avx2" ? AVX2 : AVX512;
+            best = min(best, limit);
+        }
+        return best;
+    }
+
+    // lo <= v <= hi  <=>  unsigned(v - lo) <= unsigned(hi - lo), with wrapping arithmetic.
+    static bool inRange(int32_t v, uint32_t lo, uint32_t span) { return uint32_t(v) - lo <= span; }
+
+    static size_t countScalar(const int32_t *v, size_t n, int32_t lo, int32_t hi) {
+        uint32_t span = uint32_t(hi) - uint32_t(lo);
+        size_t count = 0;
+        for (size_t i = 0; i < n; i++) count += inRange(v[i], lo, span);
+        return count;
+    }
+
+    static void selectScalar(const int32_t *v, size_t n, int32_t lo, int32_t hi, uint64_t *words) {
+        uint32_t span = uint32_t(hi) - uint32_t(lo);
+        for (size_t w = 0; w < (n + 63) / 64; w++) {
+            uint64_t bits = 0;
+            size_t end = min(n, w * 64 + 64);
+            for (size_t i = w * 64; i < end; i++) bits |= uint64_t(inRange(v[i], lo, span)) << (i & 63);
+            words[w] = bits;
+        }
+    }
+
+    static size_t compactScalar(const int32_t *v, size_t n, int32_t lo, int32_t hi, RowId base, RowId *out) {
+        uint32_t span = uint32_t(hi) - uint32_t(lo);
+        size_t k = 0;
+        for (size_t i = 0; i < n; i++) {
+            out[k] = base + RowId(i);
+            k += inRange(v[i], lo, span);
+        }
+        return k;
+    }
+
+#ifdef SCAN_KERNELS_X86
+    // AVX2 has no unsigned compare: flip the sign bit of both sides and compare signed.
+    __attribute__((target("avx2")))
+    static __m256i outOfRangeAVX2(__m256i x, __m256i lo, __m256i spanFlipped) {
+        const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+        return _mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_sub_epi32(x, lo), sign), spanFlipped);
+    }
+
+    __attribute__((target("avx2")))
+    static size_t countAVX2(const int32_t *v, size_t n, int32_t lo, int32_t hi) {
+        const __m256i vlo = _mm256_set1_epi32(lo);
+        const __m256i span = _mm256_set1_epi32(int32_t((uint32_t(hi) - uint32_t(lo)) ^ 0x80000000u));
+        size_t i = 0, out = 0;
+        while (i + 8 <= n) {
+            // Per-lane counters are flushed before they can wrap.
+            __m256i acc = _mm256_setzero_si256();
+            size_t stop = min(n - n % 8, i + (size_t(1) << 33));
+            for (; i < stop; i += 8) {
+                __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + i));
+                acc = _mm256_sub_epi32(acc, outOfRangeAVX2(x, vlo, span));
+            }
+            alignas(32) uint32_t lanes[8];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), acc);
+            for (uint32_t c : lanes) out += c;
+        }
+        return (i - out) + countScalar(v + i, n - i, lo, hi);
+    }
+
+    __attribute__((target("avx2")))
+    static void selectAVX2(const int32_t *v, size_t n, int32_t lo, int32_t hi, uint64_t *words) {
+        const __m256i vlo = _mm256_set1_epi32(lo);
+        const __m256i span = _mm256_set1_epi32(int32_t((uint32_t(hi) - uint32_t(lo)) ^ 0x80000000u));
+        size_t full = n / 64;
+        for (size_t w = 0; w < full; w++) {
+            uint64_t bits = 0;
+            for (size_t j = 0; j < 8; j++) {
+                __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + w * 64 + j * 8));
+                uint32_t out = _mm256_movemask_ps(_mm256_castsi256_ps(outOfRangeAVX2(x, vlo, span)));
+                bits |= uint64_t(~out & 0xFF) << (j * 8);
+            }
+            words[w] = bits;
+        }
+        if (full * 64 < n) selectScalar(v + full * 64, n - full * 64, lo, hi, words + full);
+    }
+
+    // Permutation that moves the selected lanes of an 8-bit mask to the front.
+    static const uint32_t (*compactTable())[8] {
+        static uint32_t table[256][8];
+        static bool ready = [] {
+            for (int m = 0; m < 256; m++) {
+                int k = 0;
+                for (int lane = 0; lane < 8; lane++) if (m & (1 << lane)) table[m][k++] = lane;
+                for (; k < 8; k++) table[m][k] = 0;
+            }
+            return true;
+        }();
+        (void)ready;
+        return table;
+    }
+
+    __attribute__((target("avx2")))
+    static size_t compactAVX2(const int32_t *v, size_t n, int32_t lo, int32_t hi, RowId base, RowId *out) {
+        const uint32_t (*table)[8] = compactTable();
+        const __m256i vlo = _mm256_set1_epi32(lo);
+        const __m256i span = _mm256_set1_epi32(int32_t((uint32_t(hi) - uint32_t(lo)) ^ 0x80000000u));
+        const __m256i step = _mm256_set1_epi32(8);
+        __m256i ids = _mm256_add_epi32(_mm256_set1_epi32(int32_t(base)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        size_t i = 0, k = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + i));
+            uint32_t mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(outOfRangeAVX2(x, vlo, span))) & 0xFF;
+            __m256i perm = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(table[mask]));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), _mm256_permutevar8x32_epi32(ids, perm));
+            k += __builtin_popcount(mask);
+            ids = _mm256_add_epi32(ids, step);
+        }
+        return k + compactScalar(v + i, n - i, lo, hi, base + RowId(i), out + k);
+    }
+
+    __attribute__((target("avx512f")))
+    static size_t countAVX512(const int32_t *v, size_t n, int32_t lo, int32_t hi) {
+        const __m512i vlo = _mm512_set1_epi32(lo);
+        const __m512i span = _mm512_set1_epi32(int32_t(uint32_t(hi) - uint32_t(lo)));
+        size_t i = 0, count = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m512i x = _mm512_sub_epi32(_mm512_loadu_si512(v + i), vlo);
+            count += __builtin_popcount(_mm512_cmple_epu32_mask(x, span));
+        }
+        return count + countScalar(v + i, n - i, lo, hi);
+    }
+
+    __attribute__((target("avx512f")))
+    static void selectAVX512(const int32_t *v, size_t n, int32_t lo, int32_t hi, uint64_t *words) {
+        const __m512i vlo = _mm512_set1_epi32(lo);
+        const __m512i span = _mm512_set1_epi32(int32_t(uint32_t(hi) - uint32_t(lo)));
+        size_t full = n / 64;
+        for (size_t w = 0; w < full; w++) {
+            uint64_t bits = 0;
+            for (size_t j = 0; j < 4; j++) {
+                __m512i x = _mm512_sub_epi32(_mm512_loadu_si512(v + w * 64 + j * 16), vlo);
+                bits |= uint64_t(_mm512_cmple_epu32_mask(x, span)) << (j * 16);
+            }
+            words[w] = bits;
+        }
+        if (full * 64 < n) selectScalar(v + full * 64, n - full * 64, lo, hi, words + full);
+    }
+
+    __attribute__((target("avx512f")))
+    static size_t compactAVX512(const int32_t *v, size_t n, int32_t lo, int32_t hi, RowId base, RowId *out) {
+        const __m512i vlo = _mm512_set1_epi32(lo);
+        const __m512i span = _mm512_set1_epi32(int32_t(uint32_t(hi) - uint32_t(lo)));
+        const __m512i step = _mm512_set1_epi32(16);
+        __m512i ids = _mm512_add_epi32(_mm512_set1_epi32(int32_t(base)),
+                                       _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+        size_t i = 0, k = 0;
+        for (; i + 16 <= n; i += 16) {
+            __mmask16 mask = _mm512_cmple_epu32_mask(_mm512_sub_epi32(_mm512_loadu_si512(v + i), vlo), span);
+            _mm512_mask_compressstoreu_epi32(out + k, mask, ids);
+            k += __builtin_popcount(mask);
+            ids = _mm512_add_epi32(ids, step);
+        }
+        return k + compactScalar(v + i, n - i, lo, hi, base + RowId(i), out + k);
+    }
+#endif
+};
+
+#endif
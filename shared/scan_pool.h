@@ -0,0 +1,293 @@
+#ifndef SCAN_POOL_H
+#define SCAN_POOL_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+// Persistent workers for the block tasks of scans and aggregations, in place of an OpenMP team per
+// call. Each worker owns a deque of tasks. A loop queues task i at the home worker of the column
+// block it reads (block b belongs to worker b % size()), and firstTouch() has that same worker
+// write a column's blocks when they are allocated, so that under Linux's first-touch policy a
+// block's pages sit on the NUMA node of the worker that scans it. A worker takes its own tasks
+// newest first and, once it runs out, steals the oldest of the others', from workers on its own
+// NUMA node first. With 'pin' set, each worker is bound to one CPU of the process's affinity mask,
+// spread over its NUMA nodes. Loops started from a worker run inline.
+class ScanPool {
+public:
+    struct Stats {
+        uint64_t tasks = 0;    // run by the workers
+        uint64_t stolen = 0;   // of those, taken from another worker's deque
+    };
+
+    // Size of the process's pool: takes effect when called before shared() is first used.
+    // Without it the pool has one unpinned worker per CPU.
+    static void configure(int threads, bool pin) {
+        Settings &s = settings();
+        s.threads = max(1, threads);
+        s.pin = pin;
+    }
+
+    static ScanPool &shared() {
+        static ScanPool pool(settings().threads, settings().pin);
+        return pool;
+    }
+
+    ScanPool(int threads, bool pin) : workers(max(1, threads)) {
+        vector<int> cpus = pin ? placement() : vector<int>();
+        for (size_t w = 0; w < workers.size(); w++) {
+            workers[w].cpu = cpus.empty() ? -1 : cpus[w % cpus.size()];
+            workers[w].node = workers[w].cpu < 0 ? 0 : nodeOf(workers[w].cpu);
+        }
+        for (size_t w = 0; w < workers.size(); w++) {
+            // Thieves try the workers of their own NUMA node first, each starting after itself.
+            for (size_t k = 1; k < workers.size(); k++) {
+                size_t v = (w + k) % workers.size();
+                if (workers[v].node == workers[w].node) workers[w].victims.push_back(v);
+            }
+            for (size_t k = 1; k < workers.size(); k++) {
+                size_t v = (w + k) % workers.size();
+                if (workers[v].node != workers[w].node) workers[w].victims.push_back(v);
+            }
+        }
+        for (size_t w = 0; w < workers.size(); w++) workers[w].runner = thread([this, w] { work(w); });
+    }
+    ScanPool(const ScanPool &) = delete;
+    ScanPool &operator=(const ScanPool &) = delete;
+
+    ~ScanPool() {
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &w : workers) w.runner.join();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Per-loop state such as partial aggregates is kept per slot: one per worker, and the last one
+    // for the calling thread.
+    size_t slots() const { return workers.size() + 1; }
+
+    Stats stats() const { return {tasksRun.load(memory_order_relaxed), tasksStolen.load(memory_order_relaxed)}; }
+
+    // Run f(i, slot) for every i in [0, n) and return once all have run. Task i reads column block
+    // blockOf(i) and is queued at that block's home worker. Tasks that run on the same thread get
+    // the same slot (< slots()), so they may share state indexed by it without locking.
+    template <typename BlockOf, typename F>
+    void forEach(size_t n, BlockOf &&blockOf, F &&f) { run(n, blockOf, f, true); }
+
+    // Task i reads block i.
+    template <typename F>
+    void forEach(size_t n, F &&f) {
+        forEach(n, [](size_t i) { return i; }, f);
+    }
+
+    // Write T() over values[from, to), each block of 'blockRows' values by its home worker, none
+    // of them stolen. Called on freshly allocated, untouched column storage.
+    template <typename T>
+    void firstTouch(T *values, size_t from, size_t to, size_t blockRows) {
+        if (from >= to) return;
+        size_t first = from / blockRows, blocks = (to - 1) / blockRows - first + 1;
+        auto touch = [&](size_t i, size_t) {
+            size_t begin = (first + i) * blockRows;
+            fill(values + max(from, begin), values + min(to, begin + blockRows), T());
+        };
+        run(blocks, [first](size_t i) { return first + i; }, touch, false);
+    }
+
+private:
+    struct Settings {
+        int threads = max(1, int(thread::hardware_concurrency()));
+        bool pin = false;
+    };
+
+    // One parallel loop; lives on its caller's stack until every task has finished.
+    struct Job {
+        void (*call)(void *f, size_t i, size_t slot);
+        void *f;
+        atomic<size_t> remaining{0};
+        mutex m;
+        condition_variable done;
+        bool finished = false;
+    };
+
+    struct Task {
+        Job *job;
+        size_t index;
+    };
+
+    struct Worker {
+        mutex m;
+        deque<Task> tasks;   // stealable
+        deque<Task> placed;  // must run here
+        atomic<size_t> placedCount{0};
+        vector<size_t> victims;
+        int cpu = -1;
+        int node = 0;
+        thread runner;
+    };
+
+    static const size_t kNone = SIZE_MAX;
+
+    static Settings &settings() {
+        static Settings s;
+        return s;
+    }
+
+    // Index of the pool worker running on this thread, or kNone.
+    static size_t &current() {
+        thread_local size_t self = kNone;
+        return self;
+    }
+
+    template <typename BlockOf, typename F>
+    void run(size_t n, const BlockOf &blockOf, F &f, bool stealable) {
+        if (n == 0) return;
+        if (n == 1 || current() != kNone) {
+            for (size_t i = 0; i < n; i++) f(i, workers.size());
+            return;
+        }
+        Job job;
+        job.call = [](void *fn, size_t i, size_t slot) { (*static_cast<F *>(fn))(i, slot); };
+        job.f = &f;
+        job.remaining.store(n);
+        vector<vector<Task>> byWorker(workers.size());
+        for (size_t i = 0; i < n; i++) byWorker[size_t(blockOf(i)) % workers.size()].push_back({&job, i});
+        for (size_t w = 0; w < workers.size(); w++) {
+            if (byWorker[w].empty()) continue;
+            lock_guard<mutex> lock(workers[w].m);
+            if (stealable) {
+                workers[w].tasks.insert(workers[w].tasks.end(), byWorker[w].begin(), byWorker[w].end());
+                open.fetch_add(byWorker[w].size());
+            } else {
+                workers[w].placed.insert(workers[w].placed.end(), byWorker[w].begin(), byWorker[w].end());
+                workers[w].placedCount.fetch_add(byWorker[w].size());
+            }
+        }
+        {
+            lock_guard<mutex> lock(sleepMutex);
+        }
+        wake.notify_all();
+        unique_lock<mutex> lock(job.m);
+        job.done.wait(lock, [&] { return job.finished; });
+    }
+
+    void work(size_t w) {
+        current() = w;
+#ifdef __linux__
+        if (workers[w].cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(workers[w].cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+#endif
+        for (;;) {
+            Task t;
+            if (take(w, t)) {
+                t.job->call(t.job->f, t.index, w);
+                if (t.job->remaining.fetch_sub(1) == 1) {
+                    lock_guard<mutex> lock(t.job->m);
+                    t.job->finished = true;
+                    t.job->done.notify_all();
+                }
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMutex);
+            wake.wait(lock, [this, w] { return stopping || open.load() > 0 || workers[w].placedCount.load() > 0; });
+            if (stopping) return;
+        }
+    }
+
+    // The next task for worker w: its own, newest first, then the oldest of a victim's.
+    bool take(size_t w, Task &out) {
+        {
+            Worker &self = workers[w];
+            lock_guard<mutex> lock(self.m);
+            if (!self.placed.empty()) {
+                out = self.placed.back();
+                self.placed.pop_back();
+                self.placedCount.fetch_sub(1);
+                tasksRun.fetch_add(1, memory_order_relaxed);
+                return true;
+            }
+            if (!self.tasks.empty()) {
+                out = self.tasks.back();
+                self.tasks.pop_back();
+                open.fetch_sub(1);
+                tasksRun.fetch_add(1, memory_order_relaxed);
+                return true;
+            }
+        }
+        for (size_t v : workers[w].victims) {
+            Worker &victim = workers[v];
+            lock_guard<mutex> lock(victim.m);
+            if (victim.tasks.empty()) continue;
+            out = victim.tasks.front();
+            victim.tasks.pop_front();
+            open.fetch_sub(1);
+            tasksRun.fetch_add(1, memory_order_relaxed);
+            tasksStolen.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    // CPUs for the workers: the process's allowed CPUs, taking one from each NUMA node in turn.
+    static vector<int> placement() {
+        vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+        vector<vector<int>> byNode;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (!CPU_ISSET(c, &set)) continue;
+            size_t node = size_t(nodeOf(c));
+            if (byNode.size() <= node) byNode.resize(node + 1);
+            byNode[node].push_back(c);
+        }
+        for (size_t k = 0; cpus.size() < size_t(CPU_COUNT(&set)); k++)
+            for (const auto &node : byNode)
+                if (k < node.size()) cpus.push_back(node[k]);
+#endif
+        return cpus;
+    }
+
+    // NUMA node of a CPU, from sysfs (0 when not known).
+    static int nodeOf(int cpu) {
+        error_code ec;
+        filesystem::directory_iterator it("/sys/devices/system/cpu/cpu" + to_string(cpu), ec), end;
+        for (; !ec && it != end; it.increment(ec)) {
+            string name = it->path().filename().string();
+            if (name.size() > 4 && name.compare(0, 4, "node") == 0 && all_of(name.begin() + 4, name.end(), ::isdigit))
+                return stoi(name.substr(4));
+        }
+        return 0;
+    }
+
+    vector<Worker> workers;
+    mutex sleepMutex;
+    condition_variable wake;
+    atomic<int64_t> open{0};   // stealable tasks queued and not yet taken
+    atomic<uint64_t> tasksRun{0}, tasksStolen{0};
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,515 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <type_traits>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.h"
+#include "vectorized_dataset.h"
+#include "partition_summary.h"
+#include "rollup_cube.h"
+
+using namespace std;
+
+// On-disk columnar snapshot of one VectorizedDataSet partition.
+//
+// Layout (native little-endian integers, every section 64-byte aligned):
+//   SnapshotHeader    magic, format version, row counts, source file identity, partition spec
+//   SnapshotColumn[]  one entry per column: name, type, section offsets/sizes, data checksum
+//   SnapshotSection[] one entry per stored derived array: name, offset, size, checksum
+//   sections          raw column values. String columns store their char buffer (data) and
+//                     uint64 offsets (aux); dictionary columns store their codes (data) and the
+//                     dictionary as uint64 offsets immediately followed by its chars (aux). Then
+//                     the derived arrays: those of the value indexes, zone maps and spatial grid,
+//                     the partition summary (a serialized query::PartitionSummary) and the cells
+//                     of the rollup cube
+//
+// Opening maps the file read-only and points the dataset's columns and indexes into the
+// mapping, so no value is copied or decoded and nothing is rebuilt: open time does not depend
+// on the row count beyond copying the cube's cells. Data checksums are only checked by
+// verify(), which a node can run after it has started serving.
+
+static const char kSnapshotMagic[8] = {'V', 'D', 'S', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t kSnapshotVersion = 5;
+
+enum SnapshotType : uint32_t {
+    SNAPSHOT_INT32 = 1,
+    SNAPSHOT_STRING = 2,
+    SNAPSHOT_INT16 = 3,
+    SNAPSHOT_FLOAT32 = 4,
+    SNAPSHOT_DICT16 = 5,
+};
+
+template <typename Col> struct SnapshotTypeOf;
+template <> struct SnapshotTypeOf<Column<int32_t>> { static constexpr uint32_t value = SNAPSHOT_INT32; };
+template <> struct SnapshotTypeOf<Column<int16_t>> { static constexpr uint32_t value = SNAPSHOT_INT16; };
+template <> struct SnapshotTypeOf<Column<float>> { static constexpr uint32_t value = SNAPSHOT_FLOAT32; };
+template <> struct SnapshotTypeOf<StringColumn> { static constexpr uint32_t value = SNAPSHOT_STRING; };
+template <> struct SnapshotTypeOf<DictColumn<uint16_t>> { static constexpr uint32_t value = SNAPSHOT_DICT16; };
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t columnCount;
+    uint32_t sectionCount;
+    uint32_t reserved;
+    uint64_t rowCount;
+    uint64_t totalRows;         // rows in the whole source file
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t loadedBytes;       // length of the whole rows of the source that were read
+    char partition[32];         // PartitionSpec::id(), e.g. "4,3,3,2#1"
+    uint64_t directoryChecksum; // over the SnapshotColumn then the SnapshotSection array
+    uint64_t headerChecksum;    // over all preceding header bytes
+};
+
+struct SnapshotColumn {
+    char name[40];
+    uint32_t type;
+    uint32_t dictSize;   // dictionary entries of a dictionary-encoded column
+    uint64_t rows;
+    uint64_t dataOffset;
+    uint64_t dataBytes;
+    uint64_t auxOffset;  // unused for fixed-width columns
+    uint64_t auxBytes;
+    uint64_t checksum;   // chained over the column's pieces in file order (see pieces())
+};
+
+// A derived array, named after VectorizedDataSet::forEachIndex() with a suffix per array of the
+// structure (e.g. "index.0.perm", "zones.3", "grid.offsets"), or "summary" and "cube.cells". A
+// structure that was not built when the snapshot was written has no sections.
+struct SnapshotSection {
+    char name[40];
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t checksum;
+};
+
+// What loading a partition yields besides its dataset: the partition's summary and rollup cube,
+// kept in its snapshot along with the dataset's indexes.
+struct PartitionDerived {
+    query::PartitionSummary summary;
+    shared_ptr<const RollupCube> cube;
+};
+
+// Fast non-cryptographic 64-bit checksum (multiply/rotate over 8-byte words).
+inline uint64_t checksum64(const void *data, size_t n, uint64_t h = 0) {
+    const uint64_t k1 = 0x9E3779B97F4A7C15ULL, k2 = 0xC2B2AE3D27D4EB4FULL;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    h ^= n * k1;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h ^= w * k2;
+        h = ((h << 31) | (h >> 33)) * k1;
+    }
+    uint64_t tail = 0;
+    if (n) memcpy(&tail, p, n);
+    h ^= tail * k2;
+    h ^= h >> 33;
+    h *= k2;
+    h ^= h >> 29;
+    return h;
+}
+
+// Identity of the CSV partition a snapshot was built from. A snapshot is only used when all
+// of it matches, so an edited or replaced source file forces a rebuild.
+struct SnapshotSource {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    string partition;
+
+    static bool of(const string &dataFile, const string &partition, SnapshotSource &out) {
+        struct stat st;
+        if (stat(dataFile.c_str(), &st) != 0) return false;
+        out.size = st.st_size;
+        out.mtime = st.st_mtime;
+        out.partition = partition;
+        if (partition.size() >= sizeof(SnapshotHeader::partition)) {
+            // Too long for the header: store a digest instead.
+            char digest[20];
+            snprintf(digest, sizeof(digest), "#%016llx", (unsigned long long)checksum64(partition.data(), partition.size()));
+            out.partition = digest;
+        }
+        return true;
+    }
+};
+
+class DatasetSnapshot {
+public:
+    // Snapshot file used for one partition of a CSV file.
+    static string pathFor(const string &dataFile, const PartitionSpec &spec) {
+        return dataFile + ".part" + to_string(spec.part) + "of" + to_string(spec.weights.size()) + ".snap";
+    }
+
+    static bool write(const VectorizedDataSet &ds, const string &path, const SnapshotSource &source,
+                      size_t totalRows, uint64_t loadedBytes, const PartitionDerived &derived) {
+        using Piece = pair<const void *, size_t>;
+        // The derived arrays, listed first: their directory precedes all sections.
+        vector<pair<string, Piece>> stored;
+        vector<array<int32_t, 2>> ranges;
+        ranges.reserve(VectorizedDataSet::kNumCountColumns);
+        SpatialGrid::Shape shape{};
+        ds.forEachIndex([&](const char *name, const auto &index) {
+            using Index = decay_t<decltype(index)>;
+            if (!index.built()) return;
+            string at = name;
+            if constexpr (is_same_v<Index, ValueIndex>) {
+                ranges.push_back({index.minimum(), index.maximum()});
+                stored.push_back({at + ".range", {ranges.back().data(), sizeof(ranges.back())}});
+                stored.push_back({at + ".prefix", {index.prefixData().data(), index.prefixData().bytes()}});
+                stored.push_back({at + ".perm", {index.permData().data(), index.permData().bytes()}});
+            } else if constexpr (is_same_v<Index, ZoneMap>) {
+                stored.push_back({at, {index.zoneData().data(), index.zoneData().bytes()}});
+            } else {
+                shape = index.shape();
+                stored.push_back({at + ".shape", {&shape, sizeof(shape)}});
+                stored.push_back({at + ".offsets", {index.offsetData().data(), index.offsetData().bytes()}});
+                stored.push_back({at + ".bounds", {index.boundData().data(), index.boundData().bytes()}});
+                stored.push_back({at + ".perm", {index.permData().data(), index.permData().bytes()}});
+                stored.push_back({at + ".lats", {index.latData().data(), index.latData().bytes()}});
+                stored.push_back({at + ".lons", {index.lonData().data(), index.lonData().bytes()}});
+            }
+        });
+        string summary = derived.summary.SerializeAsString();
+        stored.push_back({"summary", {summary.data(), summary.size()}});
+        stored.push_back({"cube.cells", {derived.cube->cells.data(), derived.cube->bytes()}});
+
+        vector<SnapshotColumn> dir;
+        vector<SnapshotSection> derivedDir;
+        vector<vector<Piece>> sections;  // in file order; pieces of a section are contiguous
+        uint64_t offset = align(sizeof(SnapshotHeader) + VectorizedDataSet::kNumColumns * sizeof(SnapshotColumn) +
+                                stored.size() * sizeof(SnapshotSection));
+        auto addSection = [&](vector<Piece> pieces, uint64_t &at, uint64_t &bytes, uint64_t &sum) {
+            at = offset;
+            bytes = 0;
+            for (const auto &piece : pieces) {
+                bytes += piece.second;
+                sum = checksum64(piece.first, piece.second, sum);
+            }
+            sections.push_back(move(pieces));
+            offset = align(offset + bytes);
+        };
+
+        ds.forEachColumn([&](const char *name, const auto &col) {
+            using Col = decay_t<decltype(col)>;
+            SnapshotColumn entry;
+            memset(&entry, 0, sizeof(entry));
+            strncpy(entry.name, name, sizeof(entry.name) - 1);
+            entry.type = SnapshotTypeOf<Col>::value;
+            entry.rows = col.size();
+            uint64_t sum = 0;
+            if constexpr (is_same_v<Col, StringColumn>) {
+                addSection({{col.charData().data(), col.charData().bytes()}}, entry.dataOffset, entry.dataBytes, sum);
+                addSection({{col.offsetData().data(), col.offsetData().bytes()}}, entry.auxOffset, entry.auxBytes, sum);
+            } else if constexpr (is_same_v<Col, DictColumn<uint16_t>>) {
+                const StringColumn &dict = col.dictionary();
+                entry.dictSize = dict.size();
+                addSection({{col.codeData().data(), col.codeData().bytes()}}, entry.dataOffset, entry.dataBytes, sum);
+                addSection({{dict.offsetData().data(), dict.offsetData().bytes()},
+                            {dict.charData().data(), dict.charData().bytes()}}, entry.auxOffset, entry.auxBytes, sum);
+            } else {
+                addSection({{col.data(), col.bytes()}}, entry.dataOffset, entry.dataBytes, sum);
+            }
+            entry.checksum = sum;
+            dir.push_back(entry);
+        });
+        for (const auto &[name, piece] : stored) {
+            SnapshotSection entry;
+            memset(&entry, 0, sizeof(entry));
+            strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+            addSection({piece}, entry.offset, entry.bytes, entry.checksum);
+            derivedDir.push_back(entry);
+        }
+
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+        header.version = kSnapshotVersion;
+        header.columnCount = dir.size();
+        header.sectionCount = derivedDir.size();
+        header.rowCount = ds.size();
+        header.totalRows = totalRows;
+        header.sourceSize = source.size;
+        header.sourceMtime = source.mtime;
+        header.loadedBytes = loadedBytes;
+        strncpy(header.partition, source.partition.c_str(), sizeof(header.partition) - 1);
+        header.directoryChecksum = checksum64(derivedDir.data(), derivedDir.size() * sizeof(SnapshotSection),
+                                              checksum64(dir.data(), dir.size() * sizeof(SnapshotColumn)));
+        header.headerChecksum = checksum64(&header, offsetof(SnapshotHeader, headerChecksum));
+
+        // Write next to the target and rename, so a crash never leaves a torn snapshot behind. The
+        // temporary name is per process, as replicas of a partition may write the same snapshot.
+        string tmp = path + ".tmp." + to_string(getpid());
+        FILE *out = fopen(tmp.c_str(), "wb");
+        if (!out) return false;
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                  fwrite(dir.data(), sizeof(SnapshotColumn), dir.size(), out) == dir.size() &&
+                  fwrite(derivedDir.data(), sizeof(SnapshotSection), derivedDir.size(), out) == derivedDir.size();
+        uint64_t written = sizeof(header) + dir.size() * sizeof(SnapshotColumn) + derivedDir.size() * sizeof(SnapshotSection);
+        static const char zeros[kAlign] = {};
+        for (const auto &section : sections) {
+            if (!ok) break;
+            ok = fwrite(zeros, 1, align(written) - written, out) == align(written) - written;
+            written = align(written);
+            for (const auto &piece : section) {
+                ok = ok && (piece.second == 0 || fwrite(piece.first, 1, piece.second, out) == piece.second);
+                written += piece.second;
+            }
+        }
+        ok = (fclose(out) == 0) && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Map a snapshot and point the (empty) dataset's columns and indexes into it; 'derived' gets
+    // the stored summary and cube. Fails without touching the dataset if the file is missing,
+    // damaged, from another format version, built from another source or partition, or does not
+    // match the dataset's schema.
+    static bool open(VectorizedDataSet &ds, const string &path, const SnapshotSource &source,
+                     size_t *totalRows = nullptr, uint64_t *loadedBytes = nullptr, PartitionDerived *derived = nullptr) {
+        if (ds.size() != 0) return false;
+        auto file = make_shared<MappedFile>(path);
+        const SnapshotHeader *header = validHeader(*file);
+        if (!header) return false;
+        if (header->sourceSize != source.size || header->sourceMtime != source.mtime ||
+            source.partition != header->partition) return false;
+
+        const SnapshotColumn *dir = directory(*file, *header);
+        if (header->columnCount != VectorizedDataSet::kNumColumns) return false;
+        bool ok = true;
+        size_t i = 0;
+        ds.forEachColumn([&](const char *name, const auto &col) {
+            const SnapshotColumn &entry = dir[i++];
+            if (strncmp(entry.name, name, sizeof(entry.name)) != 0 || entry.rows != header->rowCount ||
+                entry.type != SnapshotTypeOf<decay_t<decltype(col)>>::value || !inBounds(*file, entry)) ok = false;
+        });
+        if (!ok) return false;
+
+        SectionTable stored{file->data(), file->size(), sectionDirectory(*file, *header), header->sectionCount};
+        size_t cellCount = 0, summaryBytes = 0;
+        const RollupCube::Cell *cells = stored.find<RollupCube::Cell>("cube.cells", &cellCount);
+        const char *summaryAt = stored.find<char>("summary", &summaryBytes);
+        query::PartitionSummary summary;
+        if (!cells || !summaryAt || !summary.ParseFromArray(summaryAt, int(summaryBytes))) return false;
+        ds.forEachIndex([&](const char *name, auto &index) { ok = ok && viewIndex(index, name, stored, header->rowCount, false); });
+        if (!ok) return false;
+
+        i = 0;
+        const char *base = file->data();
+        ds.forEachColumn([&](const char *, auto &col) {
+            const SnapshotColumn &entry = dir[i++];
+            using Col = decay_t<decltype(col)>;
+            if constexpr (is_same_v<Col, StringColumn>) {
+                col.view(reinterpret_cast<const uint64_t *>(base + entry.auxOffset), entry.rows,
+                         base + entry.dataOffset, entry.dataBytes);
+            } else if constexpr (is_same_v<Col, DictColumn<uint16_t>>) {
+                size_t offsetBytes = (size_t(entry.dictSize) + 1) * sizeof(uint64_t);
+                col.view(reinterpret_cast<const uint16_t *>(base + entry.dataOffset), entry.rows,
+                         reinterpret_cast<const uint64_t *>(base + entry.auxOffset), entry.dictSize,
+                         base + entry.auxOffset + offsetBytes, entry.auxBytes - offsetBytes);
+            } else {
+                col.view(reinterpret_cast<const typename Col::value_type *>(base + entry.dataOffset), entry.rows);
+            }
+        });
+        ds.forEachIndex([&](const char *name, auto &index) { viewIndex(index, name, stored, header->rowCount, true); });
+        if (totalRows) *totalRows = header->totalRows;
+        if (loadedBytes) *loadedBytes = header->loadedBytes;
+        if (derived) {
+            uint64_t version = versionOf(source);
+            summary.set_data_version(version);
+            auto cube = make_shared<RollupCube>(RollupCube::keyedBy(ds, version));
+            cube->cells.assign(cells, cells + cellCount);
+            derived->summary = move(summary);
+            derived->cube = move(cube);
+        }
+        ds.retainBacking(file);
+        return true;
+    }
+
+    // Check every column's and derived array's data checksum. Reads the whole file.
+    static bool verify(const string &path) {
+        MappedFile file(path);
+        const SnapshotHeader *header = validHeader(file);
+        if (!header) return false;
+        const SnapshotColumn *dir = directory(file, *header);
+        for (uint32_t i = 0; i < header->columnCount; i++) {
+            const SnapshotColumn &entry = dir[i];
+            if (!inBounds(file, entry)) return false;
+            uint64_t sum = 0;
+            for (const auto &piece : pieces(entry)) sum = checksum64(file.data() + piece.first, piece.second, sum);
+            if (sum != entry.checksum) return false;
+        }
+        const SnapshotSection *stored = sectionDirectory(file, *header);
+        for (uint32_t i = 0; i < header->sectionCount; i++) {
+            const SnapshotSection &entry = stored[i];
+            if (entry.offset + entry.bytes > file.size() || checksum64(file.data() + entry.offset, entry.bytes) != entry.checksum)
+                return false;
+        }
+        return true;
+    }
+
+    // Open the partition's snapshot if it is current and intact; otherwise load the partition from the CSV
+    // file, compute its summary and cube and write a snapshot for the next start. 'derived' gets
+    // the summary and cube, at versionOf() the source. 'sourceBytes' is set to where the whole
+    // rows the partition was read from end, where a reader of rows appended later starts.
+    static bool loadPartition(VectorizedDataSet &ds, const string &dataFile, const PartitionSpec &spec,
+                              size_t *totalRows, bool *fromSnapshot, PartitionDerived *derived, uint64_t *sourceBytes = nullptr) {
+        SnapshotSource source;
+        string path = pathFor(dataFile, spec);
+        *fromSnapshot = false;
+        if (!spec.valid() || !SnapshotSource::of(dataFile, spec.id(), source)) return false;
+        uint64_t loaded = 0;
+        if (open(ds, path, source, totalRows, &loaded, derived)) {
+            // open() checks only the header and directories; the data is checked before anything
+            // is served from it, and a damaged snapshot is rebuilt from the CSV.
+            if (verify(path)) {
+                if (sourceBytes) *sourceBytes = loaded;
+                *fromSnapshot = true;
+                return true;
+            }
+            cerr << "Snapshot " << path << " failed verification; rebuilding it from " << dataFile << endl;
+            ds = VectorizedDataSet();
+            *derived = PartitionDerived();
+        }
+        size_t total = 0;
+        if (!ds.loadPartition(dataFile, spec, &total, source.size, &loaded)) return false;   // only what stat() saw, so the snapshot matches its source
+        if (totalRows) *totalRows = total;
+        if (sourceBytes) *sourceBytes = loaded;
+        uint64_t version = versionOf(source);
+        derived->summary = PartitionSummaries::of(ds, version);
+        derived->cube = make_shared<const RollupCube>(RollupCube::of(ds, version));
+        if (!write(ds, path, source, total, loaded, *derived)) {
+            cerr << "Could not write snapshot " << path << endl;
+        }
+        return true;
+    }
+
+    // Identity of the data a partition is loaded from (source file size and mtime, partition),
+    // used to key cached results. 0 when the file cannot be read.
+    static uint64_t versionOf(const string &dataFile, const PartitionSpec &spec) {
+        SnapshotSource source;
+        if (!SnapshotSource::of(dataFile, spec.id(), source)) return 0;
+        return versionOf(source);
+    }
+    static uint64_t versionOf(const SnapshotSource &source) {
+        uint64_t h = checksum64(&source.size, sizeof(source.size));
+        h = checksum64(&source.mtime, sizeof(source.mtime), h);
+        return checksum64(source.partition.data(), source.partition.size(), h);
+    }
+
+private:
+    static const size_t kAlign = 64;
+
+    static uint64_t align(uint64_t n) { return (n + kAlign - 1) & ~uint64_t(kAlign - 1); }
+
+    static const SnapshotHeader *validHeader(const MappedFile &file) {
+        if (!file.is_open() || file.size() < sizeof(SnapshotHeader)) return nullptr;
+        const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader *>(file.data());
+        if (memcmp(header->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+            header->version != kSnapshotVersion ||
+            header->headerChecksum != checksum64(header, offsetof(SnapshotHeader, headerChecksum))) return nullptr;
+        size_t dirBytes = header->columnCount * sizeof(SnapshotColumn), sectionBytes = header->sectionCount * sizeof(SnapshotSection);
+        const char *dir = file.data() + sizeof(SnapshotHeader);
+        if (file.size() < sizeof(SnapshotHeader) + dirBytes + sectionBytes ||
+            header->directoryChecksum != checksum64(dir + dirBytes, sectionBytes, checksum64(dir, dirBytes))) return nullptr;
+        return header;
+    }
+
+    static const SnapshotColumn *directory(const MappedFile &file, const SnapshotHeader &) {
+        return reinterpret_cast<const SnapshotColumn *>(file.data() + sizeof(SnapshotHeader));
+    }
+
+    static const SnapshotSection *sectionDirectory(const MappedFile &file, const SnapshotHeader &header) {
+        return reinterpret_cast<const SnapshotSection *>(file.data() + sizeof(SnapshotHeader) + header.columnCount * sizeof(SnapshotColumn));
+    }
+
+    // The derived arrays of a mapped snapshot, by name.
+    struct SectionTable {
+        const char *base;
+        size_t size;
+        const SnapshotSection *dir;
+        uint32_t count;
+
+        // Start of the named array and its length in T, or null when it is missing or malformed.
+        template <typename T>
+        const T *find(const string &name, size_t *n) const {
+            for (uint32_t i = 0; i < count; i++) {
+                const SnapshotSection &entry = dir[i];
+                if (strncmp(entry.name, name.c_str(), sizeof(entry.name)) != 0) continue;
+                if (entry.offset + entry.bytes > size || entry.bytes % sizeof(T) != 0) return nullptr;
+                *n = entry.bytes / sizeof(T);
+                return reinterpret_cast<const T *>(base + entry.offset);
+            }
+            return nullptr;
+        }
+    };
+
+    // Check the stored arrays of one derived structure of a dataset of 'rows' rows and, with
+    // 'apply', point the structure at them. A structure without arrays stays unbuilt.
+    static bool viewIndex(ValueIndex &index, const string &name, const SectionTable &stored, size_t rows, bool apply) {
+        size_t n = 0, prefixes = 0, ids = 0;
+        const int32_t *range = stored.find<int32_t>(name + ".range", &n);
+        if (!range) return true;
+        const uint64_t *prefix = stored.find<uint64_t>(name + ".prefix", &prefixes);
+        const RowId *perm = stored.find<RowId>(name + ".perm", &ids);
+        if (n != 2 || !prefix || !perm || range[0] > range[1] || int64_t(range[1]) - range[0] + 1 > ValueIndex::kMaxDomain ||
+            prefixes != size_t(int64_t(range[1]) - range[0] + 2) || ids != rows) return false;
+        if (apply) index.view(range[0], range[1], prefix, perm, rows);
+        return true;
+    }
+    static bool viewIndex(ZoneMap &zones, const string &name, const SectionTable &stored, size_t rows, bool apply) {
+        size_t n = 0;
+        const ZoneMap::Zone *stats = stored.find<ZoneMap::Zone>(name, &n);
+        if (!stats) return true;
+        if (n != (rows + ScanKernels::kBlockRows - 1) / ScanKernels::kBlockRows) return false;
+        if (apply) zones.view(stats, n);
+        return true;
+    }
+    static bool viewIndex(SpatialGrid &grid, const string &name, const SectionTable &stored, size_t, bool apply) {
+        size_t n = 0, cells = 0, boxes = 0, ids = 0, lats = 0, lons = 0;
+        const SpatialGrid::Shape *shape = stored.find<SpatialGrid::Shape>(name + ".shape", &n);
+        if (!shape) return true;
+        const uint32_t *offsets = stored.find<uint32_t>(name + ".offsets", &cells);
+        const SpatialGrid::Box *bounds = stored.find<SpatialGrid::Box>(name + ".bounds", &boxes);
+        const RowId *perm = stored.find<RowId>(name + ".perm", &ids);
+        const float *lat = stored.find<float>(name + ".lats", &lats), *lon = stored.find<float>(name + ".lons", &lons);
+        if (n != 1 || !offsets || !bounds || !perm || !lat || !lon || shape->rows == 0 || shape->cols == 0 ||
+            shape->rows > SpatialGrid::kMaxSide || shape->cols > SpatialGrid::kMaxSide ||
+            cells != shape->rows * shape->cols + 1 || boxes != cells - 1 || lats != ids || lons != ids || offsets[cells - 1] != ids)
+            return false;
+        if (apply) grid.view(*shape, offsets, bounds, perm, lat, lon, ids);
+        return true;
+    }
+
+    static bool inBounds(const MappedFile &file, const SnapshotColumn &entry) {
+        if (entry.dataOffset + entry.dataBytes > file.size() || entry.auxOffset + entry.auxBytes > file.size()) return false;
+        return entry.type != SNAPSHOT_DICT16 || (size_t(entry.dictSize) + 1) * sizeof(uint64_t) <= entry.auxBytes;
+    }
+
+    // (offset, bytes) of the pieces a column's checksum covers, in the order they were written.
+    static vector<pair<uint64_t, uint64_t>> pieces(const SnapshotColumn &entry) {
+        vector<pair<uint64_t, uint64_t>> out = {{entry.dataOffset, entry.dataBytes}};
+        if (entry.type == SNAPSHOT_STRING) {
+            out.push_back({entry.auxOffset, entry.auxBytes});
+        } else if (entry.type == SNAPSHOT_DICT16) {
+            uint64_t offsetBytes = (uint64_t(entry.dictSize) + 1) * sizeof(uint64_t);
+            out.push_back({entry.auxOffset, offsetBytes});
+            out.push_back({entry.auxOffset + offsetBytes, entry.auxBytes - offsetBytes});
+        }
+        return out;
+    }
+};
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef SPATIAL_INDEX_H
+#define SPATIAL_INDEX_H
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <omp.h>
+#include "scan_kernels.h"
+#include "column.h"
+
+using namespace std;
+
+// Uniform grid over the latitude/longitude of a partition's rows. The grid spans the central
+// 99.8% of the points in each axis, with about kRowsPerCell rows per cell; points outside it
+// (and stray coordinates such as 0, 0) fall into the border cells. The row ids and their
+// coordinates are stored grouped by cell, ascending within a cell, so a box or radius query reads
+// only the cells it overlaps, each one contiguous. Each cell keeps the bounding box of its points:
+// the rows of a cell whose box the query covers are taken as they are, those of the cells on the
+// query's edge are tested one by one. Rows without coordinates are not indexed.
+class SpatialGrid {
+public:
+    static const size_t kRowsPerCell = 64;
+    static const size_t kMaxSide = 4096;   // cells per axis
+    static constexpr double kEarthRadiusMeters = 6371008.8;
+
+    // Inclusive box in degrees.
+    struct Box {
+        double minLat, minLon, maxLat, maxLon;
+
+        bool contains(double lat, double lon) const { return lat >= minLat && lat <= maxLat && lon >= minLon && lon <= maxLon; }
+        bool covers(const Box &b) const { return b.minLat >= minLat && b.maxLat <= maxLat && b.minLon >= minLon && b.maxLon <= maxLon; }
+    };
+
+    // Points within 'meters' of (lat, lon) by great-circle distance. The haversine term of a
+    // point is compared with that of the radius, so no row needs an inverse sine.
+    struct Circle {
+        double lat = 0, lon = 0, meters = 0;
+        double cosLat = 1, limit = 0;
+
+        static Circle around(double lat, double lon, double meters) {
+            Circle c;
+            c.lat = lat;
+            c.lon = lon;
+            c.meters = meters;
+            c.cosLat = cos(radians(lat));
+            double s = sin(min(meters / kEarthRadiusMeters, M_PI) / 2);
+            c.limit = s * s;
+            return c;
+        }
+
+        bool contains(double la, double lo) const {
+            double sLat = sin(radians(la - lat) / 2), sLon = sin(radians(lo - lon) / 2);
+            return sLat * sLat + cosLat * cos(radians(la)) * sLon * sLon <= limit;
+        }
+
+        // Smallest box around the circle, widened by a rounding error (longitudes are not wrapped
+        // at the antimeridian).
+        Box bounds() const {
+            double dLat = degrees(meters / kEarthRadiusMeters) * (1 + 1e-9) + 1e-9;
+            double s = sin(min(meters / kEarthRadiusMeters, M_PI / 2));
+            double dLon = s < cosLat ? degrees(asin(s / cosLat)) * (1 + 1e-9) + 1e-9 : 180;
+            return {lat - dLat, lon - dLon, lat + dLat, lon + dLon};
+        }
+
+        // Whether every point of the box is inside. The farthest point of a box from the centre
+        // is one of its corners unless the box holds the antipode, which it cannot when its
+        // corners are less than a radian away.
+        bool covers(const Box &b) const {
+            return meters < kEarthRadiusMeters && contains(b.minLat, b.minLon) && contains(b.minLat, b.maxLon) &&
+                   contains(b.maxLat, b.minLon) && contains(b.maxLat, b.maxLon);
+        }
+    };
+
+    bool built() const { return !offsets.empty(); }
+    size_t bytes() const {
+        return offsets.size() * sizeof(uint32_t) + bounds.size() * sizeof(Box) + perm.size() * (sizeof(RowId) + 2 * sizeof(float));
+    }
+
+    // Build from n coordinates, NaN where missing.
+    void build(const float *lat, const float *lon, size_t n) {
+        offsets.clear();
+        bounds.clear();
+        perm.clear();
+        lats.clear();
+        lons.clear();
+        vector<float> las, los;
+        for (size_t i = 0; i < n; i++) {
+            if (lat[i] == lat[i] && lon[i] == lon[i]) {
+                las.push_back(lat[i]);
+                los.push_back(lon[i]);
+            }
+        }
+        if (las.empty()) return;
+        auto trimmed = [](vector<float> &v, double &lo, double &hi) {
+            size_t k = v.size() / 1000;
+            nth_element(v.begin(), v.begin() + k, v.end());
+            lo = v[k];
+            nth_element(v.begin(), v.end() - 1 - k, v.end());
+            hi = v[v.size() - 1 - k];
+        };
+        trimmed(las, lat0, lat1);
+        trimmed(los, lon0, lon1);
+        size_t cells = max<size_t>(1, las.size() / kRowsPerCell);
+        double h = lat1 - lat0, w = (lon1 - lon0) * cos(radians((lat0 + lat1) / 2));
+        double aspect = h > 0 && w > 0 ? w / h : 1;
+        rowsN = clamp<size_t>(size_t(llround(sqrt(cells / aspect))), 1, kMaxSide);
+        colsN = clamp<size_t>(cells / rowsN, 1, kMaxSide);
+        if (!(h > 0)) rowsN = 1;
+        if (!(lon1 > lon0)) colsN = 1;
+
+        // Counting sort of the row ids by cell; a sequential pass keeps row order within a cell.
+        vector<uint32_t> cellOf(n, UINT32_MAX);
+        offsets.resize(rowsN * colsN + 1);
+        #pragma omp parallel for
+        for (size_t i = 0; i < n; i++)
+            if (lat[i] == lat[i] && lon[i] == lon[i]) cellOf[i] = uint32_t(cellRow(lat[i]) * colsN + cellCol(lon[i]));
+        for (size_t i = 0; i < n; i++)
+            if (cellOf[i] != UINT32_MAX) offsets[cellOf[i] + 1]++;
+        for (size_t c = 0; c < rowsN * colsN; c++) offsets[c + 1] += offsets[c];
+        perm.grow(offsets.back());
+        lats.grow(offsets.back());
+        lons.grow(offsets.back());
+        vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; i++) {
+            if (cellOf[i] == UINT32_MAX) continue;
+            uint32_t at = next[cellOf[i]]++;
+            perm[at] = RowId(i);
+            lats[at] = lat[i];
+            lons[at] = lon[i];
+        }
+        const double inf = numeric_limits<double>::infinity();
+        bounds.grow(rowsN * colsN);
+        fill(bounds.data(), bounds.data() + bounds.size(), Box{inf, inf, -inf, -inf});
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (size_t c = 0; c < rowsN * colsN; c++) {
+            Box &b = bounds[c];
+            for (uint32_t i = offsets[c]; i < offsets[c + 1]; i++) {
+                b.minLat = min<double>(b.minLat, lats[i]);
+                b.maxLat = max<double>(b.maxLat, lats[i]);
+                b.minLon = min<double>(b.minLon, lons[i]);
+                b.maxLon = max<double>(b.maxLon, lons[i]);
+            }
+        }
+    }
+
+    // Rows in the cells overlapping 'b': an upper bound on the rows any query inside b matches.
+    size_t candidates(const Box &b) const {
+        size_t n = 0;
+        forCells(b, [&](size_t c) { n += offsets[c + 1] - offsets[c]; });
+        return n;
+    }
+
+    // Ascending ids of the rows within the box or circle.
+    vector<RowId> rows(const Box &b) const { return collect(b, b); }
+    vector<RowId> rows(const Circle &c) const { return collect(c.bounds(), c); }
+
+    // Placement of the cells, stored by the snapshot along with the arrays below.
+    struct Shape {
+        double lat0, lat1, lon0, lon1;
+        uint64_t rows, cols;
+    };
+    Shape shape() const { return {lat0, lat1, lon0, lon1, rowsN, colsN}; }
+    const Column<uint32_t> &offsetData() const { return offsets; }
+    const Column<Box> &boundData() const { return bounds; }
+    const Column<RowId> &permData() const { return perm; }
+    const Column<float> &latData() const { return lats; }
+    const Column<float> &lonData() const { return lons; }
+
+    // View a grid of the given shape over n points stored elsewhere (they must outlive the grid).
+    void view(const Shape &s, const uint32_t *cellOffsets, const Box *cellBounds, const RowId *rows,
+              const float *rowLats, const float *rowLons, size_t n) {
+        lat0 = s.lat0;
+        lat1 = s.lat1;
+        lon0 = s.lon0;
+        lon1 = s.lon1;
+        rowsN = s.rows;
+        colsN = s.cols;
+        offsets.view(cellOffsets, rowsN * colsN + 1);
+        bounds.view(cellBounds, rowsN * colsN);
+        perm.view(rows, n);
+        lats.view(rowLats, n);
+        lons.view(rowLons, n);
+    }
+
+private:
+    static double radians(double d) { return d * (M_PI / 180); }
+    static double degrees(double r) { return r * (180 / M_PI); }
+
+    size_t cellRow(double lat) const {
+        double f = (lat - lat0) / (lat1 - lat0) * rowsN;
+        return rowsN == 1 || !(f > 0) ? 0 : min(size_t(f), rowsN - 1);
+    }
+    size_t cellCol(double lon) const {
+        double f = (lon - lon0) / (lon1 - lon0) * colsN;
+        return colsN == 1 || !(f > 0) ? 0 : min(size_t(f), colsN - 1);
+    }
+
+    template <typename F>
+    void forCells(const Box &b, F &&f) const {
+        if (!built() || b.minLat > b.maxLat || b.minLon > b.maxLon) return;
+        for (size_t r = cellRow(b.minLat); r <= cellRow(b.maxLat); r++)
+            for (size_t c = cellCol(b.minLon); c <= cellCol(b.maxLon); c++) f(r * colsN + c);
+    }
+
+    template <typename Shape>
+    vector<RowId> collect(const Box &area, const Shape &shape) const {
+        vector<RowId> out;
+        forCells(area, [&](size_t cell) {
+            uint32_t b = offsets[cell], e = offsets[cell + 1];
+            if (b == e) return;
+            if (shape.covers(bounds[cell])) {
+                out.insert(out.end(), perm.begin() + b, perm.begin() + e);
+                return;
+            }
+            for (uint32_t i = b; i < e; i++)
+                if (shape.contains(lats[i], lons[i])) out.push_back(perm[i]);
+        });
+        sort(out.begin(), out.end());
+        return out;
+    }
+
+    double lat0 = 0, lat1 = 0, lon0 = 0, lon1 = 0;
+    size_t rowsN = 1, colsN = 1;
+    Column<uint32_t> offsets;   // offsets[c] = first position in perm of cell c (row-major)
+    Column<Box> bounds;         // of the points in each cell
+    Column<RowId> perm;         // row ids grouped by cell
+    Column<float> lats, lons;   // their coordinates, in the same order
+};
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <grpcpp/grpcpp.h>
+#include "query.pb.h"
+
+using namespace std;
+
+// Timed phase of a query on one node, fixed-size so the ring never allocates.
+struct Span {
+    uint64_t traceId = 0;
+    uint64_t startUs = 0;
+    uint64_t durationUs = 0;
+    char node[16] = {};
+    char phase[16] = {};
+    char detail[32] = {};
+
+    static void copyName(char *to, size_t size, string_view from) {
+        size_t n = min(size - 1, from.size());
+        memcpy(to, from.data(), n);
+        to[n] = 0;
+    }
+
+    static Span of(uint64_t traceId, const query::TraceSpan &s) {
+        Span out;
+        out.traceId = traceId;
+        out.startUs = s.start_us();
+        out.durationUs = s.duration_us();
+        copyName(out.node, sizeof(out.node), s.node());
+        copyName(out.phase, sizeof(out.phase), s.phase());
+        copyName(out.detail, sizeof(out.detail), s.detail());
+        return out;
+    }
+};
+
+// Fixed-capacity multi-producer ring of spans. record() claims a slot with one atomic increment
+// and publishes it with a per-slot sequence number, so recording never locks or blocks; a reader
+// that falls more than kCapacity spans behind loses the oldest ones.
+class TraceRing {
+public:
+    static const size_t kCapacity = 1 << 14;
+
+    void record(const Span &s) {
+        uint64_t ticket = head.fetch_add(1, memory_order_relaxed);
+        Slot &slot = slots[ticket & (kCapacity - 1)];
+        slot.seq.store(2 * ticket + 1, memory_order_relaxed);   // odd: being written
+        atomic_thread_fence(memory_order_release);
+        slot.span = s;
+        slot.seq.store(2 * ticket + 2, memory_order_release);
+    }
+
+    // Append the spans recorded since 'cursor' to out and advance it. Returns the number lost to
+    // overwriting. Spans still being written are left for the next call.
+    size_t drain(uint64_t &cursor, vector<Span> &out) const {
+        uint64_t end = head.load(memory_order_acquire);
+        size_t lost = 0;
+        if (end - cursor > kCapacity) {
+            lost = end - cursor - kCapacity;
+            cursor = end - kCapacity;
+        }
+        for (; cursor < end; cursor++) {
+            const Slot &slot = slots[cursor & (kCapacity - 1)];
+            uint64_t seq = slot.seq.load(memory_order_acquire);
+            if (seq < 2 * cursor + 2) break;   // not published yet
+            Span copy = slot.span;
+            atomic_thread_fence(memory_order_acquire);
+            if (seq != 2 * cursor + 2 || slot.seq.load(memory_order_relaxed) != seq) {
+                lost++;   // overwritten by a later lap
+                continue;
+            }
+            out.push_back(copy);
+        }
+        return lost;
+    }
+
+private:
+    struct Slot {
+        atomic<uint64_t> seq{0};
+        Span span;
+    };
+
+    atomic<uint64_t> head{0};
+    Slot slots[kCapacity];
+};
+
+// Trace ids and clocks shared by the nodes. The id travels as hex in the "x-trace-id" metadata.
+class Tracing {
+public:
+    static constexpr const char *kMetadataKey = "x-trace-id";
+
+    static uint64_t nowUs() {
+        return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static uint64_t newId() {
+        thread_local mt19937_64 rng(random_device{}() ^ hash<thread::id>()(this_thread::get_id()));
+        uint64_t id;
+        do id = rng(); while (id == 0);
+        return id;
+    }
+
+    // The caller's trace id, or 0 when it sent none.
+    static uint64_t idOf(const grpc::ServerContextBase &ctx) {
+        auto it = ctx.client_metadata().find(kMetadataKey);
+        if (it == ctx.client_metadata().end()) return 0;
+        string hex(it->second.data(), it->second.size());
+        return strtoull(hex.c_str(), nullptr, 16);
+    }
+
+    static void propagate(grpc::ClientContext &ctx, uint64_t id) {
+        if (id == 0) return;
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)id);
+        ctx.AddMetadata(kMetadataKey, hex);
+    }
+};
+
+// Spans of one query at one node and those its children returned. Shared by the query's parts;
+// every span is also recorded in the node's ring. Children's spans go to the ring as well when
+// 'keepChildren' is set (the entry node), so its export shows the whole tree.
+class QueryTrace {
+public:
+    QueryTrace(TraceRing &ring, string node, uint64_t id, bool keepChildren)
+        : ring(ring), node(std::move(node)), traceId(id), keepChildren(keepChildren) {}
+
+    uint64_t id() const { return traceId; }
+
+    void span(const char *phase, uint64_t startUs, uint64_t endUs, string_view detail = {}) {
+        query::TraceSpan s;
+        s.set_node(node);
+        s.set_phase(phase);
+        s.set_start_us(startUs);
+        s.set_duration_us(endUs > startUs ? endUs - startUs : 0);
+        if (!detail.empty()) s.set_detail(string(detail));
+        ring.record(Span::of(traceId, s));
+        lock_guard<mutex> lock(m);
+        spans.push_back(std::move(s));
+    }
+
+    // Spans a child returned with its reply.
+    void adopt(const google::protobuf::RepeatedPtrField<query::TraceSpan> &from) {
+        if (keepChildren)
+            for (const auto &s : from) ring.record(Span::of(traceId, s));
+        lock_guard<mutex> lock(m);
+        spans.insert(spans.end(), from.begin(), from.end());
+    }
+
+    void moveTo(google::protobuf::RepeatedPtrField<query::TraceSpan> *out) {
+        lock_guard<mutex> lock(m);
+        for (auto &s : spans) *out->Add() = std::move(s);
+        spans.clear();
+    }
+
+private:
+    TraceRing &ring;
+    const string node;
+    const uint64_t traceId;
+    const bool keepChildren;
+    mutex m;
+    vector<query::TraceSpan> spans;
+};
+
+// Appends the spans of a ring to a file in the Chrome trace event format (chrome://tracing or
+// Perfetto), from a background thread. Each node is a process and each trace a thread row. The
+// file is a JSON array left open at the end, which the format allows, so it can grow while read.
+class ChromeTraceExporter {
+public:
+    ChromeTraceExporter(const TraceRing &ring, const string &path, chrono::milliseconds every = chrono::milliseconds(500))
+        : ring(ring), out(fopen(path.c_str(), "w")) {
+        if (!out) return;
+        fputs("[\n", out);
+        worker = thread([this, every] {
+            unique_lock<mutex> lock(m);
+            while (!stopping) {
+                wake.wait_for(lock, every, [this] { return stopping; });
+                flush();
+            }
+        });
+    }
+    ChromeTraceExporter(const ChromeTraceExporter &) = delete;
+    ChromeTraceExporter &operator=(const ChromeTraceExporter &) = delete;
+
+    ~ChromeTraceExporter() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable()) worker.join();
+        if (out) fclose(out);
+    }
+
+    bool ok() const { return out != nullptr; }
+
+private:
+    void flush() {
+        vector<Span> spans;
+        size_t lost = ring.drain(cursor, spans);
+        for (const Span &s : spans) {
+            auto it = pids.find(s.node);
+            if (it == pids.end()) {
+                it = pids.emplace(s.node, int(pids.size()) + 1).first;
+                fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n", it->second, s.node);
+            }
+            fprintf(out, "{\"name\":\"%s\",\"cat\":\"query\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%u,"
+                         "\"args\":{\"trace\":\"%016llx\",\"detail\":\"%s\"}},\n",
+                    s.phase, (unsigned long long)s.startUs, (unsigned long long)s.durationUs, it->second,
+                    unsigned(s.traceId % 100000), (unsigned long long)s.traceId, s.detail);
+        }
+        if (lost) fprintf(out, "{\"name\":\"spans lost\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%llu,\"pid\":0,\"args\":{\"count\":%zu}},\n",
+                          (unsigned long long)Tracing::nowUs(), lost);
+        fflush(out);
+    }
+
+    const TraceRing &ring;
+    FILE *out;
+    uint64_t cursor = 0;
+    unordered_map<string, int> pids;
+    mutex m;
+    condition_variable wake;
+    thread worker;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef VALUE_INDEX_H
+#define VALUE_INDEX_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <omp.h>
+#include "scan_kernels.h"
+#include "column.h"
+
+using namespace std;
+
+// Index over an int32 column with a narrow value range, such as the number_of_* counts. A
+// histogram with prefix sums answers range counts in O(1), and a permutation of the row ids
+// grouped by value (ascending row order within each value) lists the rows of a range without a
+// scan. Columns whose values span more than kMaxDomain are not indexed.
+class ValueIndex {
+public:
+    static const int64_t kMaxDomain = 1 << 16;
+
+    bool built() const { return !prefix.empty(); }
+    size_t bytes() const { return prefix.size() * sizeof(uint64_t) + perm.size() * sizeof(RowId); }
+
+    // Build from n values; false (and no index) when the range is too wide.
+    bool build(const int32_t *v, size_t n) {
+        prefix.clear();
+        perm.clear();
+        if (n == 0) return false;
+        int32_t lo = INT32_MAX, hi = INT32_MIN;
+        #pragma omp parallel for reduction(min:lo) reduction(max:hi)
+        for (size_t i = 0; i < n; i++) {
+            lo = min(lo, v[i]);
+            hi = max(hi, v[i]);
+        }
+        if (int64_t(hi) - lo + 1 > kMaxDomain) return false;
+        minValue = lo;
+        maxValue = hi;
+        size_t domain = size_t(int64_t(hi) - lo + 1);
+
+        // Stable counting sort: each thread takes a contiguous slice of rows, so offsets computed
+        // per (thread, value) keep row order within a value.
+        int threads = omp_get_max_threads();
+        vector<vector<uint64_t>> counts(threads, vector<uint64_t>(domain, 0));
+        vector<size_t> sliceAt(threads + 1);
+        for (int t = 0; t <= threads; t++) sliceAt[t] = n * t / threads;
+        #pragma omp parallel for schedule(static, 1)
+        for (int t = 0; t < threads; t++) {
+            uint64_t *c = counts[t].data();
+            for (size_t i = sliceAt[t]; i < sliceAt[t + 1]; i++) c[v[i] - lo]++;
+        }
+        prefix.resize(domain + 1);
+        for (size_t d = 0; d < domain; d++) {
+            uint64_t at = prefix[d];
+            for (int t = 0; t < threads; t++) {
+                uint64_t c = counts[t][d];
+                counts[t][d] = at;   // becomes this thread's first slot for value d
+                at += c;
+            }
+            prefix[d + 1] = at;
+        }
+        perm.grow(n);
+        #pragma omp parallel for schedule(static, 1)
+        for (int t = 0; t < threads; t++) {
+            uint64_t *next = counts[t].data();
+            for (size_t i = sliceAt[t]; i < sliceAt[t + 1]; i++) perm[next[v[i] - lo]++] = RowId(i);
+        }
+        return true;
+    }
+
+    // Rows with lo <= value <= hi.
+    size_t count(int32_t lo, int32_t hi) const {
+        auto [b, e] = span(lo, hi);
+        return e - b;
+    }
+
+    // Ascending ids of the rows with lo <= value <= hi.
+    vector<RowId> rows(int32_t lo, int32_t hi) const {
+        auto [b, e] = span(lo, hi);
+        vector<RowId> out(perm.begin() + b, perm.begin() + e);
+        if (e > b && valueAt(b) != valueAt(e - 1)) sort(out.begin(), out.end());
+        return out;
+    }
+
+    // Raw storage and value range, used by the snapshot writer.
+    const Column<uint64_t> &prefixData() const { return prefix; }
+    const Column<RowId> &permData() const { return perm; }
+    int32_t minimum() const { return minValue; }
+    int32_t maximum() const { return maxValue; }
+
+    // View an index over [lo, hi] of n rows stored elsewhere (it must outlive the index).
+    void view(int32_t lo, int32_t hi, const uint64_t *prefixes, const RowId *rows, size_t n) {
+        minValue = lo;
+        maxValue = hi;
+        prefix.view(prefixes, size_t(int64_t(hi) - lo + 2));
+        perm.view(rows, n);
+    }
+
+private:
+    // Positions [b, e) in perm holding the values in [lo, hi].
+    pair<size_t, size_t> span(int32_t lo, int32_t hi) const {
+        lo = max(lo, minValue);
+        hi = min(hi, maxValue);
+        if (lo > hi) return {0, 0};
+        return {prefix[lo - minValue], prefix[size_t(int64_t(hi) - minValue) + 1]};
+    }
+
+    // Value of the row at position p of perm.
+    int32_t valueAt(size_t p) const {
+        return minValue + int32_t(upper_bound(prefix.begin(), prefix.end(), p) - prefix.begin() - 1);
+    }
+
+    int32_t minValue = 0, maxValue = -1;
+    Column<uint64_t> prefix;   // prefix[d] = rows with value < minValue + d
+    Column<RowId> perm;        // row ids grouped by value
+};
+
+#endif
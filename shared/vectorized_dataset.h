@@ -3,189 +3,678 @@
 
 #include <vector>
 #include <string>
-#include <sstream>
-#include <fstream>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <algorithm>
 #include <omp.h>
 #include <iostream>
+#include <memory>
+#include <variant>
+#include <type_traits>
+#include <limits>
+#include <climits>
+#include <cstdio>
+#include "mapped_file.h"
+#include "csv_tokenizer.h"
+#include "column.h"
+#include "scan_kernels.h"
+#include "value_index.h"
+#include "zone_map.h"
+#include "spatial_index.h"
 
 using namespace std;
 
+// A column of any of the dataset's column types, or monostate when there is no such column.
+using ColumnRef = variant<monostate, const Column<int32_t> *, const Column<int16_t> *, const Column<float> *,
+                          const DictColumn<uint16_t> *, const StringColumn *>;
+
+// Which rows of the data file a node owns: share 'part' of a split into weights.size() shares.
+// By default (ROWS) shares are contiguous row ranges in order, sized in proportion to their
+// weights, so a stronger machine can take more. Keyed on a column instead, a row goes to the share
+// its value hashes to (HASH, weighted the same way) or to the range of 'bounds' the value falls in
+// (RANGE), so each node holds a distinct set of key values and parents can skip whole subtrees.
+struct PartitionSpec {
+    enum Method { ROWS, HASH, RANGE };
+
+    vector<uint32_t> weights;
+    size_t part = 0;
+    Method method = ROWS;
+    string column;           // key column (dataset column name) for HASH and RANGE
+    vector<string> bounds;   // RANGE: ascending split points; share i holds bounds[i-1] <= key < bounds[i]
+
+    static PartitionSpec equal(size_t parts, size_t part) {
+        PartitionSpec s;
+        s.weights.assign(parts, 1);
+        s.part = part;
+        return s;
+    }
+
+    bool valid() const {
+        uint64_t sum = 0;
+        for (uint32_t w : weights) sum += w;
+        if (part >= weights.size() || sum == 0) return false;
+        if (method == RANGE) return !column.empty() && bounds.size() + 1 == weights.size();
+        return weights[part] > 0 && (method == ROWS || !column.empty());
+    }
+
+    // Rows [start, stop) of 'total' (ROWS).
+    pair<size_t, size_t> rows(size_t total) const {
+        uint64_t sum = 0, before = 0;
+        for (size_t i = 0; i < weights.size(); i++) {
+            if (i < part) before += weights[i];
+            sum += weights[i];
+        }
+        auto at = [&](uint64_t w) { return size_t((unsigned __int128)total * w / sum); };
+        return {at(before), at(before + weights[part])};
+    }
+
+    // Share a key hash belongs to (HASH).
+    size_t shareOfHash(uint64_t h) const {
+        uint64_t sum = 0;
+        for (uint32_t w : weights) sum += w;
+        uint64_t at = h % sum;
+        size_t i = 0;
+        while (at >= weights[i]) at -= weights[i++];
+        return i;
+    }
+
+    // Stable text form, e.g. "4,3,3,2#1", "hash:borough:4,3,3,2#1" or "range:crash_date:2016-01-01,2019-01-01#1".
+    string id() const {
+        string s;
+        if (method == RANGE) {
+            s = "range:" + column + ":";
+            for (size_t i = 0; i < bounds.size(); i++) s += (i ? "," : "") + bounds[i];
+            return s + "#" + to_string(part);
+        }
+        if (method == HASH) s = "hash:" + column + ":";
+        for (size_t i = 0; i < weights.size(); i++) s += (i ? "," : "") + to_string(weights[i]);
+        return s + "#" + to_string(part);
+    }
+};
+
 class VectorizedDataSet {
 public:
-    vector<string> crash_date;
-    vector<string> crash_time;
-    vector<string> borough;
-    vector<string> zip_code;
-    vector<string> latitude;
-    vector<string> longitude;
-    vector<string> location;
-    vector<string> on_street_name;
-    vector<string> cross_street_name;
-    vector<string> off_street_name;
-    vector<int> number_of_persons_injured;
-    vector<int> number_of_persons_killed;
-    vector<int> number_of_pedestrians_injured;
-    vector<int> number_of_pedestrians_killed;
-    vector<int> number_of_cyclist_injured;
-    vector<int> number_of_cyclist_killed;
-    vector<int> number_of_motorist_injured;
-    vector<int> number_of_motorist_killed;
-    vector<string> contributing_factor_vehicle_1;
-    vector<string> contributing_factor_vehicle_2;
-    vector<string> contributing_factor_vehicle_3;
-    vector<string> contributing_factor_vehicle_4;
-    vector<string> contributing_factor_vehicle_5;
-    vector<string> collision_id;
-    vector<string> vehicle_type_code_1;
-    vector<string> vehicle_type_code_2;
-    vector<string> vehicle_type_code_3;
-    vector<string> vehicle_type_code_4;
-    vector<string> vehicle_type_code_5;
+    Column<int32_t> crash_date;        // days since 1970-01-01, kNullDate when missing
+    Column<int16_t> crash_time;        // minutes since midnight, kNullTime when missing
+    DictColumn<uint16_t> borough;
+    DictColumn<uint16_t> zip_code;
+    Column<float> latitude;            // NaN when missing
+    Column<float> longitude;           // NaN when missing
+    StringColumn location;
+    StringColumn on_street_name;
+    StringColumn cross_street_name;
+    StringColumn off_street_name;
+    Column<int> number_of_persons_injured;
+    Column<int> number_of_persons_killed;
+    Column<int> number_of_pedestrians_injured;
+    Column<int> number_of_pedestrians_killed;
+    Column<int> number_of_cyclist_injured;
+    Column<int> number_of_cyclist_killed;
+    Column<int> number_of_motorist_injured;
+    Column<int> number_of_motorist_killed;
+    DictColumn<uint16_t> contributing_factor_vehicle_1;
+    DictColumn<uint16_t> contributing_factor_vehicle_2;
+    DictColumn<uint16_t> contributing_factor_vehicle_3;
+    DictColumn<uint16_t> contributing_factor_vehicle_4;
+    DictColumn<uint16_t> contributing_factor_vehicle_5;
+    StringColumn collision_id;
+    DictColumn<uint16_t> vehicle_type_code_1;
+    DictColumn<uint16_t> vehicle_type_code_2;
+    DictColumn<uint16_t> vehicle_type_code_3;
+    DictColumn<uint16_t> vehicle_type_code_4;
+    DictColumn<uint16_t> vehicle_type_code_5;
+
+    static const size_t kNumColumns = 29;
+    static const size_t kNumStringColumns = 5;
+    static const size_t kNumDictColumns = 12;
+    static const size_t kNumCountColumns = 8;    // number_of_* columns, which carry value indexes
+    static const size_t kNumZoneColumns = 12;    // numeric columns, which carry zone maps
+    // An index lookup beats a scan when it returns fewer than 1 / kIndexSelectivity of the rows.
+    static const size_t kIndexSelectivity = 16;
+    static const int32_t kNullDate = INT32_MIN;
+    static const int16_t kNullTime = -1;
+
+    // Malformed CSV input met by the loads into this dataset: rows without kNumColumns fields, and
+    // non-empty date, time or numeric fields that do not parse. Such rows still load, with the
+    // fields they have; a field that does not parse keeps what did, or is missing. Also the values
+    // of dictionary columns past their DictColumn::kMaxEntries distinct values, which load missing.
+    struct CsvErrors {
+        size_t rows = 0;
+        size_t fields = 0;
+        size_t overflowed = 0;
+    };
+    CsvErrors csvErrors;
+
+    size_t size() const { return number_of_persons_injured.size(); }
+
+    // Call f(name, column) for every column in CSV order.
+    template <typename F>
+    void forEachColumn(F &&f) { visitColumns(*this, f); }
+    template <typename F>
+    void forEachColumn(F &&f) const { visitColumns(*this, f); }
+
+    // Column by its name as passed to forEachColumn (e.g. "borough").
+    ColumnRef column(string_view name) const {
+        ColumnRef ref;
+        forEachColumn([&](const char *n, const auto &col) {
+            if (name == n) ref = &col;
+        });
+        return ref;
+    }
+
+    // Keep a mapping alive for columns that view into it (see snapshot.h).
+    void retainBacking(shared_ptr<const MappedFile> mapping) { backing.push_back(move(mapping)); }
+
+    // Days since 1970-01-01 for a proleptic Gregorian date.
+    static int32_t daysFromCivil(int y, unsigned m, unsigned d) {
+        y -= m <= 2;
+        const int era = (y >= 0 ? y : y - 399) / 400;
+        const unsigned yoe = unsigned(y - era * 400);
+        const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+        const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + int32_t(doe) - 719468;
+    }
+
+    // Parse "MM/DD/YYYY" (the collision export) or "YYYY-MM-DD", ignoring anything after the date.
+    static int32_t parseDate(string_view s) {
+        int y = 0, m = 0, d = 0;
+        auto num = [&](size_t at, size_t len, int &out) {
+            return s.size() >= at + len && from_chars(s.data() + at, s.data() + at + len, out).ec == errc();
+        };
+        bool ok = s.size() >= 10 && s[2] == '/' && s[5] == '/' ? num(0, 2, m) && num(3, 2, d) && num(6, 4, y)
+                : s.size() >= 10 && s[4] == '-' && s[7] == '-' ? num(0, 4, y) && num(5, 2, m) && num(8, 2, d)
+                : false;
+        if (!ok || m < 1 || m > 12 || d < 1 || d > 31) return kNullDate;
+        return daysFromCivil(y, m, d);
+    }
+
+    // Format days since 1970-01-01 as "YYYY-MM-DD".
+    static string formatDate(int32_t days) {
+        if (days == kNullDate) return "";
+        days += 719468;
+        const int era = (days >= 0 ? days : days - 146096) / 146097;
+        const unsigned doe = unsigned(days - era * 146097);
+        const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        const unsigned mp = (5 * doy + 2) / 153;
+        const unsigned d = doy - (153 * mp + 2) / 5 + 1;
+        const unsigned m = mp < 10 ? mp + 3 : mp - 9;
+        int y = int(yoe) + era * 400 + (m <= 2);
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%04d-%02u-%02u", y, m, d);
+        return buf;
+    }
+
+    // Parse "H:MM" or "HH:MM" into minutes since midnight.
+    static int16_t parseTime(string_view s) {
+        size_t colon = s.find(':');
+        int h = 0, m = 0;
+        if (colon == string_view::npos ||
+            from_chars(s.data(), s.data() + colon, h).ec != errc() ||
+            from_chars(s.data() + colon + 1, s.data() + s.size(), m).ec != errc() ||
+            h < 0 || h > 23 || m < 0 || m > 59) return kNullTime;
+        return int16_t(h * 60 + m);
+    }
 
     // Count the number of lines (excluding header) in the CSV file.
     static size_t countLines(const string &filename) {
-        ifstream file(filename);
+        MappedFile file(filename);
         if (!file.is_open()) return 0;
-        string line;
-        size_t count = 0;
-        // Skip header
-        if(getline(file, line)) { }
-        while(getline(file, line)) {
-            count++;
-        }
-        return count;
+        const char *end = file.data() + file.size();
+        const char *body = CsvTokenizer::rowEnd(file.data(), end);
+        size_t total = 0;
+        for (const auto &chunk : splitChunks(body, end)) total += chunk.rows;
+        return total;
     }
 
     // Load only a subset of lines from the file.
     // start: starting line index (0-based, after header) and count: number of lines to load.
     bool loadFromFileRange(const string &filename, size_t start, size_t count) {
-        ifstream file(filename);
+        MappedFile file(filename);
         if (!file.is_open()) return false;
+        const char *end = file.data() + file.size();
+        const char *body = CsvTokenizer::rowEnd(file.data(), end);
+        loadRows(splitChunks(body, end), start, count);
+        return true;
+    }
+
+    // Load the rows 'spec' assigns to this node from the whole rows among the first 'bytes' of the
+    // file; 'loadedBytes' is set to where they end. A last row without its newline may still be
+    // being written, so it is left to the reader of appended rows. The file is mapped once: the
+    // row count needed to place the partition comes from the same mapping.
+    bool loadPartition(const string &filename, const PartitionSpec &spec, size_t *totalRows = nullptr, size_t bytes = SIZE_MAX,
+                       uint64_t *loadedBytes = nullptr) {
+        MappedFile file(filename);
+        if (!file.is_open() || !spec.valid()) return false;
+        const char *end = file.data() + min(file.size(), bytes);
+        const char *body = CsvTokenizer::rowEnd(file.data(), end);
+
+        vector<ByteChunk> chunks = splitChunks(body, end);
+        if (!chunks.empty()) {
+            // Only the last chunk can end inside a row, and it starts at one.
+            ByteChunk &last = chunks.back();
+            const char *whole = CsvTokenizer::lastRowEnd(last.begin, last.end);
+            if (whole != last.end) {
+                last.end = whole;
+                last.rows--;
+                if (last.rows == 0) chunks.pop_back();
+            }
+            end = whole;
+        }
+        if (loadedBytes) *loadedBytes = uint64_t(max(end, body) - file.data());
+        size_t total = chunks.empty() ? 0 : chunks.back().firstRow + chunks.back().rows;
+        if (totalRows) *totalRows = total;
+        if (spec.method == PartitionSpec::ROWS) {
+            auto [start, stop] = spec.rows(total);
+            loadRows(chunks, start, stop - start);
+        } else {
+            vector<uint8_t> keep;
+            if (!ownedRows(chunks, spec, keep)) return false;
+            loadRows(chunks, 0, total, &keep);
+        }
+        return true;
+    }
 
-        string header;
-        if (!getline(file, header)) return false;
-
-        // Skip lines until 'start'
-        string line;
-        for (size_t i = 0; i < start && getline(file, line); i++) { }
-        
-        size_t linesRead = 0;
-        #pragma omp parallel
-        {
-            #pragma omp single nowait
-            {
-                while (linesRead < count && getline(file, line)) {
-                    // Copy the line into a local variable for the task.
-                    string localLine = line;
-                    #pragma omp task firstprivate(localLine)
-                    {
-                        istringstream ss(localLine);
-                        string token;
-                        string cdate, ctime, brgh, zc, lat, lon, loc, on_str, cross_str, off_str;
-                        int npi = 0, npk = 0, npi2 = 0, npk2 = 0, nci = 0, nck = 0, nmi = 0, nmk = 0;
-                        string cfv1, cfv2, cfv3, cfv4, cfv5, cid;
-                        string vtc1, vtc2, vtc3, vtc4, vtc5;
-
-                        if(getline(ss, token, ',')) cdate = token;
-                        if(getline(ss, token, ',')) ctime = token;
-                        if(getline(ss, token, ',')) brgh = token;
-                        if(getline(ss, token, ',')) zc = token;
-                        if(getline(ss, token, ',')) lat = token;
-                        if(getline(ss, token, ',')) lon = token;
-                        if(getline(ss, token, ',')) loc = token;
-                        if(getline(ss, token, ',')) on_str = token;
-                        if(getline(ss, token, ',')) cross_str = token;
-                        if(getline(ss, token, ',')) off_str = token;
-                        if(getline(ss, token, ',')) { try { npi = stoi(token); } catch(...) {} }
-                        if(getline(ss, token, ',')) { try { npk = stoi(token); } catch(...) {} }
-                        if(getline(ss, token, ',')) { try { npi2 = stoi(token); } catch(...) {} }
-                        if(getline(ss, token, ',')) { try { npk2 = stoi(token); } catch(...) {} }
-                        if(getline(ss, token, ',')) { try { nci = stoi(token); } catch(...) {} }
-                        if(getline(ss, token, ',')) { try { nck = stoi(token); } catch(...) {} }
-                        if(getline(ss, token, ',')) { try { nmi = stoi(token); } catch(...) {} }
-                        if(getline(ss, token, ',')) { try { nmk = stoi(token); } catch(...) {} }
-                        if(getline(ss, token, ',')) cfv1 = token;
-                        if(getline(ss, token, ',')) cfv2 = token;
-                        if(getline(ss, token, ',')) cfv3 = token;
-                        if(getline(ss, token, ',')) cfv4 = token;
-                        if(getline(ss, token, ',')) cfv5 = token;
-                        if(getline(ss, token, ',')) cid = token;
-                        if(getline(ss, token, ',')) vtc1 = token;
-                        if(getline(ss, token, ',')) vtc2 = token;
-                        if(getline(ss, token, ',')) vtc3 = token;
-                        if(getline(ss, token, ',')) vtc4 = token;
-                        if(getline(ss, token, ',')) vtc5 = token;
-                        
-                        #pragma omp critical
-                        {
-                            crash_date.push_back(cdate);
-                            crash_time.push_back(ctime);
-                            borough.push_back(brgh);
-                            zip_code.push_back(zc);
-                            latitude.push_back(lat);
-                            longitude.push_back(lon);
-                            location.push_back(loc);
-                            on_street_name.push_back(on_str);
-                            cross_street_name.push_back(cross_str);
-                            off_street_name.push_back(off_str);
-                            number_of_persons_injured.push_back(npi);
-                            number_of_persons_killed.push_back(npk);
-                            number_of_pedestrians_injured.push_back(npi2);
-                            number_of_pedestrians_killed.push_back(npk2);
-                            number_of_cyclist_injured.push_back(nci);
-                            number_of_cyclist_killed.push_back(nck);
-                            number_of_motorist_injured.push_back(nmi);
-                            number_of_motorist_killed.push_back(nmk);
-                            contributing_factor_vehicle_1.push_back(cfv1);
-                            contributing_factor_vehicle_2.push_back(cfv2);
-                            contributing_factor_vehicle_3.push_back(cfv3);
-                            contributing_factor_vehicle_4.push_back(cfv4);
-                            contributing_factor_vehicle_5.push_back(cfv5);
-                            collision_id.push_back(cid);
-                            vehicle_type_code_1.push_back(vtc1);
-                            vehicle_type_code_2.push_back(vtc2);
-                            vehicle_type_code_3.push_back(vtc3);
-                            vehicle_type_code_4.push_back(vtc4);
-                            vehicle_type_code_5.push_back(vtc5);
-                        }
-                    } // end task
-                    linesRead++;
-                } // end while
-            } // end single
-            #pragma omp taskwait
+    // Load the rows among [begin, end), whole lines appended to the data file after it was loaded,
+    // that 'spec' assigns to this node. Under ROWS they extend the last share; HASH and RANGE place
+    // them by key like the rest of the file.
+    bool loadAppended(const char *begin, const char *end, const PartitionSpec &spec) {
+        vector<ByteChunk> chunks = splitChunks(begin, end);
+        size_t total = chunks.empty() ? 0 : chunks.back().firstRow + chunks.back().rows;
+        if (spec.method == PartitionSpec::ROWS) {
+            if (spec.part + 1 == spec.weights.size()) loadRows(chunks, 0, total);
+            return true;
         }
-        file.close();
+        vector<uint8_t> keep;
+        if (!ownedRows(chunks, spec, keep)) return false;
+        loadRows(chunks, 0, total, &keep);
         return true;
     }
 
-    // Search using parallel for with OpenMP; returns indices of records matching the condition.
-    vector<size_t> searchByInjuryCountParallel(int minInjured) const {
-        vector<size_t> indices;
-        size_t n = number_of_persons_injured.size();
-        #pragma omp parallel
-        {
-            vector<size_t> localIndices;
-            #pragma omp for nowait
-            for (size_t i = 0; i < n; i++) {
-                if (number_of_persons_injured[i] >= minInjured)
-                    localIndices.push_back(i);
+    // (Re)build the value indexes of the number_of_* columns, the zone maps of all numeric
+    // columns and the spatial grid. Loaders call this once the columns are filled.
+    void buildIndexes() {
+        const Column<int> *cols[kNumCountColumns];
+        countColumns(cols);
+        for (size_t i = 0; i < kNumCountColumns; i++) countIndexes[i].build(cols[i]->data(), cols[i]->size());
+
+        auto never = [](auto) { return false; };
+        zones[0].build(crash_date.data(), crash_date.size(), [](int32_t v) { return v == kNullDate; });
+        zones[1].build(crash_time.data(), crash_time.size(), [](int16_t v) { return v < 0; });
+        zones[2].build(latitude.data(), latitude.size(), [](float v) { return v != v; });
+        zones[3].build(longitude.data(), longitude.size(), [](float v) { return v != v; });
+        for (size_t i = 0; i < kNumCountColumns; i++) zones[4 + i].build(cols[i]->data(), cols[i]->size(), never);
+        grid.build(latitude.data(), longitude.data(), size());
+    }
+
+    // Visit the structures buildIndexes() derives as f(name, structure), so a snapshot can store
+    // and view them: "index.<i>" per number_of_* column, "zones.<i>" per numeric column (in the
+    // orders below), then "grid".
+    template <typename F>
+    void forEachIndex(F &&f) { visitIndexes(*this, f); }
+    template <typename F>
+    void forEachIndex(F &&f) const { visitIndexes(*this, f); }
+
+    // Grid over latitude/longitude, or null when no row has coordinates.
+    const SpatialGrid *spatialIndex() const { return grid.built() ? &grid : nullptr; }
+
+    // Value index of the number_of_* column whose values are at 'values', or null.
+    const ValueIndex *indexFor(const int32_t *values) const {
+        const Column<int> *cols[kNumCountColumns];
+        countColumns(cols);
+        for (size_t i = 0; i < kNumCountColumns; i++) {
+            if (cols[i]->data() == values && countIndexes[i].built()) return &countIndexes[i];
+        }
+        return nullptr;
+    }
+
+    // Zone map of the numeric column whose values are at 'values', or null.
+    const ZoneMap *zonesFor(const void *values) const {
+        const Column<int> *cols[kNumCountColumns];
+        countColumns(cols);
+        const void *all[kNumZoneColumns] = {crash_date.data(), crash_time.data(), latitude.data(), longitude.data()};
+        for (size_t i = 0; i < kNumCountColumns; i++) all[4 + i] = cols[i]->data();
+        for (size_t i = 0; i < kNumZoneColumns; i++) {
+            if (all[i] == values && zones[i].built()) return &zones[i];
+        }
+        return nullptr;
+    }
+
+    // Blocks of an int32 column a scan for lo <= v <= hi must visit: from its zone map, or all of them.
+    vector<BlockRef> blockPlan(const int32_t *values, int32_t lo, int32_t hi) const {
+        if (const ZoneMap *z = zonesFor(values)) return z->plan(lo, hi);
+        return ScanKernels::allBlocks(size());
+    }
+
+    // Ascending indices of records with at least minInjured persons injured. Selective thresholds
+    // are read from the value index; broad ones are cheaper to scan with the vectorized kernels,
+    // over the blocks the zone map cannot rule out.
+    vector<RowId> searchByInjuryCountParallel(int minInjured) const {
+        const ValueIndex *index = indexFor(number_of_persons_injured.data());
+        if (index && index->count(minInjured, INT32_MAX) * kIndexSelectivity < size()) return index->rows(minInjured, INT32_MAX);
+        return ScanKernels::indicesInRange(number_of_persons_injured.data(), size(), minInjured, INT32_MAX,
+                                           blockPlan(number_of_persons_injured.data(), minInjured, INT32_MAX));
+    }
+
+    // Number of records with at least minInjured persons injured, from the histogram when available.
+    size_t countByInjuryCount(int minInjured) const {
+        if (const ValueIndex *index = indexFor(number_of_persons_injured.data())) return index->count(minInjured, INT32_MAX);
+        return ScanKernels::countInRange(number_of_persons_injured.data(), size(), minInjured, INT32_MAX,
+                                         blockPlan(number_of_persons_injured.data(), minInjured, INT32_MAX));
+    }
+
+    // Bitmap of records with at least minInjured persons injured.
+    SelectionBitmap selectByInjuryCount(int minInjured) const {
+        return ScanKernels::selectInRange(number_of_persons_injured.data(), size(), minInjured, INT32_MAX,
+                                          blockPlan(number_of_persons_injured.data(), minInjured, INT32_MAX));
+    }
+
+    static int get_num_threads_used() { return int(ScanPool::shared().size()); }
+
+private:
+    vector<shared_ptr<const MappedFile>> backing;
+    ValueIndex countIndexes[kNumCountColumns];   // one per number_of_* column, in column order
+    ZoneMap zones[kNumZoneColumns];              // crash_date, crash_time, latitude, longitude, then number_of_*
+    SpatialGrid grid;
+
+    void countColumns(const Column<int> *(&cols)[kNumCountColumns]) const {
+        const Column<int> *all[kNumCountColumns] = {
+            &number_of_persons_injured, &number_of_persons_killed, &number_of_pedestrians_injured,
+            &number_of_pedestrians_killed, &number_of_cyclist_injured, &number_of_cyclist_killed,
+            &number_of_motorist_injured, &number_of_motorist_killed};
+        copy(begin(all), end(all), cols);
+    }
+
+    template <typename Self, typename F>
+    static void visitIndexes(Self &self, F &f) {
+        for (size_t i = 0; i < kNumCountColumns; i++) f(("index." + to_string(i)).c_str(), self.countIndexes[i]);
+        for (size_t i = 0; i < kNumZoneColumns; i++) f(("zones." + to_string(i)).c_str(), self.zones[i]);
+        f("grid", self.grid);
+    }
+
+    template <typename Self, typename F>
+    static void visitColumns(Self &self, F &f) {
+        f("crash_date", self.crash_date);
+        f("crash_time", self.crash_time);
+        f("borough", self.borough);
+        f("zip_code", self.zip_code);
+        f("latitude", self.latitude);
+        f("longitude", self.longitude);
+        f("location", self.location);
+        f("on_street_name", self.on_street_name);
+        f("cross_street_name", self.cross_street_name);
+        f("off_street_name", self.off_street_name);
+        f("number_of_persons_injured", self.number_of_persons_injured);
+        f("number_of_persons_killed", self.number_of_persons_killed);
+        f("number_of_pedestrians_injured", self.number_of_pedestrians_injured);
+        f("number_of_pedestrians_killed", self.number_of_pedestrians_killed);
+        f("number_of_cyclist_injured", self.number_of_cyclist_injured);
+        f("number_of_cyclist_killed", self.number_of_cyclist_killed);
+        f("number_of_motorist_injured", self.number_of_motorist_injured);
+        f("number_of_motorist_killed", self.number_of_motorist_killed);
+        f("contributing_factor_vehicle_1", self.contributing_factor_vehicle_1);
+        f("contributing_factor_vehicle_2", self.contributing_factor_vehicle_2);
+        f("contributing_factor_vehicle_3", self.contributing_factor_vehicle_3);
+        f("contributing_factor_vehicle_4", self.contributing_factor_vehicle_4);
+        f("contributing_factor_vehicle_5", self.contributing_factor_vehicle_5);
+        f("collision_id", self.collision_id);
+        f("vehicle_type_code_1", self.vehicle_type_code_1);
+        f("vehicle_type_code_2", self.vehicle_type_code_2);
+        f("vehicle_type_code_3", self.vehicle_type_code_3);
+        f("vehicle_type_code_4", self.vehicle_type_code_4);
+        f("vehicle_type_code_5", self.vehicle_type_code_5);
+    }
+
+    // A byte range of whole rows of the mapped file and the number of rows.
+    struct ByteChunk {
+        const char *begin;
+        const char *end;
+        size_t rows;
+        size_t firstRow;
+    };
+
+    // Split [begin, end) into chunks that start at rows, count their rows in parallel and number
+    // them. A cut is moved to the next row end outside quotes; whether the cut itself falls inside
+    // quotes follows from the parity of the quotes before it, counted per piece in parallel.
+    static vector<ByteChunk> splitChunks(const char *begin, const char *end) {
+        size_t bytes = end - begin;
+        size_t chunkBytes = max<size_t>(1 << 20, bytes / (omp_get_max_threads() * 8) + 1);
+        size_t pieces = max<size_t>(1, (bytes + chunkBytes - 1) / chunkBytes);
+        vector<const char *> cuts(pieces + 1);
+        for (size_t i = 0; i < pieces; i++) cuts[i] = begin + i * chunkBytes;
+        cuts[pieces] = end;
+        vector<uint8_t> odd(pieces);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < pieces; i++) odd[i] = CsvTokenizer::oddQuotes(cuts[i], cuts[i + 1]);
+        vector<uint8_t> quoted(pieces, 0);   // whether cuts[i] is inside quotes
+        for (size_t i = 1; i < pieces; i++) quoted[i] = quoted[i - 1] ^ odd[i - 1];
+        // Start from the byte before the cut, so a cut right after a row end stays put.
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 1; i < pieces; i++)
+            cuts[i] = CsvTokenizer::nextRowAt(cuts[i] - 1, end, quoted[i] ^ (cuts[i][-1] == '"'));
+
+        vector<ByteChunk> chunks;
+        for (size_t i = 0; i < pieces; i++) {
+            const char *p = chunks.empty() ? begin : chunks.back().end;
+            const char *q = max(cuts[i + 1], p);   // a row longer than a piece spans several cuts
+            if (q > p) chunks.push_back({p, q, 0, 0});
+        }
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < chunks.size(); i++) {
+            chunks[i].rows = CsvTokenizer::countRows(chunks[i].begin, chunks[i].end);
+        }
+        size_t row = 0;
+        for (auto &chunk : chunks) {
+            chunk.firstRow = row;
+            row += chunk.rows;
+        }
+        return chunks;
+    }
+
+    // Chunk-local columns for the variable-length columns, in CSV order.
+    struct ChunkColumns {
+        StringColumn strings[kNumStringColumns];
+        DictColumn<uint16_t> dicts[kNumDictColumns];
+        CsvErrors errors;
+        string scratch;   // unescaped quoted fields of the current row
+    };
+
+    // Append rows [start, start + count) of the chunked file, or only those of them with keep[row]
+    // set. Fixed-width columns are sized up front and written in place; each chunk packs its
+    // strings and dictionary codes into chunk-local columns that are then appended in chunk order.
+    // Rows keep file order and no locking is needed.
+    void loadRows(const vector<ByteChunk> &chunks, size_t start, size_t count, const vector<uint8_t> *keep = nullptr) {
+        size_t total = chunks.empty() ? 0 : chunks.back().firstRow + chunks.back().rows;
+        if (start >= total) return;
+        count = min(count, total - start);
+        size_t stop = start + count;
+
+        // First slot each chunk writes, after the rows it loads are counted.
+        vector<size_t> slotAt(chunks.size() + 1, 0);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < chunks.size(); i++) {
+            size_t b = max(start, chunks[i].firstRow), e = min(stop, chunks[i].firstRow + chunks[i].rows);
+            size_t n = 0;
+            if (keep) for (size_t r = b; r < e; r++) n += (*keep)[r];
+            else if (e > b) n = e - b;
+            slotAt[i + 1] = n;
+        }
+        for (size_t i = 0; i < chunks.size(); i++) slotAt[i + 1] += slotAt[i];
+
+        size_t base = size();
+        forEachColumn([&](const char *, auto &col) {
+            // Sized without writing, then zeroed block by block by the scan worker that will read
+            // the block, so its pages land on that worker's NUMA node. Empty fields keep the zeros.
+            if constexpr (is_fixed_width<decay_t<decltype(col)>>) {
+                col.grow(base + slotAt.back());
+                ScanPool::shared().firstTouch(col.data(), base, col.size(), ScanKernels::kBlockRows);
             }
-            #pragma omp critical
-            {
-                indices.insert(indices.end(), localIndices.begin(), localIndices.end());
+        });
+
+        vector<ChunkColumns> local(chunks.size());
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const ByteChunk &chunk = chunks[i];
+            if (slotAt[i + 1] == slotAt[i]) continue;
+            size_t row = chunk.firstRow, slot = base + slotAt[i];
+            // Size the chunk-local columns once: codes and offsets exactly, and characters for about
+            // an eighth of each line per string column (they regrow if a chunk needs more).
+            size_t rows = slotAt[i + 1] - slotAt[i], lineBytes = (chunk.end - chunk.begin) / max<size_t>(chunk.rows, 1);
+            for (auto &col : local[i].strings) col.reserve(rows, rows * lineBytes / 8);
+            for (auto &col : local[i].dicts) col.reserve(rows);
+            const char *p = chunk.begin;
+            for (; row < start; row++) p = CsvTokenizer::rowEnd(p, chunk.end);
+            for (; p < chunk.end && row < stop; row++) {
+                if (!keep || (*keep)[row]) p = parseRow(slot++, p, chunk.end, local[i]);
+                else p = CsvTokenizer::rowEnd(p, chunk.end);
             }
         }
-        return indices;
+        for (const auto &l : local) {
+            csvErrors.rows += l.errors.rows;
+            csvErrors.fields += l.errors.fields;
+        }
+
+        size_t s = 0, d = 0;
+        forEachColumn([&](const char *, auto &col) {
+            using Col = decay_t<decltype(col)>;
+            if constexpr (is_same_v<Col, StringColumn>) {
+                vector<StringColumn> parts(local.size());
+                for (size_t i = 0; i < local.size(); i++) parts[i] = move(local[i].strings[s]);
+                col.append(parts);
+                s++;
+            } else if constexpr (is_same_v<Col, DictColumn<uint16_t>>) {
+                vector<DictColumn<uint16_t>> parts(local.size());
+                for (size_t i = 0; i < local.size(); i++) parts[i] = move(local[i].dicts[d]);
+                size_t before = col.overflowed();
+                col.append(parts);
+                csvErrors.overflowed += col.overflowed() - before;
+                d++;
+            }
+        });
+        buildIndexes();
+    }
+
+    // How a partition key is read from its CSV field.
+    enum class KeyKind { DATE, TIME, NUMBER, TEXT };
+
+    // FNV-1a: stable across builds, so every node places a key the same way.
+    static uint64_t hashBytes(string_view s) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (unsigned char c : s) h = (h ^ c) * 0x100000001b3ULL;
+        return h;
     }
 
-    static int get_num_threads_used() {
-        int num_threads = 0;
-        #pragma omp parallel
-        {
-            #pragma omp single
-            num_threads = omp_get_num_threads();
+    // Mix a 64-bit value so that consecutive keys spread over the shares.
+    static uint64_t mix64(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        return h ^ (h >> 33);
+    }
+
+    static double numericKey(KeyKind kind, string_view field) {
+        if (kind == KeyKind::DATE) return parseDate(field);
+        if (kind == KeyKind::TIME) return parseTime(field);
+        double v = numeric_limits<double>::quiet_NaN();
+        parseNumber(field, v);
+        return v;
+    }
+
+    // keep[row] = 1 for every row of the file that a HASH or RANGE spec assigns to spec.part. Only
+    // the fields up to the key of each row are split. False when the key column does not exist.
+    bool ownedRows(const vector<ByteChunk> &chunks, const PartitionSpec &spec, vector<uint8_t> &keep) const {
+        size_t field = 0, at = 0;
+        KeyKind kind = KeyKind::TEXT;
+        bool found = false;
+        forEachColumn([&](const char *name, const auto &col) {
+            if (!found && spec.column == name) {
+                found = true;
+                field = at;
+                using Col = decay_t<decltype(col)>;
+                kind = spec.column == "crash_date" ? KeyKind::DATE
+                     : spec.column == "crash_time" ? KeyKind::TIME
+                     : is_fixed_width<Col> ? KeyKind::NUMBER : KeyKind::TEXT;
+            }
+            at++;
+        });
+        if (!found) return false;
+        vector<double> numericBounds;
+        if (kind != KeyKind::TEXT)
+            for (const auto &b : spec.bounds) numericBounds.push_back(numericKey(kind, b));
+
+        size_t total = chunks.empty() ? 0 : chunks.back().firstRow + chunks.back().rows;
+        keep.assign(total, 0);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < chunks.size(); i++) {
+            size_t row = chunks[i].firstRow;
+            string_view f[kNumColumns];
+            string scratch;
+            for (const char *p = chunks[i].begin; p < chunks[i].end; row++) {
+                size_t n;
+                const char *next = CsvTokenizer::row(p, chunks[i].end, f, field + 1, n, scratch);
+                string_view value = field < n ? f[field] : string_view();
+                size_t share;
+                if (kind == KeyKind::TEXT) {
+                    share = spec.method == PartitionSpec::HASH
+                          ? spec.shareOfHash(mix64(hashBytes(value)))
+                          : size_t(upper_bound(spec.bounds.begin(), spec.bounds.end(), value,
+                                               [](string_view v, const string &b) { return v < b; }) - spec.bounds.begin());
+                } else {
+                    double v = numericKey(kind, value);
+                    if (v == 0) v = 0;   // one hash for -0 and 0
+                    uint64_t bits;
+                    memcpy(&bits, &v, sizeof(bits));
+                    share = spec.method == PartitionSpec::HASH
+                          ? spec.shareOfHash(mix64(bits))
+                          : size_t(upper_bound(numericBounds.begin(), numericBounds.end(), v) - numericBounds.begin());
+                }
+                keep[row] = share == spec.part;
+                p = next;
+            }
         }
-        return num_threads;
+        return true;
+    }
+
+    // False when a non-empty field is not entirely a number; out keeps what parsed, if anything.
+    template <typename T>
+    static bool parseNumber(string_view field, T &out) {
+        while (!field.empty() && field.front() == ' ') field.remove_prefix(1);
+        if (field.empty()) return true;
+        auto [end, ec] = from_chars(field.data(), field.data() + field.size(), out);
+        return ec == errc() && end == field.data() + field.size();
+    }
+
+    // Parse the CSV row at p in place and return the start of the next one: fixed-width values go
+    // to row slot r, strings and dictionary values are appended to the chunk's local columns, and
+    // malformed rows and fields are counted in local.errors.
+    const char *parseRow(size_t r, const char *p, const char *end, ChunkColumns &local) {
+        string_view f[kNumColumns];
+        size_t n;
+        const char *next = CsvTokenizer::row(p, end, f, kNumColumns, n, local.scratch);
+        CsvErrors &errors = local.errors;
+        errors.rows += n != kNumColumns;
+        crash_date[r] = parseDate(f[0]);
+        crash_time[r] = parseTime(f[1]);
+        errors.fields += (crash_date[r] == kNullDate && !f[0].empty()) + (crash_time[r] == kNullTime && !f[1].empty());
+        local.dicts[0].push_back(f[2]);
+        local.dicts[1].push_back(f[3]);
+        latitude[r] = longitude[r] = numeric_limits<float>::quiet_NaN();
+        errors.fields += !parseNumber(f[4], latitude[r]) + !parseNumber(f[5], longitude[r]);
+        for (size_t i = 6; i < 10; i++) local.strings[i - 6].push_back(f[i]);
+        errors.fields += !parseNumber(f[10], number_of_persons_injured[r]);
+        errors.fields += !parseNumber(f[11], number_of_persons_killed[r]);
+        errors.fields += !parseNumber(f[12], number_of_pedestrians_injured[r]);
+        errors.fields += !parseNumber(f[13], number_of_pedestrians_killed[r]);
+        errors.fields += !parseNumber(f[14], number_of_cyclist_injured[r]);
+        errors.fields += !parseNumber(f[15], number_of_cyclist_killed[r]);
+        errors.fields += !parseNumber(f[16], number_of_motorist_injured[r]);
+        errors.fields += !parseNumber(f[17], number_of_motorist_killed[r]);
+        for (size_t i = 18; i < 23; i++) local.dicts[i - 16].push_back(f[i]);
+        local.strings[4].push_back(f[23]);
+        for (size_t i = 24; i < kNumColumns; i++) local.dicts[i - 17].push_back(f[i]);
+        return next;
     }
 };
 
@@ -0,0 +1,85 @@
+#ifndef ZONE_MAP_H
+#define ZONE_MAP_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <omp.h>
+#include "scan_kernels.h"
+#include "column.h"
+
+using namespace std;
+
+// Min, max and null count of a numeric column per block of ScanKernels::kBlockRows rows. A range
+// scan visits only the blocks whose range overlaps the predicate, and takes the blocks that lie
+// entirely inside it without testing their rows. Most useful when the data is sorted or clustered
+// on the column, e.g. crash_date in a range-partitioned or time-ordered file.
+class ZoneMap {
+public:
+    enum Match { NONE, SOME, ALL };
+
+    struct Zone {
+        double min, max;   // over the non-null values; min > max when there are none
+        uint32_t nulls;
+        uint32_t rows;
+    };
+
+    bool built() const { return ready; }
+    size_t blocks() const { return zones.size(); }
+    const Zone &operator[](size_t b) const { return zones[b]; }
+
+    // Build from n values; isNull(v) tells the column's missing-value marker.
+    template <typename T, typename IsNull>
+    void build(const T *v, size_t n, IsNull isNull) {
+        ready = true;
+        zones.clear();
+        zones.resize((n + ScanKernels::kBlockRows - 1) / ScanKernels::kBlockRows);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t b = 0; b < zones.size(); b++) {
+            size_t begin = b * ScanKernels::kBlockRows, end = min(n, begin + ScanKernels::kBlockRows);
+            double lo = numeric_limits<double>::infinity(), hi = -lo;
+            uint32_t nulls = 0;
+            for (size_t i = begin; i < end; i++) {
+                if (isNull(v[i])) {
+                    nulls++;
+                    continue;
+                }
+                lo = min(lo, double(v[i]));
+                hi = max(hi, double(v[i]));
+            }
+            zones[b] = Zone{lo, hi, nulls, uint32_t(end - begin)};
+        }
+    }
+
+    // How the non-null rows of block b relate to lo <= v <= hi. Null rows never match.
+    Match match(size_t b, double lo, double hi) const {
+        const Zone &z = zones[b];
+        if (z.nulls == z.rows || hi < z.min || lo > z.max) return NONE;
+        if (z.nulls == 0 && lo <= z.min && z.max <= hi) return ALL;
+        return SOME;
+    }
+
+    // The blocks a scan for lo <= v <= hi must visit.
+    vector<BlockRef> plan(double lo, double hi) const {
+        vector<BlockRef> out;
+        for (size_t b = 0; b < zones.size(); b++) {
+            Match m = match(b, lo, hi);
+            if (m != NONE) out.push_back({uint32_t(b), m == ALL});
+        }
+        return out;
+    }
+
+    // Raw storage, used by the snapshot writer, and a view of zones stored elsewhere.
+    const Column<Zone> &zoneData() const { return zones; }
+    void view(const Zone *stored, size_t n) {
+        zones.view(stored, n);
+        ready = true;
+    }
+
+private:
+    Column<Zone> zones;
+    bool ready = false;
+};
+
+#endif
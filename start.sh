@@ -7,9 +7,20 @@ chmod +x ./generate_proto.sh
 python3 -m grpc_tools.protoc -I=proto \
     --python_out=clients \
     --grpc_python_out=clients \
-    proto/data.proto
+    proto/query.proto proto/data.proto
 
 rm -rf build
 mkdir build && cd build
 cmake ..
-make -j
\ No newline at end of file
+make -j
+# Start the overlay from the build directory (one process per node in config/overlay_config.json):
+#   ./overlay_node D & ./overlay_node E & ./overlay_node B & ./overlay_node C & ./overlay_node A
+# Pass a config path as the second argument to partition by column instead, e.g. by crash date:
+#   ./overlay_node B ../config/overlay_config_by_date.json
+# With overlay_config_replicas.json, D2 and E2 also serve D's and E's partitions; B and C hedge to
+# them when D or E is slow and fail over when either is down:
+#   ./overlay_node D2 ../config/overlay_config_replicas.json
+# Benchmarks (from the build directory): a synthetic five-node run and the in-process kernels,
+# saved as a baseline and compared with a later build:
+#   ./overlay_bench run --rows 1000000 --mode open --qps 200 --save run.json
+#   ./overlay_bench micro ../data/dataset.csv --baseline micro.json